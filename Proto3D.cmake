@@ -14,6 +14,10 @@ OPTION(PROTO3D_GLM
   "Include GLM headers and enable code using it" OFF)
 OPTION(PROTO3D_STB_IMAGE
   "Compile stb_image.c and allow code using it" ON)
+OPTION(PROTO3D_RESOURCE_REGISTRY
+  "Track live OpenGL objects and their memory for fast leak checks" ON)
+OPTION(PROTO3D_PROFILER
+  "Record PROTO3D_PROFILE_SCOPE() events for Chrome trace output" OFF)
 
 list(APPEND PROTO3D_INCLUDE_DIRS ${CMAKE_CURRENT_SOURCE_DIR})
 
@@ -26,6 +30,14 @@ if(PROTO3D_EXCEPTIONS)
   list(APPEND PROTO3D_DEFINITIONS -DPROTO3D_USE_EXCEPTIONS)
 endif()
 
+if(PROTO3D_RESOURCE_REGISTRY)
+  list(APPEND PROTO3D_DEFINITIONS -DPROTO3D_USE_RESOURCE_REGISTRY)
+endif()
+
+if(PROTO3D_PROFILER)
+  list(APPEND PROTO3D_DEFINITIONS -DPROTO3D_USE_PROFILER)
+endif()
+
 # Use pkg-config to find some libraries
 include(FindPkgConfig)
 
@@ -26,6 +26,8 @@ class Scene {
   VAO vao;
   VBO vbo;
   Texture2D texture;
+  SamplerCache samplers;
+  TextureUnits units;
 
   void CompileShaders(const std::string &base_relative_path) {
     char shader_source[4096];
@@ -59,11 +61,11 @@ class Scene {
     shaders[0].Delete();
     shaders[1].Delete();
 
-    bool valid;
-    auto validation_log = program.ValidationLog(&valid).get();
-    if (!valid) {
+    char validation_log_buffer[1024];
+    InfoLog validation_log(validation_log_buffer, sizeof(validation_log_buffer));
+    if (!program.Validate(&validation_log)) {
       puts("Shader program is invalid.");
-      puts(validation_log);
+      puts(validation_log.data);
     }
   }
 
@@ -96,7 +98,6 @@ class Scene {
     // Load the texture into the triangle
     auto image = stb::Image::CreateFromFile((base_relative_path + "/hazard.png").c_str());
 
-    glActiveTexture(GL_TEXTURE0);
     program.SetUniform("tex", 0);
 
     // connect the uv coords to the "vertTexCoord" attribute of the vertex
@@ -104,15 +105,21 @@ class Scene {
     vao.AddArray(program.AttribLocation("vertTexCoord"), vbo, uv_ptr_format);
     texture.Gen();
     texture.Bind();
-    texture.SetFilterAndWrap(GL_LINEAR_MIPMAP_LINEAR, GL_CLAMP_TO_EDGE);
-    texture.LoadImage(image.get());
+    texture.LoadImageStorage(image.get());
     texture.GenerateMipmaps();
+
+    // Trilinear filtering from a sampler shared by every texture sampled the
+    // same way, instead of per-texture parameters
+    SamplerDesc trilinear;
+    trilinear.wrap_s = trilinear.wrap_t = GL_CLAMP_TO_EDGE;
+    units.Set(0, texture, samplers.Get(trilinear));
   }
 
   void RenderFrame() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     vao.Bind();
     program.Bind();
+    units.Commit();
     glDrawArrays(GL_TRIANGLES, 0, 3);
     gl_swap_buffers(main_window);
   }
@@ -126,6 +133,7 @@ class Scene {
     vao.Delete();
     vbo.Delete();
     texture.Delete();
+    samplers.Delete();
     program.Delete();
   }
 #endif  // !NDEBUG
@@ -271,6 +279,9 @@ std::string GetBaseRelativePath(const char *argv_0) {
 int main(int argc, char *argv[]) {
   char *error = NULL;
   gui_init(&gui, &error);
+  CpuProfiler::SetClock([](void *gui) { return gui_get_timer_value((GlobalGui *)gui); },
+                        &gui,
+                        gui_get_timer_frequency(&gui));
 
   // Create window and OpenGL context
   main_window = gui_create_window(&gui, 800, 600, "proto3d", NULL, &error);
@@ -312,10 +323,24 @@ int main(int argc, char *argv[]) {
   scene.RenderFrame();
 
   do {
-    gui_poll_events(&gui);
+    {
+      PROTO3D_PROFILE_SCOPE("gui_poll_events");
+      gui_poll_events(&gui);
+    }
     gui_wait_events(&gui);
   } while (!main_window->closed);
 
+#ifdef PROTO3D_USE_PROFILER
+  FILE *trace_file = fopen("events_and_shader_trace.json", "w");
+  if (trace_file != NULL) {
+    ChromeTraceWriter trace_writer(trace_file);
+    trace_writer.Begin();
+    CpuProfiler::Flush(&trace_writer);
+    trace_writer.End();
+    fclose(trace_file);
+  }
+#endif
+
 #ifndef NDEBUG
   scene.Delete();
   gl::CheckLeaks();
@@ -3,15 +3,40 @@
 #ifndef PROTO3D_H_
 #define PROTO3D_H_
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cinttypes>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cmath>
+#include <condition_variable>  // NOLINT(build/c++11)
 #include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <memory>
+#include <mutex>  // NOLINT(build/c++11)
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 #ifdef PROTO3D_USE_EXCEPTIONS
+#include <stdexcept>
 #include <string>
 #endif
-#ifdef PROTO3D_USE_STB
-#include <cstdio>
-#endif
 
 #ifdef PROTO3D_USE_GLM
 /* # include "glm/glm.hpp" */
@@ -130,6 +155,26 @@ stbi_uc *stbi_load(const char *, int *, int *, int *, int);
 #ifndef FATTR_NONNULL_RET
   #define FATTR_NONNULL_RET
 #endif
+
+// Default arguments that evaluate to the file and line of the caller. Used to
+// record where OpenGL objects are created.
+#if defined(__has_builtin)
+  #if __has_builtin(__builtin_FILE) && __has_builtin(__builtin_LINE)
+    #define PROTO3D_CALLER_FILE __builtin_FILE()
+    #define PROTO3D_CALLER_LINE __builtin_LINE()
+  #endif
+#endif
+#if !defined(PROTO3D_CALLER_FILE) && defined(GCC_VERSION)
+  #if GCC_VERSION >= 40800
+    #define PROTO3D_CALLER_FILE __builtin_FILE()
+    #define PROTO3D_CALLER_LINE __builtin_LINE()
+  #endif
+#endif
+
+#ifndef PROTO3D_CALLER_FILE
+  #define PROTO3D_CALLER_FILE nullptr
+  #define PROTO3D_CALLER_LINE 0
+#endif
 // }}}
 // clang-format on
 
@@ -166,12 +211,15 @@ class Image {
 
   unsigned char *raw() { return stb_buffer; }
 
-  GLenum GLPixelFormat() {
+  /// Pixel transfer format of raw(). Grey and grey-alpha images are uploaded
+  /// as GL_RED and GL_RG (the core profile has no GL_LUMINANCE[_ALPHA]), see
+  /// Texture2D::SetGreySwizzle() to sample them as before.
+  GLenum GLPixelFormat() const {
     switch (pixel_format) {
       case STBI_grey:
-      /* return GL_LUMINANCE; */
+        return GL_RED;
       case STBI_grey_alpha:
-      /* return GL_LUMINANCE_ALPHA; */
+        return GL_RG;
       case STBI_rgb:
         return GL_RGB;
       case STBI_rgb_alpha:
@@ -182,13 +230,32 @@ class Image {
     }
   }
 
+  /// Sized internal format matching GLPixelFormat(): GL_R8, GL_RG8, GL_RGB8 or
+  /// GL_RGBA8, or GL_SRGB8[_ALPHA8] if `srgb` is set and the image has color.
+  GLenum GLInternalFormat(bool srgb = false) const {
+    switch (pixel_format) {
+      case STBI_grey:
+        return GL_R8;
+      case STBI_grey_alpha:
+        return GL_RG8;
+      case STBI_rgb:
+        return srgb ? GL_SRGB8 : GL_RGB8;
+      case STBI_rgb_alpha:
+        return srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+      default:
+        assert(false && "Invalid stb::Image pixel format");
+        return GL_ZERO;
+    }
+  }
+
   /// Call `stbi_load` to load an image from a file and wraps the buffer in a
   /// proto3d::stb::Image class.
   ///
   /// POSSIBLE_CRASH: if sbti_load fails opening the file or llocating memory.
   /// Check if the return value is nullptr.
   ///
-  /// @param req_comp STBI_rgb, STBI_rgb_alpha, ...
+  /// @param req_comp STBI_rgb, STBI_rgb_alpha, ... or STBI_default to keep the
+  /// components of the file
   /// @return nullptr in case of failure
   static std::unique_ptr<Image> CreateFromFile(char const *filename, int req_comp = STBI_rgb) {
     int width, height, comp;
@@ -196,1148 +263,8308 @@ class Image {
     if (stb_buffer == nullptr) {
       return nullptr;
     }
-    return std::unique_ptr<Image>(new Image(stb_buffer, width, height, comp));
+    // `comp` is what the file has, the buffer has `req_comp` if one was given
+    int buffer_comp = (req_comp != STBI_default) ? req_comp : comp;
+    return std::unique_ptr<Image>(new Image(stb_buffer, width, height, buffer_comp));
+  }
+
+  /// CreateFromFile() for an image file already in memory (a MappedFile...).
+  ///
+  /// @return nullptr in case of failure
+  static std::unique_ptr<Image> CreateFromMemory(const unsigned char *data,
+                                                 size_t size,
+                                                 int req_comp = STBI_default) {
+    if (size > (size_t)INT32_MAX) {
+      return nullptr;
+    }
+    int width, height, comp;
+    unsigned char *stb_buffer =
+        stbi_load_from_memory(data, (int)size, &width, &height, &comp, req_comp);
+    if (stb_buffer == nullptr) {
+      return nullptr;
+    }
+    int buffer_comp = (req_comp != STBI_default) ? req_comp : comp;
+    return std::unique_ptr<Image>(new Image(stb_buffer, width, height, buffer_comp));
+  }
+
+  /// Reads the size and the components of an image file in memory without
+  /// decoding it.
+  static bool InfoFromMemory(
+      const unsigned char *data, size_t size, int *width, int *height, int *comp) {
+    return size <= (size_t)INT32_MAX &&
+           stbi_info_from_memory(data, (int)size, width, height, comp) != 0;
   }
 };
 // }}} END of STB Image
 }  // namespace stb
 #endif  // PROTO3D_USE_STB
 
-namespace gl {
+// Memory mapped files {{{
 
-namespace detail {
-// Uniform setters {{{
-// UniformSetterFn covers glUniform{1|2|3|4}{f|i|ui}
+/// Read-only view of a whole file. Uses mmap() on POSIX systems so large
+/// assets are paged in on demand and never copied; elsewhere the file is
+/// read into a heap buffer.
+class MappedFile {
+ public:
+  const uint8_t *data;
+  size_t size;
 
-template <typename T>
-struct UniformSetterFn {
-  void operator()(GLint location, T v0) { glUniform1f(location, v0); }
+  MappedFile() : data(nullptr), size(0) {}
+  ~MappedFile() { Close(); }
 
-  void operator()(GLint location, T v0, T v1) { glUniform2f(location, v0, v1); }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
 
-  void operator()(GLint location, T v0, T v1, T v2) { glUniform3f(location, v0, v1, v2); }
+  /// @return false if the file can't be opened or mapped
+  bool Open(const char *path);
 
-  void operator()(GLint location, T v0, T v1, T v2, T v3) { glUniform4f(location, v0, v1, v2, v3); }
+  void Close();
 };
 
-template <>
-struct UniformSetterFn<GLint> {
-  void operator()(GLint location, GLint v0) { glUniform1i(location, v0); }
-
-  void operator()(GLint location, GLint v0, GLint v1) { glUniform2i(location, v0, v1); }
-
-  void operator()(GLint location, GLint v0, GLint v1, GLint v2) {
-    glUniform3i(location, v0, v1, v2);
+#ifdef PROTO3D_IMPLEMENTATION
+#if defined(__unix__) || defined(__APPLE__)
+bool MappedFile::Open(const char *path) {
+  assert(data == nullptr);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
   }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+  void *mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // the mapping keeps the file alive
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  data = (const uint8_t *)mapping;
+  size = (size_t)st.st_size;
+  return true;
+}
 
-  void operator()(GLint location, GLint v0, GLint v1, GLint v2, GLint v3) {
-    glUniform4i(location, v0, v1, v2, v3);
+void MappedFile::Close() {
+  if (data != nullptr) {
+    munmap((void *)data, size);
   }
-};
+  data = nullptr;
+  size = 0;
+}
+#else
+bool MappedFile::Open(const char *path) {
+  assert(data == nullptr);
+  FILE *file = fopen(path, "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  fseek(file, 0, SEEK_END);
+  int64_t file_size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  if (file_size <= 0) {
+    fclose(file);
+    return false;
+  }
+  uint8_t *buffer = new uint8_t[file_size];
+  if (fread(buffer, 1, (size_t)file_size, file) != (size_t)file_size) {
+    delete[] buffer;
+    fclose(file);
+    return false;
+  }
+  fclose(file);
+  data = buffer;
+  size = (size_t)file_size;
+  return true;
+}
 
-template <>
-struct UniformSetterFn<GLuint> {
-  void operator()(GLint location, GLuint v0) { glUniform1ui(location, v0); }
+void MappedFile::Close() {
+  delete[] data;
+  data = nullptr;
+  size = 0;
+}
+#endif
+#endif  // PROTO3D_IMPLEMENTATION
 
-  void operator()(GLint location, GLuint v0, GLuint v1) { glUniform2ui(location, v0, v1); }
+/// Writable view of a new file of a fixed size, e.g. an image assembled from
+/// tiles by several threads. Uses a shared mmap() on POSIX systems so pages
+/// are written back by the OS; elsewhere the bytes are kept in a heap buffer
+/// and written on Close().
+class MappedOutputFile {
+ public:
+  uint8_t *data;
+  size_t size;
 
-  void operator()(GLint location, GLuint v0, GLuint v1, GLuint v2) {
-    glUniform3ui(location, v0, v1, v2);
-  }
+  MappedOutputFile() : data(nullptr), size(0), file(nullptr) {}
+  ~MappedOutputFile() { Close(); }
 
-  void operator()(GLint location, GLuint v0, GLuint v1, GLuint v2, GLuint v3) {
-    glUniform4ui(location, v0, v1, v2, v3);
-  }
-};
+  MappedOutputFile(const MappedOutputFile &) = delete;
+  MappedOutputFile &operator=(const MappedOutputFile &) = delete;
 
-// Vec{1|2|3|4}UniformSetterFn covers glUniform{1|2|3|4}{f|i|ui}v
+  /// Creates (or truncates) the file at `path` with `size` zero bytes.
+  /// @return false if the file can't be created or mapped
+  bool Create(const char *path, size_t size);
 
-/// @param T the type of the vector component
-template <typename T>
-struct UniformVec1SetterFn;
+  /// @return false if the data couldn't be written
+  bool Close();
 
-// UniformVec1SetterFn {{{
+ private:
+  FILE *file;  // only used without mmap()
+};
 
-template <>
-struct UniformVec1SetterFn<GLfloat> {
-  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
-    glUniform1fv(location, count, value_ptr);
+#ifdef PROTO3D_IMPLEMENTATION
+#if defined(__unix__) || defined(__APPLE__)
+bool MappedOutputFile::Create(const char *path, size_t file_size) {
+  assert(data == nullptr && file_size > 0);
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
   }
-};
+  if (ftruncate(fd, (off_t)file_size) != 0) {
+    close(fd);
+    return false;
+  }
+  void *mapping = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  data = (uint8_t *)mapping;
+  size = file_size;
+  return true;
+}
 
-template <>
-struct UniformVec1SetterFn<GLint> {
-  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
-    glUniform1iv(location, count, value_ptr);
+bool MappedOutputFile::Close() {
+  bool ok = true;
+  if (data != nullptr) {
+    ok = msync(data, size, MS_SYNC) == 0;
+    ok = munmap(data, size) == 0 && ok;
   }
-};
+  data = nullptr;
+  size = 0;
+  return ok;
+}
+#else
+bool MappedOutputFile::Create(const char *path, size_t file_size) {
+  assert(data == nullptr && file_size > 0);
+  file = fopen(path, "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  data = new uint8_t[file_size]();
+  size = file_size;
+  return true;
+}
 
-template <>
-struct UniformVec1SetterFn<GLuint> {
-  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
-    glUniform1uiv(location, count, value_ptr);
+bool MappedOutputFile::Close() {
+  bool ok = true;
+  if (file != nullptr) {
+    ok = fwrite(data, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
   }
-};
+  delete[] data;
+  data = nullptr;
+  size = 0;
+  file = nullptr;
+  return ok;
+}
+#endif
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Memory mapped files
 
-// }}}
+// CPU profiling {{{
 
-/// @param T the type of the vector component
-template <typename T>
-struct UniformVec2SetterFn;
+/// Writes events in the Chrome trace / Perfetto JSON format, viewable in
+/// chrome://tracing or https://ui.perfetto.dev.
+///
+///     ChromeTraceWriter writer(file);
+///     writer.Begin();
+///     writer.CompleteEvent("shadows", "gpu", 0, 1, begin_us, duration_us);
+///     writer.End();
+class ChromeTraceWriter {
+ public:
+  explicit ChromeTraceWriter(FILE *file) : file(file), first_event(true) {}
 
-// UniformVec2SetterFn {{{
+  void Begin() { fputs("{\"traceEvents\":[\n", file); }
 
-template <>
-struct UniformVec2SetterFn<GLfloat> {
-  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
-    glUniform2fv(location, count, value_ptr);
-  }
-};
+  /// A "complete" (ph: X) event. Times are in microseconds.
+  void CompleteEvent(const char *name,
+                     const char *category,
+                     int pid,
+                     uint64_t tid,
+                     double timestamp_us,
+                     double duration_us);
 
-template <>
-struct UniformVec2SetterFn<GLint> {
-  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
-    glUniform2iv(location, count, value_ptr);
-  }
+  void End() { fputs("\n]}\n", file); }
+
+ private:
+  FILE *file;
+  bool first_event;
 };
 
-template <>
-struct UniformVec2SetterFn<GLuint> {
-  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
-    glUniform2uiv(location, count, value_ptr);
+#ifdef PROTO3D_IMPLEMENTATION
+void ChromeTraceWriter::CompleteEvent(const char *name,
+                                      const char *category,
+                                      int pid,
+                                      uint64_t tid,
+                                      double timestamp_us,
+                                      double duration_us) {
+  fputs(first_event ? "{\"name\":\"" : ",\n{\"name\":\"", file);
+  first_event = false;
+  for (const char *c = name; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fputc('\\', file);
+    }
+    fputc(*c, file);
   }
-};
+  fprintf(file,
+          "\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%" PRIu64
+          ",\"ts\":%.3f,\"dur\":%.3f}",
+          category,
+          pid,
+          tid,
+          timestamp_us,
+          duration_us);
+}
+#endif  // PROTO3D_IMPLEMENTATION
 
-// }}}
+#ifndef PROTO3D_PROFILER_EVENTS_PER_THREAD
+#define PROTO3D_PROFILER_EVENTS_PER_THREAD 16384
+#endif
 
-/// @param T the type of the vector component
-template <typename T>
-struct UniformVec3SetterFn;
+/// Instrumentation of CPU time spent in proto3d and application code.
+///
+/// PROTO3D_PROFILE_SCOPE("name") records the begin and end timestamps of the
+/// enclosing block into a ring buffer owned by the calling thread. Recording
+/// takes no locks: each ring has a single writer (its thread) and a single
+/// reader (Flush()). Rings hold PROTO3D_PROFILER_EVENTS_PER_THREAD events;
+/// once a ring is full, new events are dropped until the next Flush() (see
+/// DroppedEvents()), so slots are never rewritten while Flush() reads them.
+///
+/// The macros compile to nothing unless PROTO3D_USE_PROFILER is defined.
+///
+///     CpuProfiler::SetClock(
+///         [](void *gui) { return gui_get_timer_value((GlobalGui *)gui); },
+///         &gui,
+///         gui_get_timer_frequency(&gui));
+///     ...
+///     {
+///       PROTO3D_PROFILE_SCOPE("RenderFrame");
+///       ...
+///     }
+///     ...
+///     CpuProfiler::Flush(&writer);
+class CpuProfiler {
+ public:
+  typedef uint64_t (*ClockFn)(void *data);
+
+  struct Event {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  /// Set the clock used to timestamp events, e.g. gui_get_timer_value. Must
+  /// be called before any event is recorded. Defaults to
+  /// std::chrono::steady_clock.
+  static void SetClock(ClockFn clock, void *data, uint64_t frequency) {
+    Clock()     = clock;
+    ClockData() = data;
+    Frequency() = frequency;
+  }
 
-// UniformVec3SetterFn {{{
+  static uint64_t Now() { return Clock()(ClockData()); }
 
-template <>
-struct UniformVec3SetterFn<GLfloat> {
-  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
-    glUniform3fv(location, count, value_ptr);
+  /// Record a complete event in the calling thread's ring buffer.
+  static void Record(const char *name, uint64_t begin, uint64_t end) {
+    ThreadBuffer *buffer = CurrentThreadBuffer();
+    uint64_t head        = buffer->head.load(std::memory_order_relaxed);
+    if (head - buffer->tail.load(std::memory_order_acquire) == PROTO3D_PROFILER_EVENTS_PER_THREAD) {
+      buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    Event &event = buffer->events[head % PROTO3D_PROFILER_EVENTS_PER_THREAD];
+    event.name   = name;
+    event.begin  = begin;
+    event.end    = end;
+    buffer->head.store(head + 1, std::memory_order_release);
   }
-};
 
-template <>
-struct UniformVec3SetterFn<GLint> {
-  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
-    glUniform3iv(location, count, value_ptr);
-  }
-};
+  /// Write every event recorded since the last Flush() to `writer`. Only one
+  /// thread may flush at a time.
+  static void Flush(ChromeTraceWriter *writer);
 
-template <>
-struct UniformVec3SetterFn<GLuint> {
-  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
-    glUniform3uiv(location, count, value_ptr);
-  }
-};
+  /// Number of events dropped because a ring was full, across all threads.
+  static uint64_t DroppedEvents();
 
-// }}}
+ private:
+  struct ThreadBuffer {
+    Event events[PROTO3D_PROFILER_EVENTS_PER_THREAD];
+    std::atomic<uint64_t> head;
+    /// Only written by Flush(), once it's done reading the slots before it
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    uint64_t tid;
+    ThreadBuffer *next;
+  };
+
+  static uint64_t SteadyClockNow(void * /*data*/) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
 
-/// @param T the type of the vector component
-template <typename T>
-struct UniformVec4SetterFn;
+  static ClockFn &Clock() {
+    static ClockFn clock = &SteadyClockNow;
+    return clock;
+  }
 
-// UniformVec4SetterFn {{{
+  static void *&ClockData() {
+    static void *data = nullptr;
+    return data;
+  }
 
-template <>
-struct UniformVec4SetterFn<GLfloat> {
-  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
-    glUniform4fv(location, count, value_ptr);
+  static uint64_t &Frequency() {
+    static uint64_t frequency = 1000000000;
+    return frequency;
   }
-};
 
-template <>
-struct UniformVec4SetterFn<GLint> {
-  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
-    glUniform4iv(location, count, value_ptr);
+  /// Lock-free list of every thread's buffer.
+  static std::atomic<ThreadBuffer *> &Buffers() {
+    static std::atomic<ThreadBuffer *> buffers(nullptr);
+    return buffers;
   }
-};
 
-template <>
-struct UniformVec4SetterFn<GLuint> {
-  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
-    glUniform4uiv(location, count, value_ptr);
+  static ThreadBuffer *CurrentThreadBuffer() {
+    static thread_local ThreadBuffer *buffer = nullptr;
+    if (buffer == nullptr) {
+      static std::atomic<uint64_t> next_tid(1);
+      // Buffers are never freed: events of finished threads can still be flushed.
+      buffer          = new ThreadBuffer;
+      buffer->head    = 0;
+      buffer->tail    = 0;
+      buffer->dropped = 0;
+      buffer->tid     = next_tid.fetch_add(1, std::memory_order_relaxed);
+      buffer->next    = Buffers().load(std::memory_order_relaxed);
+      while (!Buffers().compare_exchange_weak(buffer->next, buffer, std::memory_order_release)) {
+      }
+    }
+    return buffer;
   }
 };
 
-// }}}
+/// RAII helper behind PROTO3D_PROFILE_SCOPE().
+class CpuProfileScope {
+ public:
+  explicit CpuProfileScope(const char *name) : name(name), begin(CpuProfiler::Now()) {}
+  ~CpuProfileScope() { CpuProfiler::Record(name, begin, CpuProfiler::Now()); }
 
-// GLM versions {{{
-#ifdef PROTO3D_USE_GLM
+  CpuProfileScope(const CpuProfileScope &) = delete;
+  CpuProfileScope &operator=(const CpuProfileScope &) = delete;
 
-struct UniformGLMVecSetterFn {
-  void operator()(GLint location, const glm::vec2 &value) {
-    glUniform2fv(location, 1, glm::value_ptr(value));
-  }
+ private:
+  const char *name;
+  uint64_t begin;
+};
 
-  void operator()(GLint location, const glm::vec3 &value) {
-    glUniform3fv(location, 1, glm::value_ptr(value));
+#ifdef PROTO3D_IMPLEMENTATION
+void CpuProfiler::Flush(ChromeTraceWriter *writer) {
+  double us_per_tick   = 1e6 / (double)Frequency();
+  ThreadBuffer *buffer = Buffers().load(std::memory_order_acquire);
+  for (; buffer != nullptr; buffer = buffer->next) {
+    uint64_t head = buffer->head.load(std::memory_order_acquire);
+    uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+    for (; tail < head; tail++) {
+      const Event &event = buffer->events[tail % PROTO3D_PROFILER_EVENTS_PER_THREAD];
+      writer->CompleteEvent(event.name,
+                            "cpu",
+                            0,
+                            buffer->tid,
+                            event.begin * us_per_tick,
+                            (event.end - event.begin) * us_per_tick);
+    }
+    // Hand the slots back to Record()
+    buffer->tail.store(head, std::memory_order_release);
   }
+}
 
-  void operator()(GLint location, const glm::ivec2 &value) {
-    glUniform2iv(location, 1, glm::value_ptr(value));
+uint64_t CpuProfiler::DroppedEvents() {
+  uint64_t dropped     = 0;
+  ThreadBuffer *buffer = Buffers().load(std::memory_order_acquire);
+  for (; buffer != nullptr; buffer = buffer->next) {
+    dropped += buffer->dropped.load(std::memory_order_relaxed);
   }
+  return dropped;
+}
+#endif  // PROTO3D_IMPLEMENTATION
 
-  void operator()(GLint location, const glm::ivec3 &value) {
-    glUniform2iv(location, 1, glm::value_ptr(value));
-  }
+// clang-format off
+#ifdef PROTO3D_USE_PROFILER
+  #define PROTO3D_PROFILE_CONCAT_(a, b) a##b
+  #define PROTO3D_PROFILE_CONCAT(a, b) PROTO3D_PROFILE_CONCAT_(a, b)
+  #define PROTO3D_PROFILE_SCOPE(name) \
+    ::proto3d::CpuProfileScope PROTO3D_PROFILE_CONCAT(proto3d_profile_scope_, __LINE__)(name)
+#else
+  #define PROTO3D_PROFILE_SCOPE(name)
+#endif
+// clang-format on
+// }}} END of CPU profiling
 
-  void operator()(GLint location, const glm::ivec4 &value) {
-    glUniform2iv(location, 1, glm::value_ptr(value));
-  }
+// Thread pool {{{
 
-  void operator()(GLint location, const glm::uvec2 &value) {
-    glUniform2uiv(location, 1, glm::value_ptr(value));
-  }
+/// Minimal fork-join pool for data parallel loops. Worker threads sleep
+/// between ParallelFor() calls, the calling thread takes part in the work.
+class ThreadPool {
+ public:
+  typedef void (*TaskFn)(void *data, size_t index);
 
-  void operator()(GLint location, const glm::uvec3 &value) {
-    glUniform2uiv(location, 1, glm::value_ptr(value));
-  }
+  ThreadPool()
+      : task_fn(nullptr),
+        task_data(nullptr),
+        task_count(0),
+        next_index(0),
+        done(0),
+        busy(0),
+        generation(0),
+        quit(false) {}
+  ~ThreadPool() { Delete(); }
 
-  void operator()(GLint location, const glm::uvec4 &value) {
-    glUniform2uiv(location, 1, glm::value_ptr(value));
-  }
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /// @param thread_count number of worker threads, 0 for one less than the
+  /// number of hardware threads
+  void Create(unsigned int thread_count = 0);
+
+  void Delete();
+
+  /// Number of threads running tasks, including the caller.
+  unsigned int Concurrency() const { return (unsigned int)threads.size() + 1; }
+
+  /// Calls fn(data, i) for every i in [0, count) and returns once all the
+  /// calls have returned. Not reentrant.
+  void ParallelFor(size_t count, TaskFn fn, void *data);
+
+ private:
+  void WorkerLoop();
+  void RunTasks(TaskFn fn, void *data, size_t count);
+
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished;
+  TaskFn task_fn;
+  void *task_data;
+  size_t task_count;
+  std::atomic<size_t> next_index;
+  size_t done;
+  unsigned int busy;
+  unsigned int generation;
+  bool quit;
 };
 
-struct UniformGLMMatSetterFn {
-  void operator()(GLint location, GLboolean transpose, const glm::mat2 &value) {
-    glUniformMatrix2fv(location, 1, transpose, glm::value_ptr(value));
+#ifdef PROTO3D_IMPLEMENTATION
+void ThreadPool::Create(unsigned int thread_count) {
+  assert(threads.empty());
+  if (thread_count == 0) {
+    unsigned int hardware = std::thread::hardware_concurrency();
+    thread_count          = hardware > 1 ? hardware - 1 : 0;
   }
-
-  void operator()(GLint location, GLboolean transpose, const glm::mat3 &value) {
-    glUniformMatrix3fv(location, 1, transpose, glm::value_ptr(value));
+  quit = false;
+  for (unsigned int i = 0; i < thread_count; i++) {
+    threads.push_back(std::thread(&ThreadPool::WorkerLoop, this));
   }
+}
 
-  void operator()(GLint location, GLboolean transpose, const glm::mat4 &value) {
-    glUniformMatrix4fv(location, 1, transpose, glm::value_ptr(value));
+void ThreadPool::Delete() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
   }
-
-  void operator()(GLint location, GLboolean transpose, const glm::mat2x3 &value) {
-    glUniformMatrix2x3fv(location, 1, transpose, glm::value_ptr(value));
+  wake.notify_all();
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
   }
+  threads.clear();
+}
 
-  void operator()(GLint location, GLboolean transpose, const glm::mat3x2 &value) {
-    glUniformMatrix3x2fv(location, 1, transpose, glm::value_ptr(value));
+void ThreadPool::ParallelFor(size_t count, TaskFn fn, void *data) {
+  if (threads.empty() || count <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      fn(data, i);
+    }
+    return;
   }
-
-  void operator()(GLint location, GLboolean transpose, const glm::mat2x4 &value) {
-    glUniformMatrix2x4fv(location, 1, transpose, glm::value_ptr(value));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    task_fn    = fn;
+    task_data  = data;
+    task_count = count;
+    done       = 0;
+    next_index.store(0, std::memory_order_relaxed);
+    generation++;
   }
+  wake.notify_all();
+  RunTasks(fn, data, count);
+  // Workers that woke up late may still be claiming indices from next_index, wait
+  // for them too before the next call resets it
+  std::unique_lock<std::mutex> lock(mutex);
+  finished.wait(lock, [this] { return done == task_count && busy == 0; });
+}
 
-  void operator()(GLint location, GLboolean transpose, const glm::mat4x2 &value) {
-    glUniformMatrix4x2fv(location, 1, transpose, glm::value_ptr(value));
+void ThreadPool::WorkerLoop() {
+  unsigned int seen = 0;
+  for (;;) {
+    // The job is copied under the lock so RunTasks() never reads the shared
+    // fields while ParallelFor() may be writing them
+    TaskFn fn;
+    void *data;
+    size_t count;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this, seen] { return quit || generation != seen; });
+      if (quit) {
+        return;
+      }
+      seen  = generation;
+      fn    = task_fn;
+      data  = task_data;
+      count = task_count;
+      busy++;
+    }
+    RunTasks(fn, data, count);
+    std::lock_guard<std::mutex> lock(mutex);
+    busy--;
+    if (done == task_count && busy == 0) {
+      finished.notify_all();
+    }
   }
+}
 
-  void operator()(GLint location, GLboolean transpose, const glm::mat3x4 &value) {
-    glUniformMatrix3x4fv(location, 1, transpose, glm::value_ptr(value));
+void ThreadPool::RunTasks(TaskFn fn, void *data, size_t count) {
+  size_t ran = 0;
+  for (size_t i; (i = next_index.fetch_add(1, std::memory_order_relaxed)) < count; ran++) {
+    fn(data, i);
   }
-
-  void operator()(GLint location, GLboolean transpose, const glm::mat4x3 &value) {
-    glUniformMatrix4x3fv(location, 1, transpose, glm::value_ptr(value));
+  if (ran != 0) {
+    std::lock_guard<std::mutex> lock(mutex);
+    done += ran;
+    if (done == task_count && busy == 0) {
+      finished.notify_all();
+    }
   }
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Thread pool
+
+// Math {{{
+
+namespace detail {
+// 4-wide float helpers used by the math kernels. F32x4 is an SSE or NEON
+// register when available and a plain struct otherwise.
+#if defined(__SSE__) || defined(__SSE2__)
+typedef __m128 F32x4;
+inline F32x4 Load4(const float *p) { return _mm_load_ps(p); }
+inline void Store4(float *p, F32x4 v) { _mm_store_ps(p, v); }
+inline F32x4 Splat4(float s) { return _mm_set1_ps(s); }
+inline F32x4 Add4(F32x4 a, F32x4 b) { return _mm_add_ps(a, b); }
+inline F32x4 Mul4(F32x4 a, F32x4 b) { return _mm_mul_ps(a, b); }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+typedef float32x4_t F32x4;
+inline F32x4 Load4(const float *p) { return vld1q_f32(p); }
+inline void Store4(float *p, F32x4 v) { vst1q_f32(p, v); }
+inline F32x4 Splat4(float s) { return vdupq_n_f32(s); }
+inline F32x4 Add4(F32x4 a, F32x4 b) { return vaddq_f32(a, b); }
+inline F32x4 Mul4(F32x4 a, F32x4 b) { return vmulq_f32(a, b); }
+#else
+struct F32x4 {
+  float v[4];
 };
+inline F32x4 Load4(const float *p) { return F32x4{{p[0], p[1], p[2], p[3]}}; }
+inline void Store4(float *p, F32x4 a) { memcpy(p, a.v, sizeof(a.v)); }
+inline F32x4 Splat4(float s) { return F32x4{{s, s, s, s}}; }
+inline F32x4 Add4(F32x4 a, F32x4 b) {
+  return F32x4{{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+}
+inline F32x4 Mul4(F32x4 a, F32x4 b) {
+  return F32x4{{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}};
+}
+#endif
 
+#if defined(__AVX2__)
+/// a * b + c
+inline __m256 Madd256(__m256 a, __m256 b, __m256 c) {
+#ifdef __FMA__
+  return _mm256_fmadd_ps(a, b, c);
+#else
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
 #endif
-// }}}
-// }}} END of Uniform setters
 
-// Texture (detail) {{{
+/// Column-major 4x4 matrix times the 4-vector `v`: sum of columns scaled by
+/// the components of v.
+inline F32x4 MulColumns4(const float *m, const float *v) {
+  F32x4 r = Mul4(Load4(m), Splat4(v[0]));
+  r       = Add4(r, Mul4(Load4(m + 4), Splat4(v[1])));
+  r       = Add4(r, Mul4(Load4(m + 8), Splat4(v[2])));
+  return Add4(r, Mul4(Load4(m + 12), Splat4(v[3])));
+}
+}  // namespace detail
 
-/// Sets a texture parameter of type T.
-template <typename T>
-struct TexParameterSetterFn {
-  void operator()(GLenum target, GLenum pname, T param) { glTexParameteri(target, pname, param); }
-};
+/// 16-byte aligned 4-component float vector, laid out like a GLSL vec4
+/// (also in std140 uniform blocks).
+struct alignas(16) Vec4 {
+  float x, y, z, w;
 
-template <>
-struct TexParameterSetterFn<GLfloat> {
-  void operator()(GLenum target, GLenum pname, GLfloat param) {
-    glTexParameterf(target, pname, param);
-  }
-};
+  Vec4() : x(0), y(0), z(0), w(0) {}
+  Vec4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
 
-/// Sets a vector (e.g. border color) texture parameter of component type `T`.
-/// `InternalFormatT` refers to the type OpenGL actually uses internally to store
-/// the values. If you don't care about the internal format used it will most
-/// likely be `GLfloat`. If you want integers to remain integers inside OpenGl
-/// memory, use `GL[u]int` as `InternalFormatT` template parameter.
-///
-/// http://stackoverflow.com/questions/27787418/whats-the-use-case-of-gltexparameteriiv-and-gltexparameteriuiv/27788014
-template <typename T, typename InternalFormatT = GLfloat>
-struct VecTexParameterSetterFn;
+  const float *data() const { return &x; }
+  float *data() { return &x; }
 
-template <>
-struct VecTexParameterSetterFn<GLint> {
-  void operator()(GLenum target, GLenum pname, const GLint *param) {
-    glTexParameteriv(target, pname, param);
+  Vec4 operator+(const Vec4 &v) const { return Vec4(x + v.x, y + v.y, z + v.z, w + v.w); }
+  Vec4 operator-(const Vec4 &v) const { return Vec4(x - v.x, y - v.y, z - v.z, w - v.w); }
+  Vec4 operator*(float s) const { return Vec4(x * s, y * s, z * s, w * s); }
+
+  float Dot(const Vec4 &v) const { return x * v.x + y * v.y + z * v.z + w * v.w; }
+
+  /// Cross product of the xyz parts, w = 0.
+  Vec4 Cross3(const Vec4 &v) const {
+    return Vec4(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x, 0);
   }
 };
 
-template <>
-struct VecTexParameterSetterFn<GLfloat> {
-  void operator()(GLenum target, GLenum pname, const GLfloat *param) {
-    glTexParameterfv(target, pname, param);
+/// Rotation quaternion (x, y, z) * sin(angle / 2), w = cos(angle / 2).
+struct alignas(16) Quat {
+  float x, y, z, w;
+
+  Quat() : x(0), y(0), z(0), w(1) {}
+  Quat(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+
+  /// @param angle in radians, around the normalized axis (ax, ay, az)
+  static Quat AxisAngle(float ax, float ay, float az, float angle) {
+    float s = sinf(angle * 0.5f);
+    return Quat(ax * s, ay * s, az * s, cosf(angle * 0.5f));
   }
-};
 
-template <>
-struct VecTexParameterSetterFn<GLint, GLint> {
-  void operator()(GLenum target, GLenum pname, const GLint *param) {
-    glTexParameterIiv(target, pname, param);
+  /// Hamilton product: rotating by the result rotates by `q` then by this.
+  Quat operator*(const Quat &q) const {
+    return Quat(w * q.x + x * q.w + y * q.z - z * q.y,
+                w * q.y - x * q.z + y * q.w + z * q.x,
+                w * q.z + x * q.y - y * q.x + z * q.w,
+                w * q.w - x * q.x - y * q.y - z * q.z);
   }
-};
 
-template <>
-struct VecTexParameterSetterFn<GLuint, GLuint> {
-  void operator()(GLenum target, GLenum pname, const GLuint *param) {
-    glTexParameterIuiv(target, pname, param);
+  Quat Normalized() const {
+    float s = 1.0f / sqrtf(x * x + y * y + z * z + w * w);
+    return Quat(x * s, y * s, z * s, w * s);
   }
+
+  Quat Conjugate() const { return Quat(-x, -y, -z, w); }
 };
-// }}} END of Texture (detail)
-}  // namespace detail
 
-// OpenGL debugging utilities {{{
-#ifdef PROTO3D_USE_GL_VERSION_4_3
-// OpenGL 4.3 only
-void ReportAllErrorsViaCallback(const char *origin);
-#endif
+/// 16-byte aligned column-major 4x4 float matrix, laid out like a GLSL mat4
+/// so it can be passed as is to Program::SetUniformMat4() or copied into a
+/// std140 uniform block.
+struct alignas(16) Mat4 {
+  float m[16];
 
-const char *LastErrorString();
-const char *FramebufferStatusString();
-void CheckLeaks();
-// }}} END of OpenGL debugging utilities
+  const float *data() const { return m; }
+  float *data() { return m; }
 
-// OpenGL Objects {{{
+  float &operator()(int row, int column) { return m[4 * column + row]; }
+  float operator()(int row, int column) const { return m[4 * column + row]; }
 
-/// Vertex data layout parameters used to describe VBOs.
-/// Pointer format data gets stored in VAOs.
-struct VertexPointerFormat {
-  GLint vertex_size;
-  GLenum comp_type;
-  GLboolean normalized;
-  GLsizei stride;
-  GLintptr offset;
+  static Mat4 Identity() {
+    Mat4 r;
+    memset(r.m, 0, sizeof(r.m));
+    r.m[0] = r.m[5] = r.m[10] = r.m[15] = 1.0f;
+    return r;
+  }
 
-  VertexPointerFormat()
-      : vertex_size(4), comp_type(GL_FLOAT), normalized(GL_FALSE), stride(0), offset(0) {}
+  static Mat4 Translation(float x, float y, float z) {
+    Mat4 r  = Identity();
+    r.m[12] = x;
+    r.m[13] = y;
+    r.m[14] = z;
+    return r;
+  }
 
-  explicit VertexPointerFormat(GLint vertex_size) : VertexPointerFormat(vertex_size, GL_FLOAT) {}
+  static Mat4 Scale(float x, float y, float z) {
+    Mat4 r  = Identity();
+    r.m[0]  = x;
+    r.m[5]  = y;
+    r.m[10] = z;
+    return r;
+  }
 
-  VertexPointerFormat(GLint vertex_size, GLenum comp_type)
-      : vertex_size(vertex_size),
-        comp_type(comp_type),
-        normalized(GL_FALSE),
-        stride(0),
-        offset(0) {}
-};
+  /// Rotation matrix of a unit quaternion.
+  static Mat4 Rotation(const Quat &q);
 
-/// OpenGL Vertex Buffer Objects
-class VBO {
- public:
-  GLuint id;
+  /// Translation * Rotation * Scale, the usual local transform of a node.
+  static Mat4 TRS(const Vec4 &translation, const Quat &rotation, const Vec4 &scale);
 
-  VBO(GLuint id) : id(id) {}  // NOLINT
+  /// OpenGL perspective projection (clip z in [-w, w]).
+  ///
+  /// @param fovy vertical field of view in radians
+  static Mat4 Perspective(float fovy, float aspect, float z_near, float z_far);
 
-  VBO() : id(0) {}
+  /// View matrix of a camera at `eye` looking at `target` (w ignored).
+  static Mat4 LookAt(const Vec4 &eye, const Vec4 &target, const Vec4 &up);
 
-  void Create() {
-    assert(id == 0);
-    glGenBuffers(1, &id);
+  Mat4 operator*(const Mat4 &b) const {
+    Mat4 r;
+    for (int column = 0; column < 4; column++) {
+      detail::Store4(r.m + 4 * column, detail::MulColumns4(m, b.m + 4 * column));
+    }
+    return r;
   }
 
-  void Delete() {
-    assert(!Bound());
-    glDeleteBuffers(1, &id);
+  Vec4 operator*(const Vec4 &v) const {
+    Vec4 r;
+    detail::Store4(r.data(), detail::MulColumns4(m, v.data()));
+    return r;
   }
 
-  void Bind() const {
-    assert(id != 0);
-    glBindBuffer(GL_ARRAY_BUFFER, id);
+  Mat4 Transposed() const {
+    Mat4 r;
+    for (int i = 0; i < 4; i++) {
+      for (int j = 0; j < 4; j++) {
+        r.m[4 * i + j] = m[4 * j + i];
+      }
+    }
+    return r;
   }
 
-  void Unbind() const {
-    assert(id != 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-  }
+  /// General inverse by cofactors. Returns false, leaving `out` untouched, if
+  /// the matrix is singular.
+  bool Inverse(Mat4 *out) const;
 
-  bool Bound() const {
-    assert(id != 0);
-    return id && id == CurrentBinding().id;
-  }
+  /// Inverse of a matrix whose last row is (0, 0, 0, 1) (rotation, scale and
+  /// translation). Cheaper than Inverse().
+  Mat4 AffineInverse() const;
+};
 
-  static VBO CurrentBinding() {
-    GLint current_vbo;
-    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &current_vbo);
-    return VBO((GLuint)current_vbo);
+static_assert(sizeof(Vec4) == 4 * sizeof(float), "Vec4 must match GLSL vec4");
+static_assert(sizeof(Mat4) == 16 * sizeof(float), "Mat4 must match GLSL mat4");
+
+/// out[i] = a[i] * b[i], e.g. parent world matrices times local matrices.
+/// `out` may alias `a` or `b`.
+void MultiplyMat4s(const Mat4 *a, const Mat4 *b, Mat4 *out, size_t count);
+
+/// out[i] = m * in[i]. `out` may alias `in`.
+void TransformVec4s(const Mat4 &m, const Vec4 *in, Vec4 *out, size_t count);
+
+#ifdef PROTO3D_IMPLEMENTATION
+Mat4 Mat4::Rotation(const Quat &q) {
+  float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+  float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+  float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+  Mat4 r;
+  r.m[0]  = 1 - 2 * (yy + zz);
+  r.m[1]  = 2 * (xy + wz);
+  r.m[2]  = 2 * (xz - wy);
+  r.m[3]  = 0;
+  r.m[4]  = 2 * (xy - wz);
+  r.m[5]  = 1 - 2 * (xx + zz);
+  r.m[6]  = 2 * (yz + wx);
+  r.m[7]  = 0;
+  r.m[8]  = 2 * (xz + wy);
+  r.m[9]  = 2 * (yz - wx);
+  r.m[10] = 1 - 2 * (xx + yy);
+  r.m[11] = 0;
+  r.m[12] = 0;
+  r.m[13] = 0;
+  r.m[14] = 0;
+  r.m[15] = 1;
+  return r;
+}
+
+Mat4 Mat4::TRS(const Vec4 &translation, const Quat &rotation, const Vec4 &scale) {
+  Mat4 r = Rotation(rotation);
+  for (int i = 0; i < 3; i++) {
+    r.m[i]     *= scale.x;
+    r.m[4 + i] *= scale.y;
+    r.m[8 + i] *= scale.z;
   }
+  r.m[12] = translation.x;
+  r.m[13] = translation.y;
+  r.m[14] = translation.z;
+  return r;
+}
 
-  void LoadBufferData(const GLvoid *data, GLsizeiptr size) {
-    assert(Bound());
-    glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+Mat4 Mat4::Perspective(float fovy, float aspect, float z_near, float z_far) {
+  float f = 1.0f / tanf(fovy * 0.5f);
+  Mat4 r;
+  memset(r.m, 0, sizeof(r.m));
+  r.m[0]  = f / aspect;
+  r.m[5]  = f;
+  r.m[10] = (z_far + z_near) / (z_near - z_far);
+  r.m[11] = -1.0f;
+  r.m[14] = 2.0f * z_far * z_near / (z_near - z_far);
+  return r;
+}
+
+Mat4 Mat4::LookAt(const Vec4 &eye, const Vec4 &target, const Vec4 &up) {
+  Vec4 forward   = Vec4(target.x - eye.x, target.y - eye.y, target.z - eye.z, 0);
+  forward        = forward * (1.0f / sqrtf(forward.Dot(forward)));
+  Vec4 side      = forward.Cross3(up);
+  side           = side * (1.0f / sqrtf(side.Dot(side)));
+  Vec4 camera_up = side.Cross3(forward);
+  Mat4 r         = Identity();
+  for (int column = 0; column < 3; column++) {
+    r(0, column) = side.data()[column];
+    r(1, column) = camera_up.data()[column];
+    r(2, column) = -forward.data()[column];
   }
+  r(0, 3) = -(side.x * eye.x + side.y * eye.y + side.z * eye.z);
+  r(1, 3) = -(camera_up.x * eye.x + camera_up.y * eye.y + camera_up.z * eye.z);
+  r(2, 3) = forward.x * eye.x + forward.y * eye.y + forward.z * eye.z;
+  return r;
+}
 
-  void LoadBufferData(const GLvoid *data, GLsizeiptr size, GLenum usage) {
-    assert(Bound());
-    glBufferData(GL_ARRAY_BUFFER, size, data, usage);
+bool Mat4::Inverse(Mat4 *out) const {
+  // Cofactors from the 2x2 sub-determinants of the first and last two columns
+  const float *a = m;
+
+  float s0  = a[0] * a[5] - a[1] * a[4];
+  float s1  = a[0] * a[6] - a[2] * a[4];
+  float s2  = a[0] * a[7] - a[3] * a[4];
+  float s3  = a[1] * a[6] - a[2] * a[5];
+  float s4  = a[1] * a[7] - a[3] * a[5];
+  float s5  = a[2] * a[7] - a[3] * a[6];
+  float c0  = a[8] * a[13] - a[9] * a[12];
+  float c1  = a[8] * a[14] - a[10] * a[12];
+  float c2  = a[8] * a[15] - a[11] * a[12];
+  float c3  = a[9] * a[14] - a[10] * a[13];
+  float c4  = a[9] * a[15] - a[11] * a[13];
+  float c5  = a[10] * a[15] - a[11] * a[14];
+  float det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+  if (det == 0.0f) {
+    return false;
   }
-};
+  alignas(16) float inv[16];
+  inv[0]  = a[5] * c5 - a[6] * c4 + a[7] * c3;
+  inv[1]  = -a[1] * c5 + a[2] * c4 - a[3] * c3;
+  inv[2]  = a[13] * s5 - a[14] * s4 + a[15] * s3;
+  inv[3]  = -a[9] * s5 + a[10] * s4 - a[11] * s3;
+  inv[4]  = -a[4] * c5 + a[6] * c2 - a[7] * c1;
+  inv[5]  = a[0] * c5 - a[2] * c2 + a[3] * c1;
+  inv[6]  = -a[12] * s5 + a[14] * s2 - a[15] * s1;
+  inv[7]  = a[8] * s5 - a[10] * s2 + a[11] * s1;
+  inv[8]  = a[4] * c4 - a[5] * c2 + a[7] * c0;
+  inv[9]  = -a[0] * c4 + a[1] * c2 - a[3] * c0;
+  inv[10] = a[12] * s4 - a[13] * s2 + a[15] * s0;
+  inv[11] = -a[8] * s4 + a[9] * s2 - a[11] * s0;
+  inv[12] = -a[4] * c3 + a[5] * c1 - a[6] * c0;
+  inv[13] = a[0] * c3 - a[1] * c1 + a[2] * c0;
+  inv[14] = -a[12] * s3 + a[13] * s1 - a[14] * s0;
+  inv[15] = a[8] * s3 - a[9] * s1 + a[10] * s0;
+
+  detail::F32x4 inv_det = detail::Splat4(1.0f / det);
+  for (int i = 0; i < 16; i += 4) {
+    detail::Store4(out->m + i, detail::Mul4(detail::Load4(inv + i), inv_det));
+  }
+  return true;
+}
 
-void Create(VBO *vbo_arr, GLuint count);
-void Delete(VBO *vbo_arr, GLuint count);
+Mat4 Mat4::AffineInverse() const {
+  // Invert the upper 3x3 block by cofactors, then translation = -inverse * t
+  const float *a = m;
+
+  float c0      = a[5] * a[10] - a[6] * a[9];
+  float c1      = a[6] * a[8] - a[4] * a[10];
+  float c2      = a[4] * a[9] - a[5] * a[8];
+  float inv_det = 1.0f / (a[0] * c0 + a[1] * c1 + a[2] * c2);
+  Mat4 r;
+  r.m[0]  = c0 * inv_det;
+  r.m[1]  = (a[2] * a[9] - a[1] * a[10]) * inv_det;
+  r.m[2]  = (a[1] * a[6] - a[2] * a[5]) * inv_det;
+  r.m[3]  = 0;
+  r.m[4]  = c1 * inv_det;
+  r.m[5]  = (a[0] * a[10] - a[2] * a[8]) * inv_det;
+  r.m[6]  = (a[2] * a[4] - a[0] * a[6]) * inv_det;
+  r.m[7]  = 0;
+  r.m[8]  = c2 * inv_det;
+  r.m[9]  = (a[1] * a[8] - a[0] * a[9]) * inv_det;
+  r.m[10] = (a[0] * a[5] - a[1] * a[4]) * inv_det;
+  r.m[11] = 0;
+  r.m[12] = -(r.m[0] * a[12] + r.m[4] * a[13] + r.m[8] * a[14]);
+  r.m[13] = -(r.m[1] * a[12] + r.m[5] * a[13] + r.m[9] * a[14]);
+  r.m[14] = -(r.m[2] * a[12] + r.m[6] * a[13] + r.m[10] * a[14]);
+  r.m[15] = 1;
+  return r;
+}
 
-#ifdef PROTO3D_IMPLEMENTATION
-void Create(VBO *vbo_arr, GLuint count) {
-  glGenBuffers(count, reinterpret_cast<GLuint *>(vbo_arr));
+void MultiplyMat4s(const Mat4 *a, const Mat4 *b, Mat4 *out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    out[i] = a[i] * b[i];
+  }
 }
 
-void Delete(VBO *vbo_arr, GLuint count) {
-  for (GLuint i = 0; i < count; i++) {
-    assert(!vbo_arr[i].Bound());
+void TransformVec4s(const Mat4 &m, const Vec4 *in, Vec4 *out, size_t count) {
+  // Keep the columns in registers for the whole batch
+  detail::F32x4 c0 = detail::Load4(m.m), c1 = detail::Load4(m.m + 4);
+  detail::F32x4 c2 = detail::Load4(m.m + 8), c3 = detail::Load4(m.m + 12);
+  for (size_t i = 0; i < count; i++) {
+    detail::F32x4 r = detail::Mul4(c0, detail::Splat4(in[i].x));
+    r               = detail::Add4(r, detail::Mul4(c1, detail::Splat4(in[i].y)));
+    r               = detail::Add4(r, detail::Mul4(c2, detail::Splat4(in[i].z)));
+    r               = detail::Add4(r, detail::Mul4(c3, detail::Splat4(in[i].w)));
+    detail::Store4(out[i].data(), r);
   }
-  glDeleteBuffers(count, reinterpret_cast<GLuint *>(vbo_arr));
 }
 #endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Math
 
-/// OpenGL Vertex Array Objects
-///
-/// A Vertex Array Object (VAO) is a container for a set of Vertex Buffer
-/// Objects (VBO) and their state.
-///
-/// The usage patter is:
-///
-///  - During scene initialization:
-///    1. Bind() the VAO
-///    2. Set vertex data state for a visual object using VBOs
-///    3. Unbind() the VAO
+// Transform hierarchy {{{
+
+/// Scene graph transforms stored as flat structure-of-arrays instead of a
+/// tree of nodes. A node is an index, its parent always has a smaller index,
+/// so world matrices are computed in a single forward pass with no pointer
+/// chasing.
 ///
-///  - In the render function:
-///    1. Bind() the VAO to restore all the of the vertex data state remembered
-///       by the VAO
-///    2. Call a glDraw*() function
-///    3. Unbind() the VAO
+/// After Sort() nodes are in depth-first order, every subtree is a contiguous
+/// range and Update() hands disjoint subtrees to a ThreadPool.
 ///
-/// A Vertex Array Object (VAO) is an OpenGL container object that encapsulates
-/// the state needed to specify per-vertex attribute data to the OpenGL
-/// pipeline. To put it another way, a VAO remembers the states of buffer
-/// objects (see QOpenGLBuffer) and their associated state (e.g. vertex
-/// attribute divisors). This allows a very easy and efficient method of
-/// switching between OpenGL buffer states for rendering different "objects" in
-/// a scene. The QOpenGLVertexArrayObject class is a thin wrapper around an
-/// OpenGL VAO.
-class VAO {
+/// `worlds` is contiguous and can be uploaded as is to a uniform/storage
+/// buffer or an instanced mat4 attribute (see Mat4).
+class TransformHierarchy {
  public:
-  GLuint id;
+  static const uint32_t kNoParent = 0xffffffffu;
+
+  // Per node arrays, all of the same size
+  std::vector<uint32_t> parents;
+  std::vector<Vec4> translations;
+  std::vector<Quat> rotations;
+  std::vector<Vec4> scales;
+  std::vector<Mat4> locals;
+  std::vector<Mat4> worlds;
+  /// Local transform changed since the last Update()
+  std::vector<uint8_t> dirty;
+  /// World matrix recomputed by the last Update()
+  std::vector<uint8_t> changed;
+  /// Number of nodes in the subtree rooted at each node, valid after Sort()
+  std::vector<uint32_t> subtree_sizes;
+
+  TransformHierarchy() : sorted(true), partition_target(0) {}
+
+  size_t Size() const { return parents.size(); }
+
+  void Reserve(size_t count);
+
+  /// Appends a node. `parent` must be kNoParent or an existing node.
+  uint32_t Add(uint32_t parent,
+               const Vec4 &translation = Vec4(0, 0, 0, 1),
+               const Quat &rotation    = Quat(),
+               const Vec4 &scale       = Vec4(1, 1, 1, 0));
+
+  void SetLocal(uint32_t node, const Vec4 &translation, const Quat &rotation, const Vec4 &scale) {
+    translations[node] = translation;
+    rotations[node]    = rotation;
+    scales[node]       = scale;
+    dirty[node]        = 1;
+  }
 
-  VAO(GLuint id) : id(id) {}  // NOLINT
+  /// Reorders the nodes depth-first so subtrees are contiguous. Children keep
+  /// their relative order. Fills `remap` with the new index of every old
+  /// index if not null.
+  void Sort(std::vector<uint32_t> *remap = nullptr);
 
-  VAO() : id(0) {}
+  /// Recomputes the local matrices of dirty nodes and the world matrices of
+  /// dirty nodes and their descendants. Subtrees are processed in parallel if
+  /// `pool` is not null and the hierarchy is sorted.
+  void Update(ThreadPool *pool = nullptr);
 
-  void Create() {
-    assert(id == 0);
-    glGenVertexArrays(1, &id);
-  }
+ private:
+  struct Range {
+    uint32_t begin, end;
+  };
+
+  void UpdateRange(uint32_t begin, uint32_t end);
+  void BuildPartition(uint32_t target);
+  static void UpdateTask(void *data, size_t index);
+
+  bool sorted;
+  uint32_t partition_target;
+  /// Nodes with subtrees too big for one task, updated serially first
+  std::vector<uint32_t> top_nodes;
+  std::vector<Range> tasks;
+};
 
-  void Delete() {
-    assert(!Bound());
-    glDeleteVertexArrays(1, &id);
+#ifdef PROTO3D_IMPLEMENTATION
+namespace detail {
+/// (*array)[i] = old (*array)[order[i]]
+template <class T>
+void Permute(std::vector<T> *array, const std::vector<uint32_t> &order) {
+  std::vector<T> sorted(array->size());
+  for (size_t i = 0; i < order.size(); i++) {
+    sorted[i] = (*array)[order[i]];
   }
+  array->swap(sorted);
+}
+}  // namespace detail
 
-  void Bind() const {
-    assert(id != 0);
-    glBindVertexArray(id);
+void TransformHierarchy::Reserve(size_t count) {
+  parents.reserve(count);
+  translations.reserve(count);
+  rotations.reserve(count);
+  scales.reserve(count);
+  locals.reserve(count);
+  worlds.reserve(count);
+  dirty.reserve(count);
+  changed.reserve(count);
+  subtree_sizes.reserve(count);
+}
+
+uint32_t TransformHierarchy::Add(uint32_t parent,
+                                 const Vec4 &translation,
+                                 const Quat &rotation,
+                                 const Vec4 &scale) {
+  uint32_t node = (uint32_t)parents.size();
+  assert(parent == kNoParent || parent < node);
+  // Still depth-first if the node is appended to the subtree that ends last
+  if (sorted && node != 0 && parent != node - 1) {
+    uint32_t ancestor = parents[node - 1];
+    while (ancestor != kNoParent && ancestor != parent) {
+      ancestor = parents[ancestor];
+    }
+    sorted = ancestor == parent;
   }
+  if (sorted) {
+    subtree_sizes.push_back(1);
+    for (uint32_t ancestor = parent; ancestor != kNoParent; ancestor = parents[ancestor]) {
+      subtree_sizes[ancestor]++;
+    }
+  }
+  parents.push_back(parent);
+  translations.push_back(translation);
+  rotations.push_back(rotation);
+  scales.push_back(scale);
+  locals.push_back(Mat4::Identity());
+  worlds.push_back(Mat4::Identity());
+  dirty.push_back(1);
+  changed.push_back(0);
+  partition_target = 0;
+  return node;
+}
 
-  void Unbind() const {
-    assert(Bound());
-    glBindVertexArray(0);
+void TransformHierarchy::Sort(std::vector<uint32_t> *remap) {
+  uint32_t count = (uint32_t)Size();
+  // Children lists in a flat array (counting sort on the parent index)
+  std::vector<uint32_t> first(count + 2, 0), children(count);
+  for (uint32_t i = 0; i < count; i++) {
+    first[parents[i] == kNoParent ? 0 : parents[i] + 1]++;
+  }
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < count + 2; i++) {
+    uint32_t n = first[i];
+    first[i]   = sum;
+    sum += n;
+  }
+  std::vector<uint32_t> cursor(first.begin(), first.end() - 1);
+  for (uint32_t i = 0; i < count; i++) {
+    children[cursor[parents[i] == kNoParent ? 0 : parents[i] + 1]++] = i;
   }
+  // Depth-first order with an explicit stack, pushing children in reverse
+  std::vector<uint32_t> order, stack, new_index(count);
+  order.reserve(count);
+  for (uint32_t c = first[1]; c-- > first[0];) {
+    stack.push_back(children[c]);
+  }
+  while (!stack.empty()) {
+    uint32_t node = stack.back();
+    stack.pop_back();
+    new_index[node] = (uint32_t)order.size();
+    order.push_back(node);
+    for (uint32_t c = first[node + 2]; c-- > first[node + 1];) {
+      stack.push_back(children[c]);
+    }
+  }
+  assert(order.size() == count);
+
+  detail::Permute(&parents, order);
+  detail::Permute(&translations, order);
+  detail::Permute(&rotations, order);
+  detail::Permute(&scales, order);
+  detail::Permute(&locals, order);
+  detail::Permute(&worlds, order);
+  detail::Permute(&dirty, order);
+  detail::Permute(&changed, order);
+  for (uint32_t i = 0; i < count; i++) {
+    if (parents[i] != kNoParent) {
+      parents[i] = new_index[parents[i]];
+    }
+  }
+  subtree_sizes.assign(count, 1);
+  for (uint32_t i = count; i-- > 0;) {
+    if (parents[i] != kNoParent) {
+      subtree_sizes[parents[i]] += subtree_sizes[i];
+    }
+  }
+  if (remap != nullptr) {
+    remap->swap(new_index);
+  }
+  sorted           = true;
+  partition_target = 0;
+}
 
-  bool Bound() const {
-    assert(id != 0);
-    return id && id == CurrentBinding().id;
+void TransformHierarchy::UpdateRange(uint32_t begin, uint32_t end) {
+  for (uint32_t i = begin; i < end; i++) {
+    uint32_t parent = parents[i];
+    if (dirty[i]) {
+      locals[i] = Mat4::TRS(translations[i], rotations[i], scales[i]);
+    }
+    changed[i] = dirty[i] || (parent != kNoParent && changed[parent]);
+    dirty[i]   = 0;
+    if (changed[i]) {
+      worlds[i] = parent == kNoParent ? locals[i] : worlds[parent] * locals[i];
+    }
   }
+}
 
-  static VAO CurrentBinding() {
-    GLint current_vao;
-    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &current_vao);
-    return VAO((GLuint)current_vao);
+void TransformHierarchy::BuildPartition(uint32_t target) {
+  // Subtrees of up to `target` nodes become tasks, their ancestors are
+  // updated first on the calling thread. Adjacent small subtrees are merged.
+  top_nodes.clear();
+  tasks.clear();
+  uint32_t count = (uint32_t)Size();
+  for (uint32_t i = 0; i < count;) {
+    if (subtree_sizes[i] > target) {
+      top_nodes.push_back(i);
+      i++;
+      continue;
+    }
+    uint32_t end = i + subtree_sizes[i];
+    if (!tasks.empty() && tasks.back().end == i && end - tasks.back().begin <= target) {
+      tasks.back().end = end;
+    } else {
+      tasks.push_back(Range{i, end});
+    }
+    i = end;
   }
+  partition_target = target;
+}
 
-  static GLint MaxNumberOfArrays() {
-    GLint max_vertex_attribs;
-    glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &max_vertex_attribs);
-    return max_vertex_attribs;
+void TransformHierarchy::UpdateTask(void *data, size_t index) {
+  TransformHierarchy *self = (TransformHierarchy *)data;
+  self->UpdateRange(self->tasks[index].begin, self->tasks[index].end);
+}
+
+void TransformHierarchy::Update(ThreadPool *pool) {
+  PROTO3D_PROFILE_SCOPE("TransformHierarchy::Update");
+  uint32_t count = (uint32_t)Size();
+  if (pool == nullptr || pool->Concurrency() == 1 || !sorted) {
+    UpdateRange(0, count);
+    return;
+  }
+  // A few tasks per thread so uneven subtrees still balance, but not so
+  // small that scheduling dominates
+  uint32_t target = count / (4 * pool->Concurrency());
+  target          = target < 1024 ? 1024 : target;
+  if (target != partition_target) {
+    BuildPartition(target);
+  }
+  for (size_t i = 0; i < top_nodes.size(); i++) {
+    UpdateRange(top_nodes[i], top_nodes[i] + 1);
+  }
+  pool->ParallelFor(tasks.size(), UpdateTask, this);
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Transform hierarchy
+
+// Mipmap generation {{{
+
+enum MipFilter {
+  kMipFilterBox,       ///< 2x2 average, fastest
+  kMipFilterKaiser,    ///< 8-tap Kaiser-windowed sinc, keeps more detail
+  kMipFilterTriangle,  ///< 4-tap tent (1 3 3 1), smoother than box
+};
+
+/// A level of a mip chain with 8 bits per component, tightly packed.
+struct MipLevel {
+  int width;
+  int height;
+  std::vector<uint8_t> pixels;
+};
+
+/// Builds the full mip chain of a tightly packed 8-bit image with
+/// `components` (1 to 4) per pixel, down to 1x1. `(*levels)[0]` is a copy of
+/// the source.
+///
+/// Levels are filtered in linear float (AVX2 when available, otherwise SSE or
+/// NEON). With `srgb` set, the color channels of 3 and 4 component images are
+/// decoded from sRGB before filtering and encoded back after, alpha is always
+/// linear. Rows of every pass are split across `pool` if not null.
+void GenerateMipChain(const uint8_t *pixels,
+                      int width,
+                      int height,
+                      int components,
+                      bool srgb,
+                      MipFilter filter,
+                      std::vector<MipLevel> *levels,
+                      ThreadPool *pool = nullptr);
+
+#ifdef PROTO3D_IMPLEMENTATION
+namespace detail {
+/// sRGB transfer function lookup tables, built once (thread-safe static).
+struct SrgbTables {
+  float to_linear[256];
+  /// Linear [0, 1] quantized to 4096 steps to 8-bit sRGB
+  uint8_t to_srgb[4096];
+
+  SrgbTables() {
+    for (int i = 0; i < 256; i++) {
+      float c      = i / 255.0f;
+      to_linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+    for (int i = 0; i < 4096; i++) {
+      float l    = i / 4095.0f;
+      float c    = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+      to_srgb[i] = (uint8_t)(c * 255.0f + 0.5f);
+    }
+  }
+
+  static const SrgbTables &Get() {
+    static const SrgbTables tables;
+    return tables;
+  }
+};
+
+inline float Saturate(float c) { return c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c); }
+
+/// Expands pixels [begin, end) of an 8-bit image to linear RGBA float,
+/// missing channels are 0 (and alpha 1).
+inline void DecodeMipLevel(
+    const uint8_t *pixels, int begin, int end, int components, bool srgb, Vec4 *out) {
+  const float *to_linear = SrgbTables::Get().to_linear;
+  bool color_srgb        = srgb && components >= 3;
+  for (int i = begin; i < end; i++) {
+    const uint8_t *p = pixels + i * components;
+    float c[4]       = {0, 0, 0, 1};
+    for (int k = 0; k < components; k++) {
+      c[k] = (color_srgb && k < 3) ? to_linear[p[k]] : p[k] / 255.0f;
+    }
+    out[i] = Vec4(c[0], c[1], c[2], c[3]);
+  }
+}
+
+inline void EncodeMipLevel(
+    const Vec4 *texels, int begin, int end, int components, bool srgb, uint8_t *pixels) {
+  const uint8_t *to_srgb = SrgbTables::Get().to_srgb;
+  bool color_srgb        = srgb && components >= 3;
+  for (int i = begin; i < end; i++) {
+    const float *c = texels[i].data();
+    uint8_t *p     = pixels + i * components;
+    for (int k = 0; k < components; k++) {
+      if (color_srgb && k < 3) {
+        p[k] = to_srgb[(int)(Saturate(c[k]) * 4095.0f + 0.5f)];
+      } else {
+        p[k] = (uint8_t)(Saturate(c[k]) * 255.0f + 0.5f);
+      }
+    }
+  }
+}
+
+inline int MipDimension(int size) { return size > 1 ? size / 2 : 1; }
+
+inline int ClampIndex(int i, int size) { return i < 0 ? 0 : (i >= size ? size - 1 : i); }
+
+/// 2x2 box filter of destination rows [y_begin, y_end), clamping at the
+/// edges of odd or 1 texel wide levels.
+inline void DownsampleBox(
+    const Vec4 *src, int src_width, int src_height, Vec4 *dst, int y_begin, int y_end) {
+  int dst_width = MipDimension(src_width);
+  for (int y = y_begin; y < y_end; y++) {
+    const Vec4 *row0 = src + (2 * y) * src_width;
+    const Vec4 *row1 = src + ClampIndex(2 * y + 1, src_height) * src_width;
+    Vec4 *out        = dst + y * dst_width;
+    int x            = 0;
+#ifdef __AVX2__
+    // Two destination texels from 4 source columns per iteration
+    __m256 quarter = _mm256_set1_ps(0.25f);
+    for (; 2 * x + 3 < src_width && x + 1 < dst_width; x += 2) {
+      __m256 a = _mm256_add_ps(_mm256_loadu_ps(row0[2 * x].data()),
+                               _mm256_loadu_ps(row1[2 * x].data()));
+      __m256 b = _mm256_add_ps(_mm256_loadu_ps(row0[2 * x + 2].data()),
+                               _mm256_loadu_ps(row1[2 * x + 2].data()));
+      __m256 sum = _mm256_add_ps(_mm256_permute2f128_ps(a, b, 0x20),
+                                 _mm256_permute2f128_ps(a, b, 0x31));
+      _mm256_storeu_ps(out[x].data(), _mm256_mul_ps(sum, quarter));
+    }
+#endif
+    F32x4 quarter4 = Splat4(0.25f);
+    for (; x < dst_width; x++) {
+      int x0  = 2 * x;
+      int x1  = ClampIndex(x0 + 1, src_width);
+      F32x4 s = Add4(Add4(Load4(row0[x0].data()), Load4(row0[x1].data())),
+                     Add4(Load4(row1[x0].data()), Load4(row1[x1].data())));
+      Store4(out[x].data(), Mul4(s, quarter4));
+    }
+  }
+}
+
+/// Normalized taps of a separable halving filter. Tap k of destination texel
+/// x reads source texel 2x - taps/2 + 1 + k.
+struct MipKernel {
+  int taps;
+  float weights[8];
+
+  /// 8-tap Kaiser-windowed sinc (alpha = 4, 2 destination texels of support)
+  static const MipKernel &Kaiser() {
+    static const MipKernel kernel = MakeKaiser();
+    return kernel;
+  }
+
+  /// 4-tap tent, 1 destination texel of support
+  static const MipKernel &Triangle() {
+    static const MipKernel kernel = {4, {0.125f, 0.375f, 0.375f, 0.125f}};
+    return kernel;
+  }
+
+  /// Zeroth order modified Bessel function of the first kind
+  static float BesselI0(float x) {
+    float sum = 1.0f, term = 1.0f;
+    for (int k = 1; k < 16; k++) {
+      term *= (x / (2.0f * k)) * (x / (2.0f * k));
+      sum += term;
+    }
+    return sum;
+  }
+
+  static MipKernel MakeKaiser() {
+    const float kAlpha = 4.0f, kPi = 3.14159265f;
+    MipKernel kernel;
+    kernel.taps = 8;
+    float total = 0.0f;
+    for (int k = 0; k < 8; k++) {
+      float d           = (k - 3.5f) * 0.5f;  // distance in destination texels
+      float r           = d / 2.0f;
+      float sinc        = sinf(kPi * d) / (kPi * d);
+      kernel.weights[k] = sinc * BesselI0(kAlpha * sqrtf(1.0f - r * r)) / BesselI0(kAlpha);
+      total += kernel.weights[k];
+    }
+    for (int k = 0; k < 8; k++) {
+      kernel.weights[k] /= total;
+    }
+    return kernel;
+  }
+};
+
+/// Horizontal pass of a separable filter over source rows [y_begin, y_end).
+/// `tmp` has dst_width texels per row.
+inline void DownsampleRows(const Vec4 *src,
+                           int src_width,
+                           const MipKernel &kernel,
+                           Vec4 *tmp,
+                           int y_begin,
+                           int y_end) {
+  int dst_width = MipDimension(src_width);
+  int first_tap = 1 - kernel.taps / 2;
+  F32x4 w[8];
+  for (int k = 0; k < kernel.taps; k++) {
+    w[k] = Splat4(kernel.weights[k]);
+  }
+  for (int y = y_begin; y < y_end; y++) {
+    const Vec4 *row = src + y * src_width;
+    for (int x = 0; x < dst_width; x++) {
+      F32x4 sum = Splat4(0.0f);
+      for (int k = 0; k < kernel.taps; k++) {
+        int sx = ClampIndex(2 * x + first_tap + k, src_width);
+        sum    = Add4(sum, Mul4(Load4(row[sx].data()), w[k]));
+      }
+      Store4(tmp[y * dst_width + x].data(), sum);
+    }
+  }
+}
+
+/// Vertical pass of a separable filter over destination rows [y_begin,
+/// y_end). Rows are contiguous, so this is where the wide loads pay off.
+inline void DownsampleColumns(const Vec4 *tmp,
+                              int dst_width,
+                              int src_height,
+                              const MipKernel &kernel,
+                              Vec4 *dst,
+                              int y_begin,
+                              int y_end) {
+  int first_tap = 1 - kernel.taps / 2;
+#ifdef __AVX2__
+  __m256 w[8];
+  for (int k = 0; k < kernel.taps; k++) {
+    w[k] = _mm256_set1_ps(kernel.weights[k]);
+  }
+#endif
+  for (int y = y_begin; y < y_end; y++) {
+    const Vec4 *rows[8];
+    for (int k = 0; k < kernel.taps; k++) {
+      rows[k] = tmp + ClampIndex(2 * y + first_tap + k, src_height) * dst_width;
+    }
+    Vec4 *out = dst + y * dst_width;
+    int x     = 0;
+#ifdef __AVX2__
+    for (; x + 1 < dst_width; x += 2) {
+      __m256 sum = _mm256_setzero_ps();
+      for (int k = 0; k < kernel.taps; k++) {
+        sum = Madd256(_mm256_loadu_ps(rows[k][x].data()), w[k], sum);
+      }
+      _mm256_storeu_ps(out[x].data(), sum);
+    }
+#endif
+    for (; x < dst_width; x++) {
+      F32x4 sum = Splat4(0.0f);
+      for (int k = 0; k < kernel.taps; k++) {
+        sum = Add4(sum, Mul4(Load4(rows[k][x].data()), Splat4(kernel.weights[k])));
+      }
+      Store4(out[x].data(), sum);
+    }
+  }
+}
+
+/// Calls fn(begin, end) over slices of [0, count), on `pool` if not null.
+template <class Fn>
+void ForEachRowRange(ThreadPool *pool, int count, Fn fn) {
+  if (pool == nullptr || pool->Concurrency() == 1 || count < 64) {
+    fn(0, count);
+    return;
+  }
+  // A few slices per thread to balance the tail
+  struct Job {
+    Fn *fn;
+    int count;
+    int slices;
+  } job = {&fn, count, (int)pool->Concurrency() * 4};
+  job.slices = job.slices < count ? job.slices : count;
+  pool->ParallelFor((size_t)job.slices,
+                    [](void *data, size_t i) {
+                      Job *job = (Job *)data;
+                      (*job->fn)((int)((int64_t)job->count * i / job->slices),
+                                 (int)((int64_t)job->count * (i + 1) / job->slices));
+                    },
+                    &job);
+}
+}  // namespace detail
+
+void GenerateMipChain(const uint8_t *pixels,
+                      int width,
+                      int height,
+                      int components,
+                      bool srgb,
+                      MipFilter filter,
+                      std::vector<MipLevel> *levels,
+                      ThreadPool *pool) {
+  PROTO3D_PROFILE_SCOPE("GenerateMipChain");
+  assert(components >= 1 && components <= 4);
+  levels->clear();
+  levels->push_back(MipLevel{width, height, std::vector<uint8_t>()});
+  levels->back().pixels.assign(pixels, pixels + (size_t)width * height * components);
+
+  std::vector<Vec4> src((size_t)width * height), dst, tmp;
+  auto decode = [&src, pixels, width, components, srgb](int begin, int end) {
+    detail::DecodeMipLevel(pixels, begin * width, end * width, components, srgb, src.data());
+  };
+  detail::ForEachRowRange(pool, height, decode);
+  const detail::MipKernel &kernel =
+      filter == kMipFilterKaiser ? detail::MipKernel::Kaiser() : detail::MipKernel::Triangle();
+  while (width > 1 || height > 1) {
+    int dst_width  = detail::MipDimension(width);
+    int dst_height = detail::MipDimension(height);
+    dst.resize((size_t)dst_width * dst_height);
+    if (filter == kMipFilterBox) {
+      auto box = [&src, &dst, width, height](int begin, int end) {
+        detail::DownsampleBox(src.data(), width, height, dst.data(), begin, end);
+      };
+      detail::ForEachRowRange(pool, dst_height, box);
+    } else {
+      tmp.resize((size_t)dst_width * height);
+      auto rows = [&src, &tmp, &kernel, width](int begin, int end) {
+        detail::DownsampleRows(src.data(), width, kernel, tmp.data(), begin, end);
+      };
+      detail::ForEachRowRange(pool, height, rows);
+      auto columns = [&tmp, &dst, &kernel, dst_width, height](int begin, int end) {
+        detail::DownsampleColumns(tmp.data(), dst_width, height, kernel, dst.data(), begin, end);
+      };
+      detail::ForEachRowRange(pool, dst_height, columns);
+    }
+    levels->push_back(MipLevel{dst_width, dst_height, std::vector<uint8_t>()});
+    levels->back().pixels.resize(dst.size() * components);
+    uint8_t *out = levels->back().pixels.data();
+
+    auto encode = [&dst, out, dst_width, components, srgb](int begin, int end) {
+      detail::EncodeMipLevel(dst.data(), begin * dst_width, end * dst_width, components, srgb, out);
+    };
+    detail::ForEachRowRange(pool, dst_height, encode);
+    src.swap(dst);
+    width  = dst_width;
+    height = dst_height;
+  }
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Mipmap generation
+
+// Atlas packing {{{
+
+/// Where a SkylinePacker put a rectangle.
+struct AtlasRect {
+  int x;
+  int y;
+  int width;
+  int height;
+  int page;
+};
+
+/// Packs rectangles into pages of a fixed size with the skyline bottom-left
+/// heuristic. Each page keeps the top edge (the "skyline") of what it holds,
+/// and a rectangle goes where its top ends lowest, ties going to the
+/// narrowest segment. A new page is opened when none has room.
+///
+/// Packing the tallest rectangles first (PackAll()) usually fills 85-95% of
+/// the pages.
+class SkylinePacker {
+ public:
+  SkylinePacker(int page_width, int page_height)
+      : page_width(page_width), page_height(page_height) {}
+
+  /// @return false if the rectangle doesn't fit in a page
+  bool Pack(int width, int height, AtlasRect *rect);
+
+  /// Packs `count` rectangles, tallest first.
+  /// @return false if one of them doesn't fit in a page
+  bool PackAll(const int *widths, const int *heights, int count, AtlasRect *rects);
+
+  int PageCount() const { return (int)pages.size(); }
+
+ private:
+  struct Segment {
+    int x;
+    int y;
+    int width;
+  };
+
+  /// @return the lowest y of a width x height rectangle whose left edge is
+  /// at segment `index`, or -1 if it doesn't fit there
+  int Fit(const std::vector<Segment> &skyline, size_t index, int width, int height) const;
+
+  void Place(std::vector<Segment> *skyline, size_t index, int top, int width);
+
+  int page_width;
+  int page_height;
+  std::vector<std::vector<Segment>> pages;
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+int SkylinePacker::Fit(const std::vector<Segment> &skyline,
+                       size_t index,
+                       int width,
+                       int height) const {
+  if (skyline[index].x + width > page_width) {
+    return -1;
+  }
+  // The segments cover the page width, so this stays in the skyline
+  int y = 0;
+  for (int remaining = width; remaining > 0; index++) {
+    y = std::max(y, skyline[index].y);
+    if (y + height > page_height) {
+      return -1;
+    }
+    remaining -= skyline[index].width;
+  }
+  return y;
+}
+
+void SkylinePacker::Place(std::vector<Segment> *skyline, size_t index, int top, int width) {
+  Segment placed = {(*skyline)[index].x, top, width};
+  skyline->insert(skyline->begin() + index, placed);
+
+  // Cut what the new segment covers
+  int end = placed.x + width;
+  for (size_t next = index + 1; next < skyline->size() && (*skyline)[next].x < end;) {
+    Segment &segment = (*skyline)[next];
+    int segment_end  = segment.x + segment.width;
+    if (segment_end <= end) {
+      skyline->erase(skyline->begin() + next);
+    } else {
+      segment.x     = end;
+      segment.width = segment_end - end;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i + 1 < skyline->size();) {
+    if ((*skyline)[i].y == (*skyline)[i + 1].y) {
+      (*skyline)[i].width += (*skyline)[i + 1].width;
+      skyline->erase(skyline->begin() + i + 1);
+    } else {
+      i++;
+    }
+  }
+}
+
+bool SkylinePacker::Pack(int width, int height, AtlasRect *rect) {
+  assert(width > 0 && height > 0);
+  if (width > page_width || height > page_height) {
+    return false;
+  }
+  // A new page always has room, so this ends
+  for (size_t page = 0;; page++) {
+    if (page == pages.size()) {
+      pages.push_back(std::vector<Segment>(1, Segment{0, 0, page_width}));
+    }
+    std::vector<Segment> &skyline = pages[page];
+    size_t best                   = skyline.size();
+    int best_top                  = page_height + 1;
+    int best_width                = page_width + 1;
+    for (size_t i = 0; i < skyline.size(); i++) {
+      int y = Fit(skyline, i, width, height);
+      if (y >= 0 && (y + height < best_top ||
+                     (y + height == best_top && skyline[i].width < best_width))) {
+        best       = i;
+        best_top   = y + height;
+        best_width = skyline[i].width;
+      }
+    }
+    if (best < skyline.size()) {
+      *rect = AtlasRect{skyline[best].x, best_top - height, width, height, (int)page};
+      Place(&skyline, best, best_top, width);
+      return true;
+    }
+  }
+}
+
+bool SkylinePacker::PackAll(const int *widths, const int *heights, int count, AtlasRect *rects) {
+  std::vector<int> order((size_t)count);
+  for (int i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [widths, heights](int a, int b) {
+    return heights[a] != heights[b] ? heights[a] > heights[b] : widths[a] > widths[b];
+  });
+  for (int i : order) {
+    if (!Pack(widths[i], heights[i], &rects[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Atlas packing
+
+// Frustum culling {{{
+
+/// View frustum as 6 planes (left, right, bottom, top, near, far) of the form
+/// a*x + b*y + c*z + d >= 0 for points inside.
+struct Frustum {
+  float planes[6][4];
+
+  /// Extract the planes of a column-major projection * view matrix
+  /// (Gribb/Hartmann). Planes are in world space if the matrix includes the
+  /// view transform, and are normalized.
+  static Frustum FromMatrix(const float *m);
+
+  static Frustum FromMatrix(const Mat4 &m) { return FromMatrix(m.data()); }
+};
+
+/// Cull spheres stored as structure of arrays against a frustum.
+///
+/// SSE2 and AVX2 kernels are used when the compiler targets them (-mavx2),
+/// with a scalar fallback. The indices of the spheres that are at least
+/// partially inside are written, in increasing order, to `visible`, which is
+/// ready to be uploaded as a per-instance attribute or an indirect draw
+/// argument buffer.
+///
+/// @param visible output array with room for `count` indices
+/// @return the number of visible indices written
+GLsizei CullSpheres(const Frustum &frustum,
+                    const float *x,
+                    const float *y,
+                    const float *z,
+                    const float *radius,
+                    GLsizei count,
+                    GLuint *visible);
+
+/// Cull axis-aligned boxes, given by their centers and half extents stored as
+/// structure of arrays. Same contract as CullSpheres().
+GLsizei CullBoxes(const Frustum &frustum,
+                  const float *center_x,
+                  const float *center_y,
+                  const float *center_z,
+                  const float *extent_x,
+                  const float *extent_y,
+                  const float *extent_z,
+                  GLsizei count,
+                  GLuint *visible);
+
+#ifdef PROTO3D_IMPLEMENTATION
+Frustum Frustum::FromMatrix(const float *m) {
+  // Row i of the column-major matrix m is (m[i], m[4 + i], m[8 + i], m[12 + i])
+  Frustum frustum;
+  for (int i = 0; i < 6; i++) {
+    int row     = i / 2;
+    float sign  = (i % 2 == 0) ? 1.0f : -1.0f;
+    float *p    = frustum.planes[i];
+    p[0]        = m[3] + sign * m[row];
+    p[1]        = m[7] + sign * m[4 + row];
+    p[2]        = m[11] + sign * m[8 + row];
+    p[3]        = m[15] + sign * m[12 + row];
+    float scale = 1.0f / sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    p[0] *= scale;
+    p[1] *= scale;
+    p[2] *= scale;
+    p[3] *= scale;
+  }
+  return frustum;
+}
+
+namespace detail {
+
+inline bool SphereVisible(const Frustum &f, float x, float y, float z, float radius) {
+  for (int i = 0; i < 6; i++) {
+    const float *p = f.planes[i];
+    if (p[0] * x + p[1] * y + p[2] * z + p[3] < -radius) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool BoxVisible(
+    const Frustum &f, float cx, float cy, float cz, float ex, float ey, float ez) {
+  for (int i = 0; i < 6; i++) {
+    const float *p = f.planes[i];
+    float r        = fabsf(p[0]) * ex + fabsf(p[1]) * ey + fabsf(p[2]) * ez;
+    if (p[0] * cx + p[1] * cy + p[2] * cz + p[3] < -r) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Branchless compaction: always store, advance only for visible lanes.
+inline GLsizei CompactLanes(unsigned mask, int lanes, GLuint first, GLuint *visible) {
+  GLsizei n = 0;
+  for (int lane = 0; lane < lanes; lane++) {
+    visible[n] = first + lane;
+    n += (mask >> lane) & 1;
+  }
+  return n;
+}
+
+}  // namespace detail
+
+GLsizei CullSpheres(const Frustum &frustum,
+                    const float *x,
+                    const float *y,
+                    const float *z,
+                    const float *radius,
+                    GLsizei count,
+                    GLuint *visible) {
+  PROTO3D_PROFILE_SCOPE("CullSpheres");
+  GLsizei i = 0, n = 0;
+#if defined(__AVX2__)
+  __m256 planes[6][4];
+  for (int p = 0; p < 6; p++) {
+    for (int c = 0; c < 4; c++) {
+      planes[p][c] = _mm256_set1_ps(frustum.planes[p][c]);
+    }
+  }
+  for (; i + 8 <= count; i += 8) {
+    __m256 vx     = _mm256_loadu_ps(x + i);
+    __m256 vy     = _mm256_loadu_ps(y + i);
+    __m256 vz     = _mm256_loadu_ps(z + i);
+    __m256 neg_r  = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(radius + i));
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (int p = 0; p < 6; p++) {
+      __m256 d = detail::Madd256(planes[p][2], vz, planes[p][3]);
+      d        = detail::Madd256(planes[p][1], vy, d);
+      d        = detail::Madd256(planes[p][0], vx, d);
+      inside   = _mm256_and_ps(inside, _mm256_cmp_ps(d, neg_r, _CMP_GE_OQ));
+    }
+    n += detail::CompactLanes(_mm256_movemask_ps(inside), 8, i, visible + n);
+  }
+#elif defined(__SSE2__)
+  __m128 planes[6][4];
+  for (int p = 0; p < 6; p++) {
+    for (int c = 0; c < 4; c++) {
+      planes[p][c] = _mm_set1_ps(frustum.planes[p][c]);
+    }
+  }
+  for (; i + 4 <= count; i += 4) {
+    __m128 vx     = _mm_loadu_ps(x + i);
+    __m128 vy     = _mm_loadu_ps(y + i);
+    __m128 vz     = _mm_loadu_ps(z + i);
+    __m128 neg_r  = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(radius + i));
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (int p = 0; p < 6; p++) {
+      __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], vx), _mm_mul_ps(planes[p][1], vy)),
+                            _mm_add_ps(_mm_mul_ps(planes[p][2], vz), planes[p][3]));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(d, neg_r));
+    }
+    n += detail::CompactLanes(_mm_movemask_ps(inside), 4, i, visible + n);
+  }
+#endif
+  for (; i < count; i++) {
+    visible[n] = i;
+    n += detail::SphereVisible(frustum, x[i], y[i], z[i], radius[i]);
+  }
+  return n;
+}
+
+GLsizei CullBoxes(const Frustum &frustum,
+                  const float *center_x,
+                  const float *center_y,
+                  const float *center_z,
+                  const float *extent_x,
+                  const float *extent_y,
+                  const float *extent_z,
+                  GLsizei count,
+                  GLuint *visible) {
+  PROTO3D_PROFILE_SCOPE("CullBoxes");
+  GLsizei i = 0, n = 0;
+#if defined(__AVX2__)
+  __m256 planes[6][4], abs_normals[6][3];
+  for (int p = 0; p < 6; p++) {
+    for (int c = 0; c < 4; c++) {
+      planes[p][c] = _mm256_set1_ps(frustum.planes[p][c]);
+    }
+    for (int c = 0; c < 3; c++) {
+      abs_normals[p][c] = _mm256_set1_ps(fabsf(frustum.planes[p][c]));
+    }
+  }
+  for (; i + 8 <= count; i += 8) {
+    __m256 cx = _mm256_loadu_ps(center_x + i), cy = _mm256_loadu_ps(center_y + i),
+           cz = _mm256_loadu_ps(center_z + i);
+    __m256 ex = _mm256_loadu_ps(extent_x + i), ey = _mm256_loadu_ps(extent_y + i),
+           ez = _mm256_loadu_ps(extent_z + i);
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (int p = 0; p < 6; p++) {
+      __m256 d = detail::Madd256(planes[p][2], cz, planes[p][3]);
+      d        = detail::Madd256(planes[p][1], cy, d);
+      d        = detail::Madd256(planes[p][0], cx, d);
+      __m256 r = _mm256_mul_ps(abs_normals[p][2], ez);
+      r        = detail::Madd256(abs_normals[p][1], ey, r);
+      r        = detail::Madd256(abs_normals[p][0], ex, r);
+      // d >= -r  <=>  d + r >= 0
+      inside = _mm256_and_ps(inside,
+                             _mm256_cmp_ps(_mm256_add_ps(d, r), _mm256_setzero_ps(), _CMP_GE_OQ));
+    }
+    n += detail::CompactLanes(_mm256_movemask_ps(inside), 8, i, visible + n);
+  }
+#elif defined(__SSE2__)
+  __m128 planes[6][4], abs_normals[6][3];
+  for (int p = 0; p < 6; p++) {
+    for (int c = 0; c < 4; c++) {
+      planes[p][c] = _mm_set1_ps(frustum.planes[p][c]);
+    }
+    for (int c = 0; c < 3; c++) {
+      abs_normals[p][c] = _mm_set1_ps(fabsf(frustum.planes[p][c]));
+    }
+  }
+  for (; i + 4 <= count; i += 4) {
+    __m128 cx = _mm_loadu_ps(center_x + i), cy = _mm_loadu_ps(center_y + i),
+           cz = _mm_loadu_ps(center_z + i);
+    __m128 ex = _mm_loadu_ps(extent_x + i), ey = _mm_loadu_ps(extent_y + i),
+           ez = _mm_loadu_ps(extent_z + i);
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (int p = 0; p < 6; p++) {
+      __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planes[p][0], cx), _mm_mul_ps(planes[p][1], cy)),
+                            _mm_add_ps(_mm_mul_ps(planes[p][2], cz), planes[p][3]));
+      __m128 r = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(abs_normals[p][0], ex), _mm_mul_ps(abs_normals[p][1], ey)),
+          _mm_mul_ps(abs_normals[p][2], ez));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+    }
+    n += detail::CompactLanes(_mm_movemask_ps(inside), 4, i, visible + n);
+  }
+#endif
+  for (; i < count; i++) {
+    visible[n] = i;
+    n += detail::BoxVisible(frustum,
+                            center_x[i],
+                            center_y[i],
+                            center_z[i],
+                            extent_x[i],
+                            extent_y[i],
+                            extent_z[i]);
+  }
+  return n;
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Frustum culling
+
+namespace gl {
+
+namespace detail {
+// Uniform setters {{{
+// UniformSetterFn covers glUniform{1|2|3|4}{f|i|ui}
+
+template <typename T>
+struct UniformSetterFn {
+  void operator()(GLint location, T v0) { glUniform1f(location, v0); }
+
+  void operator()(GLint location, T v0, T v1) { glUniform2f(location, v0, v1); }
+
+  void operator()(GLint location, T v0, T v1, T v2) { glUniform3f(location, v0, v1, v2); }
+
+  void operator()(GLint location, T v0, T v1, T v2, T v3) { glUniform4f(location, v0, v1, v2, v3); }
+};
+
+template <>
+struct UniformSetterFn<GLint> {
+  void operator()(GLint location, GLint v0) { glUniform1i(location, v0); }
+
+  void operator()(GLint location, GLint v0, GLint v1) { glUniform2i(location, v0, v1); }
+
+  void operator()(GLint location, GLint v0, GLint v1, GLint v2) {
+    glUniform3i(location, v0, v1, v2);
+  }
+
+  void operator()(GLint location, GLint v0, GLint v1, GLint v2, GLint v3) {
+    glUniform4i(location, v0, v1, v2, v3);
+  }
+};
+
+template <>
+struct UniformSetterFn<GLuint> {
+  void operator()(GLint location, GLuint v0) { glUniform1ui(location, v0); }
+
+  void operator()(GLint location, GLuint v0, GLuint v1) { glUniform2ui(location, v0, v1); }
+
+  void operator()(GLint location, GLuint v0, GLuint v1, GLuint v2) {
+    glUniform3ui(location, v0, v1, v2);
+  }
+
+  void operator()(GLint location, GLuint v0, GLuint v1, GLuint v2, GLuint v3) {
+    glUniform4ui(location, v0, v1, v2, v3);
+  }
+};
+
+// Vec{1|2|3|4}UniformSetterFn covers glUniform{1|2|3|4}{f|i|ui}v
+
+/// @param T the type of the vector component
+template <typename T>
+struct UniformVec1SetterFn;
+
+// UniformVec1SetterFn {{{
+
+template <>
+struct UniformVec1SetterFn<GLfloat> {
+  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
+    glUniform1fv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec1SetterFn<GLint> {
+  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
+    glUniform1iv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec1SetterFn<GLuint> {
+  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
+    glUniform1uiv(location, count, value_ptr);
+  }
+};
+
+// }}}
+
+/// @param T the type of the vector component
+template <typename T>
+struct UniformVec2SetterFn;
+
+// UniformVec2SetterFn {{{
+
+template <>
+struct UniformVec2SetterFn<GLfloat> {
+  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
+    glUniform2fv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec2SetterFn<GLint> {
+  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
+    glUniform2iv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec2SetterFn<GLuint> {
+  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
+    glUniform2uiv(location, count, value_ptr);
+  }
+};
+
+// }}}
+
+/// @param T the type of the vector component
+template <typename T>
+struct UniformVec3SetterFn;
+
+// UniformVec3SetterFn {{{
+
+template <>
+struct UniformVec3SetterFn<GLfloat> {
+  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
+    glUniform3fv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec3SetterFn<GLint> {
+  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
+    glUniform3iv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec3SetterFn<GLuint> {
+  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
+    glUniform3uiv(location, count, value_ptr);
+  }
+};
+
+// }}}
+
+/// @param T the type of the vector component
+template <typename T>
+struct UniformVec4SetterFn;
+
+// UniformVec4SetterFn {{{
+
+template <>
+struct UniformVec4SetterFn<GLfloat> {
+  void operator()(GLint location, GLsizei count, const GLfloat *value_ptr) {
+    glUniform4fv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec4SetterFn<GLint> {
+  void operator()(GLint location, GLsizei count, const GLint *value_ptr) {
+    glUniform4iv(location, count, value_ptr);
+  }
+};
+
+template <>
+struct UniformVec4SetterFn<GLuint> {
+  void operator()(GLint location, GLsizei count, const GLuint *value_ptr) {
+    glUniform4uiv(location, count, value_ptr);
+  }
+};
+
+// }}}
+
+// GLM versions {{{
+#ifdef PROTO3D_USE_GLM
+
+struct UniformGLMVecSetterFn {
+  void operator()(GLint location, const glm::vec2 &value) {
+    glUniform2fv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::vec3 &value) {
+    glUniform3fv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::vec4 &value) {
+    glUniform4fv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::ivec2 &value) {
+    glUniform2iv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::ivec3 &value) {
+    glUniform3iv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::ivec4 &value) {
+    glUniform4iv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::uvec2 &value) {
+    glUniform2uiv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::uvec3 &value) {
+    glUniform3uiv(location, 1, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, const glm::uvec4 &value) {
+    glUniform4uiv(location, 1, glm::value_ptr(value));
+  }
+};
+
+struct UniformGLMMatSetterFn {
+  void operator()(GLint location, GLboolean transpose, const glm::mat2 &value) {
+    glUniformMatrix2fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat3 &value) {
+    glUniformMatrix3fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat4 &value) {
+    glUniformMatrix4fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat2x3 &value) {
+    glUniformMatrix2x3fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat3x2 &value) {
+    glUniformMatrix3x2fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat2x4 &value) {
+    glUniformMatrix2x4fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat4x2 &value) {
+    glUniformMatrix4x2fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat3x4 &value) {
+    glUniformMatrix3x4fv(location, 1, transpose, glm::value_ptr(value));
+  }
+
+  void operator()(GLint location, GLboolean transpose, const glm::mat4x3 &value) {
+    glUniformMatrix4x3fv(location, 1, transpose, glm::value_ptr(value));
+  }
+};
+
+#endif
+// }}}
+// }}} END of Uniform setters
+
+// Texture (detail) {{{
+
+/// Sets a texture parameter of type T.
+template <typename T>
+struct TexParameterSetterFn {
+  void operator()(GLenum target, GLenum pname, T param) { glTexParameteri(target, pname, param); }
+};
+
+template <>
+struct TexParameterSetterFn<GLfloat> {
+  void operator()(GLenum target, GLenum pname, GLfloat param) {
+    glTexParameterf(target, pname, param);
+  }
+};
+
+/// Sets a vector (e.g. border color) texture parameter of component type `T`.
+/// `InternalFormatT` refers to the type OpenGL actually uses internally to store
+/// the values. If you don't care about the internal format used it will most
+/// likely be `GLfloat`. If you want integers to remain integers inside OpenGl
+/// memory, use `GL[u]int` as `InternalFormatT` template parameter.
+///
+/// http://stackoverflow.com/questions/27787418/whats-the-use-case-of-gltexparameteriiv-and-gltexparameteriuiv/27788014
+template <typename T, typename InternalFormatT = GLfloat>
+struct VecTexParameterSetterFn;
+
+template <>
+struct VecTexParameterSetterFn<GLint> {
+  void operator()(GLenum target, GLenum pname, const GLint *param) {
+    glTexParameteriv(target, pname, param);
+  }
+};
+
+template <>
+struct VecTexParameterSetterFn<GLfloat> {
+  void operator()(GLenum target, GLenum pname, const GLfloat *param) {
+    glTexParameterfv(target, pname, param);
+  }
+};
+
+template <>
+struct VecTexParameterSetterFn<GLint, GLint> {
+  void operator()(GLenum target, GLenum pname, const GLint *param) {
+    glTexParameterIiv(target, pname, param);
+  }
+};
+
+template <>
+struct VecTexParameterSetterFn<GLuint, GLuint> {
+  void operator()(GLenum target, GLenum pname, const GLuint *param) {
+    glTexParameterIuiv(target, pname, param);
+  }
+};
+
+/// Estimated size in bytes of a texel stored with `internal_format`, for
+/// memory accounting. Unsized formats are assumed to be 8 bits per
+/// component, and 3-component formats to be padded to 4 bytes as most
+/// drivers do.
+inline GLint BytesPerTexel(GLenum internal_format) {
+  switch (internal_format) {
+    case GL_RED:
+    case GL_R8:
+    case GL_STENCIL_INDEX8:
+      return 1;
+    case GL_RG:
+    case GL_RG8:
+    case GL_R16F:
+    case GL_DEPTH_COMPONENT16:
+      return 2;
+    case GL_RGB:
+    case GL_RGB8:
+    case GL_SRGB8:
+    case GL_RGBA:
+    case GL_RGBA8:
+    case GL_SRGB8_ALPHA8:
+    case GL_RG16F:
+    case GL_R32F:
+    case GL_R11F_G11F_B10F:
+    case GL_RGB10_A2:
+    case GL_DEPTH_COMPONENT:
+    case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32F:
+    case GL_DEPTH24_STENCIL8:
+    case GL_DEPTH_STENCIL:
+      return 4;
+    case GL_RGBA16F:
+    case GL_RGB16F:
+    case GL_RG32F:
+    case GL_DEPTH32F_STENCIL8:
+      return 8;
+    case GL_RGBA32F:
+    case GL_RGB32F:
+      return 16;
+    default:
+      return 4;
+  }
+}
+
+/// Sized internal format for an unsized `format` uploaded as GL_UNSIGNED_BYTE.
+/// Sized formats are returned unchanged.
+inline GLenum SizedInternalFormat(GLenum format) {
+  switch (format) {
+    case GL_RED:
+      return GL_R8;
+    case GL_RG:
+      return GL_RG8;
+    case GL_RGB:
+      return GL_RGB8;
+    case GL_RGBA:
+      return GL_RGBA8;
+    case GL_DEPTH_COMPONENT:
+      return GL_DEPTH_COMPONENT24;
+    case GL_DEPTH_STENCIL:
+      return GL_DEPTH24_STENCIL8;
+    default:
+      return format;
+  }
+}
+
+/// Pixel transfer format and type compatible with a sized `internal_format`,
+/// used to allocate levels with glTexImage2D(..., nullptr).
+inline void TransferFormat(GLenum internal_format, GLenum *format, GLenum *type) {
+  *type = GL_UNSIGNED_BYTE;
+  switch (internal_format) {
+    case GL_R8:
+      *format = GL_RED;
+      return;
+    case GL_R16F:
+    case GL_R32F:
+      *format = GL_RED;
+      *type   = GL_FLOAT;
+      return;
+    case GL_RG8:
+      *format = GL_RG;
+      return;
+    case GL_RG16F:
+    case GL_RG32F:
+      *format = GL_RG;
+      *type   = GL_FLOAT;
+      return;
+    case GL_RGB8:
+    case GL_SRGB8:
+      *format = GL_RGB;
+      return;
+    case GL_RGB16F:
+    case GL_RGB32F:
+    case GL_R11F_G11F_B10F:
+      *format = GL_RGB;
+      *type   = GL_FLOAT;
+      return;
+    case GL_RGBA16F:
+    case GL_RGBA32F:
+      *format = GL_RGBA;
+      *type   = GL_FLOAT;
+      return;
+    case GL_RGB10_A2:
+      *format = GL_RGBA;
+      *type   = GL_UNSIGNED_INT_2_10_10_10_REV;
+      return;
+    case GL_DEPTH_COMPONENT16:
+    case GL_DEPTH_COMPONENT24:
+      *format = GL_DEPTH_COMPONENT;
+      *type   = GL_UNSIGNED_INT;
+      return;
+    case GL_DEPTH_COMPONENT32F:
+      *format = GL_DEPTH_COMPONENT;
+      *type   = GL_FLOAT;
+      return;
+    case GL_DEPTH24_STENCIL8:
+      *format = GL_DEPTH_STENCIL;
+      *type   = GL_UNSIGNED_INT_24_8;
+      return;
+    case GL_DEPTH32F_STENCIL8:
+      *format = GL_DEPTH_STENCIL;
+      *type   = GL_FLOAT_32_UNSIGNED_INT_24_8_REV;
+      return;
+    default:  // GL_RGBA8, GL_SRGB8_ALPHA8...
+      *format = GL_RGBA;
+      return;
+  }
+}
+
+/// Number of GL_UNSIGNED_BYTE components per pixel of a transfer `format`.
+inline GLint ComponentCount(GLenum format) {
+  switch (format) {
+    case GL_RED:
+      return 1;
+    case GL_RG:
+      return 2;
+    case GL_RGB:
+      return 3;
+    default:
+      return 4;
+  }
+}
+
+/// Bytes per pixel of tightly packed client memory for a transfer `format` and
+/// `type` (see TransferFormat()), e.g. 16 for GL_RGBA + GL_FLOAT.
+inline GLint TransferBytesPerPixel(GLenum format, GLenum type) {
+  switch (type) {
+    case GL_UNSIGNED_INT_2_10_10_10_REV:
+    case GL_UNSIGNED_INT_24_8:
+      return 4;
+    case GL_FLOAT_32_UNSIGNED_INT_24_8_REV:
+      return 8;
+    default:
+      break;
+  }
+  GLint components = (format == GL_DEPTH_COMPONENT) ? 1 : ComponentCount(format);
+  switch (type) {
+    case GL_HALF_FLOAT:
+      return components * 2;
+    case GL_FLOAT:
+    case GL_UNSIGNED_INT:
+      return components * 4;
+    default:
+      return components;
+  }
+}
+
+/// GL_TEXTURE_MAG_FILTER matching a GL_TEXTURE_MIN_FILTER: magnification has
+/// no mipmap variants, GL_*_MIPMAP_* filters are GL_INVALID_ENUM there.
+inline GLenum MagFilter(GLenum min_filter) {
+  switch (min_filter) {
+    case GL_NEAREST_MIPMAP_NEAREST:
+    case GL_NEAREST_MIPMAP_LINEAR:
+      return GL_NEAREST;
+    case GL_LINEAR_MIPMAP_NEAREST:
+    case GL_LINEAR_MIPMAP_LINEAR:
+      return GL_LINEAR;
+    default:
+      return min_filter;
+  }
+}
+
+/// Sets GL_UNPACK_ALIGNMENT to the largest alignment (up to the default 4)
+/// rows of `row_bytes` bytes satisfy, and restores the default on exit.
+/// Tightly packed GL_RED, GL_RG and GL_RGB rows are often not 4-byte aligned.
+class UnpackAlignmentScope {
+ public:
+  explicit UnpackAlignmentScope(GLsizei row_bytes)
+      : alignment((row_bytes % 4 == 0) ? 4 : (row_bytes % 2 == 0) ? 2 : 1) {
+    if (alignment != 4) {
+      glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+    }
+  }
+
+  ~UnpackAlignmentScope() {
+    if (alignment != 4) {
+      glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+  }
+
+ private:
+  GLint alignment;
+};
+
+/// Sets the pixel pack state glReadPixels() and glGetTexImage() write with
+/// (`alignment`, no GL_PACK_ROW_LENGTH or GL_PACK_SKIP_*) and restores the
+/// previous state on exit.
+class PackStateScope {
+ public:
+  explicit PackStateScope(GLint alignment) : wanted{alignment, 0, 0, 0} {
+    for (int i = 0; i < 4; i++) {
+      glGetIntegerv(Name(i), &previous[i]);
+      if (previous[i] != wanted[i]) {
+        glPixelStorei(Name(i), wanted[i]);
+      }
+    }
+  }
+
+  ~PackStateScope() {
+    for (int i = 0; i < 4; i++) {
+      if (previous[i] != wanted[i]) {
+        glPixelStorei(Name(i), previous[i]);
+      }
+    }
+  }
+
+ private:
+  static GLenum Name(int i) {
+    static const GLenum names[4] = {
+        GL_PACK_ALIGNMENT, GL_PACK_ROW_LENGTH, GL_PACK_SKIP_PIXELS, GL_PACK_SKIP_ROWS};
+    return names[i];
+  }
+
+  GLint wanted[4];
+  GLint previous[4];
+};
+// }}} END of Texture (detail)
+}  // namespace detail
+
+// OpenGL debugging utilities {{{
+#ifdef PROTO3D_USE_GL_VERSION_4_3
+// OpenGL 4.3 only
+void ReportAllErrorsViaCallback(const char *origin);
+#endif
+
+const char *LastErrorString();
+const char *FramebufferStatusString();
+void CheckLeaks();
+
+/// Whether the current context is at least OpenGL `major`.`minor`.
+bool HasVersion(GLint major, GLint minor);
+/// Whether the current context exposes `extension` (e.g. "GL_ARB_bindless_texture").
+bool HasExtension(const char *extension);
+// }}} END of OpenGL debugging utilities
+
+// Resource registry {{{
+
+enum ResourceType {
+  kResourceBuffer,
+  kResourceVertexArray,
+  kResourceTexture,
+  kResourceShader,
+  kResourceProgram,
+  kResourceFramebuffer,
+  kResourceRenderbuffer,
+  kResourceSampler,
+  kResourceTypeCount
+};
+
+const char *ResourceTypeName(ResourceType type);
+
+/// Live object count and estimated GPU memory of a ResourceType.
+struct ResourceStats {
+  int64_t count;
+  int64_t bytes;
+};
+
+/// A live object as recorded by the ResourceRegistry.
+struct ResourceInfo {
+  ResourceType type;
+  GLuint id;
+  int64_t bytes;
+  /// Where the object was created or nullptr if the compiler can't tell.
+  const char *file;
+  int line;
+};
+
+#ifndef PROTO3D_RESOURCE_REGISTRY_CAPACITY
+#define PROTO3D_RESOURCE_REGISTRY_CAPACITY 16384
+#endif
+
+/// Tracks every VBO, VAO, Texture, Shader and Program created through
+/// proto3d, together with the call site that created it and an estimate of
+/// the GPU memory it uses.
+///
+/// Enabled by PROTO3D_USE_RESOURCE_REGISTRY. Inserts and removals are
+/// lock-free (open addressing over atomic keys) so objects can be created
+/// from any thread. Removed slots become empty again rather than tombstones,
+/// and lookups probe as far as the longest probe any insert needed, so the
+/// cost of a miss doesn't grow with create/delete churn. Per-type totals are
+/// kept up to date on every change, so Live() is O(1) and ForEachLive() only
+/// walks the fixed-size table.
+///
+/// Objects that don't fit in the table (see
+/// PROTO3D_RESOURCE_REGISTRY_CAPACITY) still count in Live() but can't be
+/// enumerated. Untracked() tells how many of those were seen.
+///
+/// Objects are keyed by type and name only: the registry is global and
+/// supports a single context, or several contexts sharing their objects. With
+/// unshared contexts, names collide and the counts are wrong.
+class ResourceRegistry {
+ public:
+  static ResourceRegistry &Global();
+
+  void Insert(ResourceType type, GLuint id, const char *file, int line);
+  void Remove(ResourceType type, GLuint id);
+  void SetBytes(ResourceType type, GLuint id, int64_t bytes);
+
+  ResourceStats Live(ResourceType type) const {
+    ResourceStats stats;
+    stats.count = live_count[type].load(std::memory_order_relaxed);
+    stats.bytes = live_bytes[type].load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  int64_t Untracked() const { return untracked.load(std::memory_order_relaxed); }
+
+  /// Call `fn(const ResourceInfo &)` for every tracked live object.
+  template <class Fn>
+  void ForEachLive(Fn fn) const {
+    for (const Entry &entry : entries) {
+      uint64_t key = entry.key.load(std::memory_order_acquire);
+      if (key == kEmptyKey) {
+        continue;
+      }
+      ResourceInfo info;
+      info.type  = (ResourceType)((key >> 32) - 1);
+      info.id    = (GLuint)key;
+      info.bytes = entry.bytes.load(std::memory_order_relaxed);
+      info.file  = entry.file.load(std::memory_order_relaxed);
+      info.line  = entry.line.load(std::memory_order_relaxed);
+      fn(info);
+    }
+  }
+
+ private:
+  static const uint64_t kEmptyKey = 0;
+  static const size_t kCapacity   = PROTO3D_RESOURCE_REGISTRY_CAPACITY;
+  static_assert((kCapacity & (kCapacity - 1)) == 0,
+                "PROTO3D_RESOURCE_REGISTRY_CAPACITY must be a power of two");
+
+  struct Entry {
+    std::atomic<uint64_t> key;
+    std::atomic<int64_t> bytes;
+    std::atomic<const char *> file;
+    std::atomic<int> line;
+  };
+
+  Entry entries[kCapacity];
+  std::atomic<int64_t> live_count[kResourceTypeCount];
+  std::atomic<int64_t> live_bytes[kResourceTypeCount];
+  std::atomic<int64_t> untracked;
+  /// Objects of each type that didn't fit and weren't deleted yet
+  std::atomic<int64_t> untracked_live[kResourceTypeCount];
+  /// Longest distance from its home slot at which a key was inserted
+  std::atomic<size_t> max_probe;
+
+  static size_t Home(uint64_t key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 40) & (kCapacity - 1);
+  }
+
+  static uint64_t Key(ResourceType type, GLuint id) {
+    return ((uint64_t)(type + 1) << 32) | (uint64_t)id;
+  }
+
+  Entry *Find(uint64_t key);
+};
+
+namespace detail {
+
+// Hooks called by the object classes. They compile to nothing unless
+// PROTO3D_USE_RESOURCE_REGISTRY is defined.
+
+inline void TrackCreate(ResourceType type, GLuint id, const char *file, int line) {
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+  ResourceRegistry::Global().Insert(type, id, file, line);
+#endif
+}
+
+inline void TrackCreate(
+    ResourceType type, const GLuint *ids, GLsizei count, const char *file, int line) {
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+  for (GLsizei i = 0; i < count; i++) {
+    ResourceRegistry::Global().Insert(type, ids[i], file, line);
+  }
+#endif
+}
+
+inline void TrackDelete(ResourceType type, GLuint id) {
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+  ResourceRegistry::Global().Remove(type, id);
+#endif
+}
+
+inline void TrackDelete(ResourceType type, const GLuint *ids, GLsizei count) {
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+  for (GLsizei i = 0; i < count; i++) {
+    ResourceRegistry::Global().Remove(type, ids[i]);
+  }
+#endif
+}
+
+inline void TrackBytes(ResourceType type, GLuint id, int64_t bytes) {
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+  ResourceRegistry::Global().SetBytes(type, id, bytes);
+#endif
+}
+
+}  // namespace detail
+
+#ifdef PROTO3D_IMPLEMENTATION
+const char *ResourceTypeName(ResourceType type) {
+  switch (type) {
+    case kResourceBuffer:
+      return "Buffer";
+    case kResourceVertexArray:
+      return "VertexArray";
+    case kResourceTexture:
+      return "Texture";
+    case kResourceShader:
+      return "Shader";
+    case kResourceProgram:
+      return "Program";
+    case kResourceFramebuffer:
+      return "Framebuffer";
+    case kResourceRenderbuffer:
+      return "Renderbuffer";
+    case kResourceSampler:
+      return "Sampler";
+    default:
+      return "unknown resource type";
+  }
+}
+
+ResourceRegistry &ResourceRegistry::Global() {
+  // Zero-initialized static storage: every key is kEmptyKey.
+  static ResourceRegistry registry;
+  return registry;
+}
+
+ResourceRegistry::Entry *ResourceRegistry::Find(uint64_t key) {
+  // Empty slots don't end the search: removals empty their slot even if keys
+  // inserted after it are further along the probe sequence
+  size_t mask        = kCapacity - 1;
+  size_t i           = Home(key);
+  size_t probe_count = max_probe.load(std::memory_order_acquire) + 1;
+  for (size_t probes = 0; probes < probe_count; probes++, i = (i + 1) & mask) {
+    if (entries[i].key.load(std::memory_order_acquire) == key) {
+      return &entries[i];
+    }
+  }
+  return nullptr;
+}
+
+void ResourceRegistry::Insert(ResourceType type, GLuint id, const char *file, int line) {
+  live_count[type].fetch_add(1, std::memory_order_relaxed);
+  uint64_t key = Key(type, id);
+  size_t mask  = kCapacity - 1;
+  size_t i     = Home(key);
+  for (size_t probes = 0; probes < kCapacity; probes++, i = (i + 1) & mask) {
+    uint64_t current = entries[i].key.load(std::memory_order_relaxed);
+    if (current != kEmptyKey) {
+      continue;
+    }
+    // Publish the probe length before the key so that Find() reaches it
+    size_t longest = max_probe.load(std::memory_order_relaxed);
+    while (longest < probes &&
+           !max_probe.compare_exchange_weak(longest, probes, std::memory_order_release)) {
+    }
+    if (entries[i].key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+      entries[i].bytes.store(0, std::memory_order_relaxed);
+      entries[i].file.store(file, std::memory_order_relaxed);
+      entries[i].line.store(line, std::memory_order_relaxed);
+      return;
+    }
+  }
+  untracked.fetch_add(1, std::memory_order_relaxed);
+  untracked_live[type].fetch_add(1, std::memory_order_relaxed);
+}
+
+void ResourceRegistry::Remove(ResourceType type, GLuint id) {
+  // Deleting name 0 is a no-op in OpenGL
+  if (id == 0) {
+    return;
+  }
+  uint64_t key = Key(type, id);
+  Entry *entry = Find(key);
+  if (entry == nullptr) {
+    // Either an object that didn't fit in the table or a double delete, which
+    // mustn't make the count negative
+    int64_t pending = untracked_live[type].load(std::memory_order_relaxed);
+    while (pending > 0 && !untracked_live[type].compare_exchange_weak(
+                              pending, pending - 1, std::memory_order_relaxed)) {
+    }
+    if (pending > 0) {
+      live_count[type].fetch_sub(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  // Take the bytes before freeing the slot for another Insert()
+  int64_t bytes     = entry->bytes.exchange(0, std::memory_order_relaxed);
+  uint64_t expected = key;
+  if (!entry->key.compare_exchange_strong(expected, kEmptyKey, std::memory_order_acq_rel)) {
+    return;  // removed concurrently
+  }
+  live_count[type].fetch_sub(1, std::memory_order_relaxed);
+  live_bytes[type].fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void ResourceRegistry::SetBytes(ResourceType type, GLuint id, int64_t bytes) {
+  Entry *entry = Find(Key(type, id));
+  if (entry == nullptr) {
+    return;
+  }
+  int64_t previous = entry->bytes.exchange(bytes, std::memory_order_relaxed);
+  live_bytes[type].fetch_add(bytes - previous, std::memory_order_relaxed);
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Resource registry
+
+// OpenGL Objects {{{
+
+/// Vertex data layout parameters used to describe VBOs.
+/// Pointer format data gets stored in VAOs.
+struct VertexPointerFormat {
+  GLint vertex_size;
+  GLenum comp_type;
+  GLboolean normalized;
+  GLsizei stride;
+  GLintptr offset;
+
+  VertexPointerFormat()
+      : vertex_size(4), comp_type(GL_FLOAT), normalized(GL_FALSE), stride(0), offset(0) {}
+
+  explicit VertexPointerFormat(GLint vertex_size) : VertexPointerFormat(vertex_size, GL_FLOAT) {}
+
+  VertexPointerFormat(GLint vertex_size, GLenum comp_type)
+      : vertex_size(vertex_size),
+        comp_type(comp_type),
+        normalized(GL_FALSE),
+        stride(0),
+        offset(0) {}
+};
+
+/// OpenGL Vertex Buffer Objects
+class VBO {
+ public:
+  GLuint id;
+
+  VBO(GLuint id) : id(id) {}  // NOLINT
+
+  VBO() : id(0) {}
+
+  void Create(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    assert(id == 0);
+    glGenBuffers(1, &id);
+    detail::TrackCreate(kResourceBuffer, id, file, line);
+  }
+
+  void Delete() {
+    assert(!Bound());
+    detail::TrackDelete(kResourceBuffer, id);
+    glDeleteBuffers(1, &id);
+  }
+
+  void Bind() const {
+    assert(id != 0);
+    glBindBuffer(GL_ARRAY_BUFFER, id);
+  }
+
+  void Unbind() const {
+    assert(id != 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  bool Bound() const {
+    assert(id != 0);
+    return id && id == CurrentBinding().id;
+  }
+
+  static VBO CurrentBinding() {
+    GLint current_vbo;
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &current_vbo);
+    return VBO((GLuint)current_vbo);
+  }
+
+  void LoadBufferData(const GLvoid *data, GLsizeiptr size) {
+    LoadBufferData(data, size, GL_STATIC_DRAW);
+  }
+
+  void LoadBufferData(const GLvoid *data, GLsizeiptr size, GLenum usage) {
+    assert(Bound());
+    glBufferData(GL_ARRAY_BUFFER, size, data, usage);
+    detail::TrackBytes(kResourceBuffer, id, size);
+  }
+};
+
+void Create(VBO *vbo_arr,
+            GLuint count,
+            const char *file = PROTO3D_CALLER_FILE,
+            int line         = PROTO3D_CALLER_LINE);
+void Delete(VBO *vbo_arr, GLuint count);
+
+#ifdef PROTO3D_IMPLEMENTATION
+void Create(VBO *vbo_arr, GLuint count, const char *file, int line) {
+  glGenBuffers(count, reinterpret_cast<GLuint *>(vbo_arr));
+  detail::TrackCreate(kResourceBuffer, reinterpret_cast<GLuint *>(vbo_arr), count, file, line);
+}
+
+void Delete(VBO *vbo_arr, GLuint count) {
+  for (GLuint i = 0; i < count; i++) {
+    assert(!vbo_arr[i].Bound());
+  }
+  detail::TrackDelete(kResourceBuffer, reinterpret_cast<GLuint *>(vbo_arr), count);
+  glDeleteBuffers(count, reinterpret_cast<GLuint *>(vbo_arr));
+}
+#endif  // PROTO3D_IMPLEMENTATION
+
+/// OpenGL Vertex Array Objects
+///
+/// A Vertex Array Object (VAO) is a container for a set of Vertex Buffer
+/// Objects (VBO) and their state.
+///
+/// The usage patter is:
+///
+///  - During scene initialization:
+///    1. Bind() the VAO
+///    2. Set vertex data state for a visual object using VBOs
+///    3. Unbind() the VAO
+///
+///  - In the render function:
+///    1. Bind() the VAO to restore all the of the vertex data state remembered
+///       by the VAO
+///    2. Call a glDraw*() function
+///    3. Unbind() the VAO
+///
+/// A Vertex Array Object (VAO) is an OpenGL container object that encapsulates
+/// the state needed to specify per-vertex attribute data to the OpenGL
+/// pipeline. To put it another way, a VAO remembers the states of buffer
+/// objects (see QOpenGLBuffer) and their associated state (e.g. vertex
+/// attribute divisors). This allows a very easy and efficient method of
+/// switching between OpenGL buffer states for rendering different "objects" in
+/// a scene. The QOpenGLVertexArrayObject class is a thin wrapper around an
+/// OpenGL VAO.
+class VAO {
+ public:
+  GLuint id;
+
+  VAO(GLuint id) : id(id) {}  // NOLINT
+
+  VAO() : id(0) {}
+
+  void Create(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    assert(id == 0);
+    glGenVertexArrays(1, &id);
+    detail::TrackCreate(kResourceVertexArray, id, file, line);
+  }
+
+  void Delete() {
+    assert(!Bound());
+    detail::TrackDelete(kResourceVertexArray, id);
+    glDeleteVertexArrays(1, &id);
+  }
+
+  void Bind() const {
+    assert(id != 0);
+    glBindVertexArray(id);
+  }
+
+  void Unbind() const {
+    assert(Bound());
+    glBindVertexArray(0);
+  }
+
+  bool Bound() const {
+    assert(id != 0);
+    return id && id == CurrentBinding().id;
+  }
+
+  static VAO CurrentBinding() {
+    GLint current_vao;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &current_vao);
+    return VAO((GLuint)current_vao);
+  }
+
+  static GLint MaxNumberOfArrays() {
+    GLint max_vertex_attribs;
+    glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &max_vertex_attribs);
+    return max_vertex_attribs;
   }
 
   void SetArrayFormat(GLint index, const VertexPointerFormat &format) {
     assert(Bound());
-    glVertexAttribPointer(index,
-                          format.vertex_size,
-                          format.comp_type,
-                          format.normalized,
-                          format.stride,
-                          (const GLvoid *)format.offset);
+    glVertexAttribPointer(index,
+                          format.vertex_size,
+                          format.comp_type,
+                          format.normalized,
+                          format.stride,
+                          (const GLvoid *)format.offset);
+  }
+
+  void EnableArray(GLint index) {
+    assert(Bound());
+    assert(index < MaxNumberOfArrays());
+    glEnableVertexAttribArray(index);
+  }
+
+  void DisableArray(GLint index) {
+    assert(Bound());
+    glDisableVertexAttribArray(index);
+  }
+
+  void AddArray(GLint index, const VBO vbo, const VertexPointerFormat &format) {
+    PROTO3D_PROFILE_SCOPE("VAO::AddArray");
+    assert(vbo.Bound());
+    SetArrayFormat(index, format);
+    EnableArray(index);
+  }
+
+  VBO AddArray(GLint index,
+               const GLvoid *data,
+               GLsizeiptr size,
+               GLenum usage,
+               const VertexPointerFormat &format) {
+    PROTO3D_PROFILE_SCOPE("VAO::AddArray");
+    assert(VBO::CurrentBinding().id == 0 && "No VBO should be bound before VBO::AddArray()");
+    VBO vbo;
+    vbo.Create();
+    vbo.Bind();
+    vbo.LoadBufferData(data, size, usage);
+    AddArray(index, vbo, format);
+    vbo.Unbind();
+    return vbo;
+  }
+
+  VBO AddArray(GLint index,
+               const GLvoid *data,
+               GLsizeiptr size,
+               const VertexPointerFormat &format) {
+    return AddArray(index, data, size, GL_STATIC_DRAW, format);
+  }
+};
+
+void Create(VAO *vao_arr,
+            GLuint count,
+            const char *file = PROTO3D_CALLER_FILE,
+            int line         = PROTO3D_CALLER_LINE);
+void Delete(VAO *vao_arr, GLuint count);
+
+#ifdef PROTO3D_IMPLEMENTATION
+void Create(VAO *vao_arr, GLuint count, const char *file, int line) {
+  glGenVertexArrays(count, reinterpret_cast<GLuint *>(vao_arr));
+  detail::TrackCreate(
+      kResourceVertexArray, reinterpret_cast<GLuint *>(vao_arr), count, file, line);
+}
+
+void Delete(VAO *vao_arr, GLuint count) {
+  for (GLuint i = 0; i < count; i++) {
+    assert(!vao_arr[i].Bound());
+  }
+  detail::TrackDelete(kResourceVertexArray, reinterpret_cast<GLuint *>(vao_arr), count);
+  glDeleteVertexArrays(count, reinterpret_cast<GLuint *>(vao_arr));
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of OpenGL objects
+
+// OpenGL Shaders {{{
+
+/// Caller-provided storage for shader and program info logs.
+///
+/// The `Compile(InfoLog *)`, `Link(InfoLog *)` and `Validate(InfoLog *)`
+/// overloads write the log straight into `data` and only when the operation
+/// fails, so the success path doesn't query GL_INFO_LOG_LENGTH nor allocate.
+/// Logs longer than `size - 1` bytes are truncated.
+///
+///     char buffer[1024];
+///     InfoLog log(buffer, sizeof(buffer));
+///     if (!shader.Compile(&log)) {
+///       puts(log.data);
+///     }
+struct InfoLog {
+  char *data;
+  /// Capacity of `data` in bytes, including the 0 terminating byte.
+  GLsizei size;
+  /// Length of the last log written, not including the 0 terminating byte.
+  GLsizei length;
+
+  InfoLog(char *data, GLsizei size) : data(data), size(size), length(0) {
+    assert(size > 0);
+    data[0] = '\0';
+  }
+
+  void Clear() {
+    length  = 0;
+    data[0] = '\0';
+  }
+
+  /// An InfoLog backed by a 16KiB buffer owned by the calling thread. The
+  /// buffer is shared by every call to ThreadLocal() in the same thread.
+  static InfoLog ThreadLocal() {
+    static thread_local char buffer[16384];
+    return InfoLog(buffer, sizeof(buffer));
+  }
+};
+
+/// OpenGL Shader class
+///
+/// Usage example:
+///
+///     Shader shader;
+///     shader.Create(GL_VERTEX_SHADER);
+///     // You can get the type
+///     assert(shader.GetType() == GL_VERTEX_SHADER);
+///     // set the source from a C string or a proto3d::sdl::SourceFile
+///     shader.SetSource(sdl::SourceFile("shader.vert");
+///     // and compile the shader.
+///     std::unique_ptr<char[]> compilation_error = shader.Compile();
+///     if (compilation_error == nullptr) {
+///       bool compiled = shader.IsCompiled(); // true
+///       ...
+///     }
+///     // Shaders have to be deleted manually
+///     shader.Delete();
+class Shader {
+ public:
+  /// The shader name.
+  GLuint id;
+
+  Shader() = default;
+
+  Shader(GLuint id) : id(id) {}  // NOLINT
+
+  /// Create the Shader in OpenGL memory.
+  ///
+  /// @param shader_type Specifies the type of shader to be created.
+  ///                    Must be one of GL_VERTEX_SHADER,
+  ///                    GL_GEOMETRY_SHADER or GL_FRAGMENT_SHADER.
+  void Create(GLenum shader_type,
+              const char *file = PROTO3D_CALLER_FILE,
+              int line         = PROTO3D_CALLER_LINE) {
+    id = glCreateShader(shader_type);
+    detail::TrackCreate(kResourceShader, id, file, line);
+  }
+
+  void Delete() {
+    // It's OK to delete a shader even if it's linked to one or many programs.
+    // The shader will simply be flagged for deletion and once the programs are
+    // deleted, the shader is finally deleted.
+    //
+    // Program::Link(shaders...) attaches, links, and then detaches the shaders.
+    // It's recommended that you Delete(shaders...) after linking.
+    detail::TrackDelete(kResourceShader, id);
+    glDeleteShader(id);
+  }
+
+  void SetSource(const char *source) { glShaderSource(id, 1, &source, nullptr); }
+
+  void SetSources(GLsizei count, const char **sources) {
+    glShaderSource(id, count, sources, nullptr);
+  }
+
+  /// @return nullptr if success or the compilation error message in case of
+  /// failure
+  std::unique_ptr<char[]> Compile() {
+    glCompileShader(id);
+    if (IsCompiled()) {
+      return nullptr;
+    }
+    return GetInfoLog();
+  }
+
+  /// Compile the shader without allocating memory.
+  ///
+  /// @param log receives the compilation error message in case of failure
+  /// @return true if the shader compiled successfully
+  bool Compile(InfoLog *log) {
+    glCompileShader(id);
+    if (IsCompiled()) {
+      log->Clear();
+      return true;
+    }
+    GetInfoLog(log);
+    return false;
+  }
+
+  /// Write the info log into caller-provided storage.
+  void GetInfoLog(InfoLog *log) const {
+    glGetShaderInfoLog(id, log->size, &log->length, log->data);
+  }
+
+  std::unique_ptr<char[]> GetInfoLog(GLsizei *length_ptr = nullptr) const {
+    char *info_log;
+
+    // The size of the info log. size is better name than length because it
+    // includes the 0 terminating byte. size may be 0 though, in case it has no
+    // information log.
+    GLint size;
+    glGetShaderiv(id, GL_INFO_LOG_LENGTH, &size);
+
+    if (size == 0) {
+      return nullptr;
+    }
+    info_log = new char[size + 1];
+    glGetShaderInfoLog(id, size, length_ptr, info_log);
+
+    return std::unique_ptr<char[]>(info_log);
+  }
+
+  /// Returns the concatenation of the source strings that make up the shader
+  /// source for the shader, including the null termination character.
+  std::unique_ptr<char[]> GetSource(GLsizei *length_ptr = nullptr) const {
+    char *source;
+
+    // The size includes the 0 terminating character.
+    GLint size;
+    glGetShaderiv(id, GL_SHADER_SOURCE_LENGTH, &size);
+
+    if (size == 0) {
+      return nullptr;
+    }
+    source = new char[size + 1];
+    glGetShaderSource(id, size, length_ptr, source);
+
+    return std::unique_ptr<char[]>(source);
+  }
+
+  /// Write the shader source into caller-provided storage of `size` bytes.
+  /// The source is truncated if it doesn't fit.
+  void GetSource(char *source, GLsizei size, GLsizei *length_ptr = nullptr) const {
+    glGetShaderSource(id, size, length_ptr, source);
+  }
+
+  GLenum GetType() const {
+    GLint type;
+    glGetShaderiv(id, GL_SHADER_TYPE, &type);
+    return type;
+  }
+
+  /// Returns whether the shader is flagged for deletion.
+  bool IsDeleted() const {
+    GLint deleted;
+    glGetShaderiv(id, GL_DELETE_STATUS, &deleted);
+    return deleted == GL_TRUE;
+  }
+
+  bool IsCompiled() const {
+    GLint compiled;
+    glGetShaderiv(id, GL_COMPILE_STATUS, &compiled);
+    return compiled == GL_TRUE;
+  }
+};
+
+class Program {
+ public:
+  /// The program name.
+  GLuint id;
+
+  Program() = default;
+
+  Program(GLuint id) : id(id) {}  // NOLINT
+
+  void Create(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    id = glCreateProgram();
+    detail::TrackCreate(kResourceProgram, id, file, line);
+  }
+
+  void Delete() {
+    detail::TrackDelete(kResourceProgram, id);
+    glDeleteProgram(id);
+  }
+
+  void AttachShaders(Shader shader) { glAttachShader(id, shader.id); }
+
+  /// Attach shaders to this program.
+  template <class Shader, class... Shaders>
+  void AttachShaders(Shader shader, Shaders... shaders) {
+    glAttachShader(id, shader.id);
+    AttachShaders(shaders...);
+  }
+
+  void AttachShaders(Shader *shaders, int size) {
+    for (int i = 0; i < size; i++) {
+      AttachShaders(shaders[i]);
+    }
+  }
+
+  void DetachShaders(Shader shader) { glDetachShader(id, shader.id); }
+
+  /// Detach shaders from this program.
+  template <class... Shaders>
+  void DetachShaders(Shader shader, Shaders... shaders) {
+    glDetachShader(id, shader.id);
+    DetachShaders(shaders...);
+  }
+
+  void DetachShaders(Shader *shaders, int size) {
+    for (int i = 0; i < size; i++) {
+      DetachShaders(shaders[i]);
+    }
+  }
+
+  /// Link all the attached shaders to finish building the program.
+  std::unique_ptr<char[]> Link() {
+    PROTO3D_PROFILE_SCOPE("Program::Link");
+    glLinkProgram(id);
+    if (IsLinked()) {
+      return nullptr;
+    }
+    return GetInfoLog();
+  }
+
+  /// Link all the attached shaders without allocating memory.
+  ///
+  /// @param log receives the link error message in case of failure
+  /// @return true if the program linked successfully
+  bool Link(InfoLog *log) {
+    PROTO3D_PROFILE_SCOPE("Program::Link");
+    glLinkProgram(id);
+    if (IsLinked()) {
+      log->Clear();
+      return true;
+    }
+    GetInfoLog(log);
+    return false;
+  }
+
+  template <class Shader, class... Shaders>
+  std::unique_ptr<char[]> Link(Shader shader, Shaders... shaders) {
+    AttachShaders(shader, shaders...);
+    auto message = Link();
+    DetachShaders(shader, shaders...);
+    return message;
+  }
+
+  std::unique_ptr<char[]> Link(Shader *shaders, int size) {
+    AttachShaders(shaders, size);
+    auto message = Link();
+    DetachShaders(shaders, size);
+    return message;
+  }
+
+  bool Link(InfoLog *log, Shader *shaders, int size) {
+    AttachShaders(shaders, size);
+    bool linked = Link(log);
+    DetachShaders(shaders, size);
+    return linked;
+  }
+
+  /// Write the info log into caller-provided storage.
+  void GetInfoLog(InfoLog *log) const {
+    glGetProgramInfoLog(id, log->size, &log->length, log->data);
+  }
+
+  std::unique_ptr<char[]> GetInfoLog(GLsizei *length_p = nullptr) const {
+    char *info_log;
+
+    // The size of the info log. size is better name than length because it
+    // includes the 0 terminating byte. size may be 0 though, in case it has no
+    // information log.
+    GLint size;
+    glGetProgramiv(id, GL_INFO_LOG_LENGTH, &size);
+
+    if (size == 0) {
+      return nullptr;
+    }
+    info_log = new char[size + 1];
+    glGetProgramInfoLog(id, size, length_p, info_log);
+    return std::unique_ptr<char[]>(info_log);
+  }
+
+  std::unique_ptr<char[]> ValidationLog(bool *is_valid, GLsizei *length_ptr = nullptr) const {
+    // Validate the program
+    glValidateProgram(id);
+
+    // Query the validation status
+    GLint is_valid_i;
+    glGetProgramiv(id, GL_VALIDATE_STATUS, &is_valid_i);
+    *is_valid = is_valid_i;
+
+    // Return the info log that contains validation information
+    return GetInfoLog(length_ptr);
+  }
+
+  /// Validate the program without allocating memory.
+  ///
+  /// @param log receives the validation information if the program is invalid
+  /// @return true if the program is valid
+  bool Validate(InfoLog *log) const {
+    glValidateProgram(id);
+    GLint is_valid;
+    glGetProgramiv(id, GL_VALIDATE_STATUS, &is_valid);
+    if (is_valid) {
+      log->Clear();
+      return true;
+    }
+    GetInfoLog(log);
+    return false;
+  }
+
+  std::unique_ptr<Shader> GetAttachedShaders(GLint *count_ptr) const {
+    glGetProgramiv(id, GL_ATTACHED_SHADERS, count_ptr);
+    if (*count_ptr == 0) {
+      return nullptr;
+    }
+
+    auto shaders = new GLuint[*count_ptr];
+    glGetAttachedShaders(id, *count_ptr, count_ptr, shaders);
+
+    return std::unique_ptr<Shader>(reinterpret_cast<Shader *>(shaders));
+  }
+
+  bool IsLinked() const {
+    GLint linked;
+    glGetProgramiv(id, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+  }
+
+  bool IsDeleted() const {
+    GLint deleted;
+    glGetProgramiv(id, GL_DELETE_STATUS, &deleted);
+    return deleted == GL_TRUE;
+  }
+
+  void Use() const { glUseProgram(id); }
+
+  void Bind() const { glUseProgram(id); }
+
+  void Unbind() const { glUseProgram(0); }
+
+  /// Get the location of an attribute variable.
+  ///
+  /// Attribute variables can have a different value for each vertex (e.g. the
+  /// color of a corner of a triangle).
+  GLint AttribLocation(const GLchar *attrib_name) const {
+    GLint location = glGetAttribLocation(id, attrib_name);
+    return location;
+  }
+
+  /// Get the location of an uniform variable.
+  ///
+  /// Uniform variables keep the same value for multiple vertices (e.g. the
+  /// color of the whole triangle).
+  GLint UniformLocation(const GLchar *uniform_name) const {
+    GLint location = glGetUniformLocation(id, uniform_name);
+    return location;
+  }
+
+  // Uniform setters using locations {{{
+
+  /// Sets a shader uniform with up to 4 parameters for the vector components.
+  template <typename T, typename... U>
+  void SetUniform(GLint location, T v0, U... values) {
+    detail::UniformSetterFn<T> setter;
+    setter(location, v0, values...);
+  }
+
+  // Versions for pointer parameters
+
+  template <typename T>
+  void SetUniformVec1(GLint location, GLsizei count, const T *value_ptr) {
+    detail::UniformVec1SetterFn<T> setter;
+    setter(location, count, value_ptr);
+  }
+
+  template <typename T>
+  void SetUniformVec2(GLint location, GLsizei count, const T *value_ptr) {
+    detail::UniformVec2SetterFn<T> setter;
+    setter(location, count, value_ptr);
+  }
+
+  template <typename T>
+  void SetUniformVec3(GLint location, GLsizei count, const T *value_ptr) {
+    detail::UniformVec3SetterFn<T> setter;
+    setter(location, count, value_ptr);
+  }
+
+  template <typename T>
+  void SetUniformVec4(GLint location, GLsizei count, const T *value_ptr) {
+    detail::UniformVec4SetterFn<T> setter;
+    setter(location, count, value_ptr);
+  }
+
+#define UNIFORM_MATRIX_SETTER(DIMENSIONS)                                             \
+  void SetUniformMat##DIMENSIONS(                                                     \
+      GLint location, GLsizei count, GLboolean transpose, const GLfloat *value_ptr) { \
+    glUniformMatrix##DIMENSIONS##fv(location, count, transpose, value_ptr);           \
+  }
+
+  UNIFORM_MATRIX_SETTER(2)
+  UNIFORM_MATRIX_SETTER(3)
+  UNIFORM_MATRIX_SETTER(4)
+  UNIFORM_MATRIX_SETTER(2x3)
+  UNIFORM_MATRIX_SETTER(3x2)
+  UNIFORM_MATRIX_SETTER(2x4)
+  UNIFORM_MATRIX_SETTER(4x2)
+  UNIFORM_MATRIX_SETTER(3x4)
+  UNIFORM_MATRIX_SETTER(4x3)
+
+#undef UNIFORM_MATRIX_SETTER
+
+  // Versions for proto3d math types
+
+  void SetUniformVec4(GLint location, const Vec4 &value) {
+    glUniform4fv(location, 1, value.data());
+  }
+
+  void SetUniformVec4(GLint location, GLsizei count, const Vec4 *values) {
+    glUniform4fv(location, count, values->data());
+  }
+
+  void SetUniformMat4(GLint location, const Mat4 &value) {
+    glUniformMatrix4fv(location, 1, GL_FALSE, value.data());
+  }
+
+  void SetUniformMat4(GLint location, GLsizei count, const Mat4 *values) {
+    glUniformMatrix4fv(location, count, GL_FALSE, values->data());
+  }
+
+#ifdef PROTO3D_USE_GLM
+  // Versions for GLM types
+
+  /// Sets a GLM vector as a shader uniform variable.
+  template <class T>
+  void SetVecUniform(GLint location, const T &value) {
+    detail::UniformGLMVecSetterFn setter;
+    setter(location, value);
+  }
+
+  /// Sets a GLM matrix as a shader uniform variable.
+  template <class T>
+  void SetUniformMat(GLint location, const T &value) {
+    detail::UniformGLMMatSetterFn setter;
+    setter(location, GL_FALSE, value);
+  }
+
+  /// Sets a GLM matrix as a shader uniform variable.
+  template <class T>
+  void SetMatUniform(GLint location, GLboolean transpose, const T &value) {
+    detail::UniformGLMMatSetterFn setter;
+    setter(location, transpose, value);
+  }
+#endif  // PROTO3D_USE_GLM
+
+  // }}}
+
+  // Uniform setters using names {{{
+
+  /// Sets a shader uniform variable.
+  ///
+  /// @return the location of the uniform variable of -1 in case of error
+  template <typename... T>
+  GLint SetUniform(const GLchar *uniform_name, T... values) {
+    GLint location = UniformLocation(uniform_name);
+    if (location >= 0) {
+      SetUniform(location, values...);
+    }
+    return location;
+  }
+
+#define UNIFORM_VECTOR_SETTER_BY_NAME(DIMENSION)                       \
+  template <typename T>                                                \
+  GLint SetVec##DIMENSION##Uniform(                                    \
+      const GLchar *uniform_name, GLsizei count, const T *value_ptr) { \
+    GLint location = UniformLocation(uniform_name);                    \
+    if (location >= 0) {                                               \
+      SetVec##DIMENSION##Uniform(location, count, value_ptr);          \
+    }                                                                  \
+    return location;                                                   \
+  }
+
+  UNIFORM_VECTOR_SETTER_BY_NAME(1)
+  UNIFORM_VECTOR_SETTER_BY_NAME(2)
+  UNIFORM_VECTOR_SETTER_BY_NAME(3)
+  UNIFORM_VECTOR_SETTER_BY_NAME(4)
+
+#undef UNIFORM_VECTOR_SETTER_BY_NAME
+
+#define UNIFORM_MATRIX_SETTER_BY_NAME(DIMENSIONS)                                                 \
+  GLint Set##DIMENSIONS##UniformMat(                                                              \
+      const GLchar *uniform_name, GLsizei count, GLboolean transpose, const GLfloat *value_ptr) { \
+    GLint location = UniformLocation(uniform_name);                                               \
+    if (location >= 0) {                                                                          \
+      glUniformMatrix##DIMENSIONS##fv(location, count, transpose, value_ptr);                     \
+    }                                                                                             \
+    return location;                                                                              \
+  }
+
+  UNIFORM_MATRIX_SETTER_BY_NAME(2)
+  UNIFORM_MATRIX_SETTER_BY_NAME(3)
+  UNIFORM_MATRIX_SETTER_BY_NAME(4)
+  UNIFORM_MATRIX_SETTER_BY_NAME(2x3)
+  UNIFORM_MATRIX_SETTER_BY_NAME(3x2)
+  UNIFORM_MATRIX_SETTER_BY_NAME(2x4)
+  UNIFORM_MATRIX_SETTER_BY_NAME(4x2)
+  UNIFORM_MATRIX_SETTER_BY_NAME(3x4)
+  UNIFORM_MATRIX_SETTER_BY_NAME(4x3)
+
+#undef UNIFORM_MATRIX_SETTER_BY_NAME
+
+  /// Sets a shader uniform variable.
+  ///
+  /// @return the location of the uniform variable of -1 in case of error
+  template <class T>
+  GLint SetVecUniform(const GLchar *uniform_name, const T &value) {
+    GLint location = UniformLocation(uniform_name);
+    if (location >= 0) {
+      SetVecUniform(location, value);
+    }
+    return location;
+  }
+
+  /// Sets a shader uniform variable.
+  ///
+  /// @return the location of the uniform variable of -1 in case of error
+  template <class T>
+  GLint SetUniformMat(const GLchar *uniform_name, GLboolean transpose, const T &value) {
+    GLint location = UniformLocation(uniform_name);
+    if (location >= 0) {
+      SetUniformMat(location, transpose, value);
+    }
+    return location;
+  }
+
+  /// Sets a shader uniform variable.
+  ///
+  /// @return the location of the uniform variable of -1 in case of error
+  template <class T>
+  GLint SetUniformMat(const GLchar *uniform_name, const T &value) {
+    GLint location = UniformLocation(uniform_name);
+    if (location >= 0) {
+      SetUniformMat(location, value);
+    }
+    return location;
+  }
+
+  // }}}
+};
+// Program reflection {{{
+
+/// An active uniform, uniform block or vertex attribute of a linked Program.
+///
+/// Not every field applies to every kind of resource:
+///
+///  - uniforms: `location` is -1 for uniforms inside a block, in which case
+///    `block_index`, `offset`, `array_stride` and `matrix_stride` describe the
+///    layout inside the block's buffer.
+///  - uniform blocks: `location` is the uniform buffer binding point, `type` is
+///    GL_UNIFORM_BLOCK and `size` is GL_UNIFORM_BLOCK_DATA_SIZE in bytes.
+///  - attributes: `location` is the attribute location.
+struct ProgramResource {
+  GLint location;
+  GLenum type;
+  GLint size;
+  GLint block_index;
+  GLint offset;
+  GLint array_stride;
+  GLint matrix_stride;
+  GLint name_offset;  // into ProgramReflection::names
+};
+
+/// Flat table of all the active uniforms, uniform blocks and attributes of a
+/// Program, built in one pass after Link().
+///
+/// Resources are addressed by integer slots, so binders can keep slots instead
+/// of names and never call glGet*Location() at render time. Name lookups
+/// (FindUniform() and friends) are linear and meant for load time.
+///
+/// Usage example:
+///
+///     ProgramReflection reflection;
+///     reflection.Build(program);
+///     GLint mvp = reflection.FindUniform("mvp");
+///     ...
+///     program.SetUniformMat4(reflection.Uniform(mvp).location, 1, GL_FALSE, m);
+class ProgramReflection {
+ public:
+  /// Uniforms, then blocks, then attributes.
+  std::vector<ProgramResource> resources;
+  /// Zero-terminated resource names. Array names have the "[0]" suffix removed.
+  std::vector<char> names;
+
+  GLint num_uniforms;
+  GLint num_blocks;
+  GLint num_attribs;
+
+  ProgramReflection() : num_uniforms(0), num_blocks(0), num_attribs(0) {}
+
+  /// Enumerate GL_ACTIVE_UNIFORMS, GL_ACTIVE_UNIFORM_BLOCKS and
+  /// GL_ACTIVE_ATTRIBUTES of a linked program, replacing the previous contents.
+  void Build(const Program &program);
+
+  const ProgramResource &Uniform(GLint slot) const {
+    assert(slot >= 0 && slot < num_uniforms);
+    return resources[slot];
+  }
+
+  const ProgramResource &Block(GLint slot) const {
+    assert(slot >= 0 && slot < num_blocks);
+    return resources[num_uniforms + slot];
+  }
+
+  const ProgramResource &Attrib(GLint slot) const {
+    assert(slot >= 0 && slot < num_attribs);
+    return resources[num_uniforms + num_blocks + slot];
+  }
+
+  const char *Name(const ProgramResource &resource) const {
+    return names.data() + resource.name_offset;
+  }
+
+  /// @return the uniform slot or -1 if there's no active uniform with that name
+  GLint FindUniform(const char *name) const { return Find(0, num_uniforms, name); }
+
+  /// @return the block slot or -1 if there's no active block with that name
+  GLint FindBlock(const char *name) const { return Find(num_uniforms, num_blocks, name); }
+
+  /// @return the attribute slot or -1 if there's no active attribute with that
+  /// name
+  GLint FindAttrib(const char *name) const {
+    return Find(num_uniforms + num_blocks, num_attribs, name);
+  }
+
+  /// Check a CPU-side struct member against the std140/shared layout the
+  /// linker chose for a uniform inside a block.
+  ///
+  /// @return true if the uniform exists, lives in a block and has the offset
+  bool CheckBlockMemberOffset(const char *uniform_name, GLint offset) const {
+    GLint slot = FindUniform(uniform_name);
+    return slot >= 0 && Uniform(slot).block_index >= 0 && Uniform(slot).offset == offset;
+  }
+
+ private:
+  GLint Find(GLint first, GLint count, const char *name) const {
+    for (GLint i = 0; i < count; i++) {
+      if (strcmp(Name(resources[first + i]), name) == 0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  GLint AppendName(const char *name, GLsizei length);
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+GLint ProgramReflection::AppendName(const char *name, GLsizei length) {
+  if (length >= 3 && strcmp(name + length - 3, "[0]") == 0) {
+    length -= 3;
+  }
+  GLint name_offset = (GLint)names.size();
+  names.insert(names.end(), name, name + length);
+  names.push_back('\0');
+  return name_offset;
+}
+
+void ProgramReflection::Build(const Program &program) {
+  assert(program.IsLinked());
+  resources.clear();
+  names.clear();
+
+  GLint max_name_length = 0, max_block_name_length = 0, max_attrib_name_length = 0;
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &num_uniforms);
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCKS, &num_blocks);
+  glGetProgramiv(program.id, GL_ACTIVE_ATTRIBUTES, &num_attribs);
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_name_length);
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_block_name_length);
+  glGetProgramiv(program.id, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &max_attrib_name_length);
+  if (max_block_name_length > max_name_length) {
+    max_name_length = max_block_name_length;
+  }
+  if (max_attrib_name_length > max_name_length) {
+    max_name_length = max_attrib_name_length;
+  }
+  std::vector<char> name(max_name_length + 1);
+  resources.resize(num_uniforms + num_blocks + num_attribs);
+
+  // Uniforms: one glGetActiveUniformsiv() call per property for all of them
+  if (num_uniforms > 0) {
+    std::vector<GLuint> indices(num_uniforms);
+    std::vector<GLint> values(num_uniforms);
+    for (GLint i = 0; i < num_uniforms; i++) {
+      indices[i] = i;
+    }
+#define QUERY_UNIFORMS_PROPERTY(pname, field)                                            \
+  glGetActiveUniformsiv(program.id, num_uniforms, indices.data(), pname, values.data()); \
+  for (GLint i = 0; i < num_uniforms; i++) {                                             \
+    resources[i].field = values[i];                                                      \
+  }
+    QUERY_UNIFORMS_PROPERTY(GL_UNIFORM_TYPE, type);
+    QUERY_UNIFORMS_PROPERTY(GL_UNIFORM_SIZE, size);
+    QUERY_UNIFORMS_PROPERTY(GL_UNIFORM_BLOCK_INDEX, block_index);
+    QUERY_UNIFORMS_PROPERTY(GL_UNIFORM_OFFSET, offset);
+    QUERY_UNIFORMS_PROPERTY(GL_UNIFORM_ARRAY_STRIDE, array_stride);
+    QUERY_UNIFORMS_PROPERTY(GL_UNIFORM_MATRIX_STRIDE, matrix_stride);
+#undef QUERY_UNIFORMS_PROPERTY
+    for (GLint i = 0; i < num_uniforms; i++) {
+      GLsizei length;
+      glGetActiveUniformName(program.id, i, (GLsizei)name.size(), &length, name.data());
+      resources[i].location = (resources[i].block_index < 0)
+                                  ? glGetUniformLocation(program.id, name.data())
+                                  : -1;
+      resources[i].name_offset = AppendName(name.data(), length);
+    }
+  }
+
+  // Uniform blocks
+  for (GLint i = 0; i < num_blocks; i++) {
+    ProgramResource &block = resources[num_uniforms + i];
+    GLsizei length;
+    glGetActiveUniformBlockName(program.id, i, (GLsizei)name.size(), &length, name.data());
+    glGetActiveUniformBlockiv(program.id, i, GL_UNIFORM_BLOCK_BINDING, &block.location);
+    glGetActiveUniformBlockiv(program.id, i, GL_UNIFORM_BLOCK_DATA_SIZE, &block.size);
+    block.type          = GL_UNIFORM_BLOCK;
+    block.block_index   = i;
+    block.offset        = 0;
+    block.array_stride  = 0;
+    block.matrix_stride = 0;
+    block.name_offset   = AppendName(name.data(), length);
+  }
+
+  // Attributes
+  for (GLint i = 0; i < num_attribs; i++) {
+    ProgramResource &attrib = resources[num_uniforms + num_blocks + i];
+    GLsizei length;
+    glGetActiveAttrib(
+        program.id, i, (GLsizei)name.size(), &length, &attrib.size, &attrib.type, name.data());
+    attrib.location      = glGetAttribLocation(program.id, name.data());
+    attrib.block_index   = -1;
+    attrib.offset        = -1;
+    attrib.array_stride  = -1;
+    attrib.matrix_stride = -1;
+    attrib.name_offset   = AppendName(name.data(), length);
+  }
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Program reflection
+// }}} END of OpenGL Shaders
+
+// OpenGL Textures {{{
+
+class Texture {
+ public:
+  GLuint id;
+
+  Texture() = default;
+
+  Texture(GLuint id) : id(id) {}  // NOLINT
+
+  void Gen(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    glGenTextures(1, &id);
+    detail::TrackCreate(kResourceTexture, id, file, line);
+  }
+
+  void Delete() {
+    detail::TrackDelete(kResourceTexture, id);
+    glDeleteTextures(1, &id);
+  }
+};
+
+namespace detail {
+
+template <GLenum kTarget, GLenum kBinding>
+class TextureCommonTemplate : public Texture {
+ public:
+  TextureCommonTemplate() = default;
+  TextureCommonTemplate(GLuint id) : Texture(id) {}  // NOLINT
+
+  void Bind() const { glBindTexture(kTarget, id); }
+
+  void Unbind() const { glBindTexture(kTarget, 0); }
+
+  bool Bound() const {
+    GLint current_texture;
+    glGetIntegerv(kBinding, &current_texture);
+    return this->id && this->id == (GLuint)current_texture;
+  }
+
+  template <typename T>
+  void SetParameter(GLenum pname, T param) {
+    assert(Bound());
+    detail::TexParameterSetterFn<T> setter;
+    setter(kTarget, pname, param);
+  }
+
+  template <typename T, typename InternalFormatT = GLfloat>
+  void SetVecParameter(GLenum pname, const T *params) {
+    assert(Bound());
+    detail::VecTexParameterSetterFn<T, InternalFormatT> setter;
+    setter(kTarget, pname, params);
+  }
+
+  /// 64-bit handle through which shaders sample the texture without binding
+  /// it (GL_ARB_bindless_texture, see BindlessTextureTable). Its parameters
+  /// can't change once a handle exists, and the handle must be made resident
+  /// before use.
+  GLuint64 GetBindlessHandle() const { return glGetTextureHandleARB(id); }
+
+  /// Makes GL_RED and GL_RG textures sample like the old luminance and
+  /// luminance-alpha formats: (r, r, r, 1) and (r, r, r, g).
+  void SetGreySwizzle(GLenum format) {
+    assert(Bound());
+    if (format == GL_RED || format == GL_R8) {
+      const GLint swizzle[4] = {GL_RED, GL_RED, GL_RED, GL_ONE};
+      glTexParameteriv(kTarget, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    } else if (format == GL_RG || format == GL_RG8) {
+      const GLint swizzle[4] = {GL_RED, GL_RED, GL_RED, GL_GREEN};
+      glTexParameteriv(kTarget, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+    }
+  }
+};
+
+};  // namespace detail
+
+/// Who builds the mip levels of a texture, see Texture2D::LoadImageMipmapped()
+enum MipGeneration {
+  kMipGenerationGpu,  ///< glGenerateMipmap()
+  /// GenerateMipChain(): sRGB-correct everywhere and much faster than
+  /// glGenerateMipmap() on software rasterizers such as llvmpipe
+  kMipGenerationCpu,
+};
+
+// Since OpenGL 1.1
+class Texture2D : public detail::TextureCommonTemplate<GL_TEXTURE_2D, GL_TEXTURE_BINDING_2D> {
+ public:
+  Texture2D() = default;
+  Texture2D(GLuint id)  // NOLINT
+      : detail::TextureCommonTemplate<GL_TEXTURE_2D, GL_TEXTURE_BINDING_2D>(id) {}
+
+  /// Sets GL_TEXTURE_WRAP_(S|T) and GL_TEXTURE_(MIN|MAG)_FILTER
+  ///
+  /// @param wrap
+  ///   GL_CLAMP_TO_EDGE
+  ///   GL_CLAMP_TO_BORDER
+  ///   GL_REPEAT
+  ///   GL_MIRRORED_REPEAT.
+  ///
+  /// @param filter
+  ///  - `GL_NEAREST`: Returns the pixel that is closest to the coordinates.
+  ///  - `GL_LINEAR`:  Returns the weighted average of the 4 pixels surrounding the
+  ///    given coordinates.
+  ///  - `GL_NEAREST_MIPMAP_NEAREST`, `GL_LINEAR_MIPMAP_NEAREST`,
+  ///  `GL_NEAREST_MIPMAP_LINEAR`, `GL_LINEAR_MIPMAP_LINEAR`: Sample from mipmaps
+  ///  instead. Only used for minification, magnification uses the matching
+  ///  `GL_NEAREST` or `GL_LINEAR`.
+  ///
+  void SetFilterAndWrap(GLint filter = GL_LINEAR, GLint wrap = GL_CLAMP_TO_EDGE) {
+    assert(Bound());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, (GLint)detail::MagFilter(filter));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+  }
+
+  /// Number of levels of a full mip chain for a `width` x `height` image.
+  static GLsizei MipLevelCount(GLsizei width, GLsizei height) {
+    GLsizei levels = 1;
+    for (GLsizei size = width > height ? width : height; size > 1; size >>= 1) {
+      levels++;
+    }
+    return levels;
+  }
+
+  /// Whether Storage() can allocate immutable storage (OpenGL 4.2 or
+  /// GL_ARB_texture_storage) in the current context.
+  static bool ImmutableStorageSupported() {
+    return HasVersion(4, 2) || HasExtension("GL_ARB_texture_storage");
+  }
+
+  /// Allocates all the levels of the texture at once with a sized
+  /// `internal_format` (GL_RGBA8, GL_SRGB8_ALPHA8, GL_R8, GL_RG8...). Fill them
+  /// with SubImage() or GenerateMipmaps(); neither reallocates.
+  ///
+  /// Uses immutable storage (glTexStorage2D) when supported. Otherwise every
+  /// level is allocated with glTexImage2D and GL_TEXTURE_MAX_LEVEL is set, so
+  /// the texture is still mipmap complete and the driver doesn't have to
+  /// guess its final layout.
+  ///
+  /// @param levels number of mip levels, 0 for a full chain
+  void Storage(GLenum internal_format, GLsizei width, GLsizei height, GLsizei levels = 0) {
+    assert(Bound());
+    if (levels == 0) {
+      levels = MipLevelCount(width, height);
+    }
+    if (ImmutableStorageSupported()) {
+      glTexStorage2D(GL_TEXTURE_2D, levels, internal_format, width, height);
+    } else {
+      GLenum format, type;
+      detail::TransferFormat(internal_format, &format, &type);
+      for (GLint level = 0; level < levels; level++) {
+        GLsizei level_width  = (width >> level) > 0 ? (width >> level) : 1;
+        GLsizei level_height = (height >> level) > 0 ? (height >> level) : 1;
+        glTexImage2D(GL_TEXTURE_2D,
+                     level,
+                     (GLint)internal_format,
+                     level_width,
+                     level_height,
+                     0,
+                     format,
+                     type,
+                     nullptr);
+      }
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    }
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+    int64_t bytes = 0;
+    for (GLint level = 0; level < levels; level++) {
+      GLsizei level_width  = (width >> level) > 0 ? (width >> level) : 1;
+      GLsizei level_height = (height >> level) > 0 ? (height >> level) : 1;
+      bytes += (int64_t)level_width * level_height * detail::BytesPerTexel(internal_format);
+    }
+    detail::TrackBytes(kResourceTexture, id, bytes);
+#endif
+  }
+
+  /// Updates a region of `level` without reallocating the texture.
+  ///
+  /// @param format GL_RED, GL_RG, GL_RGB, GL_RGBA...
+  /// @param type GL_UNSIGNED_BYTE, GL_FLOAT...
+  void SubImage(GLint level,
+                GLint x,
+                GLint y,
+                GLsizei width,
+                GLsizei height,
+                GLenum format,
+                GLenum type,
+                const void *pixels) {
+    assert(Bound());
+    glTexSubImage2D(GL_TEXTURE_2D, level, x, y, width, height, format, type, pixels);
+  }
+
+  /// SubImage() for tightly packed GL_UNSIGNED_BYTE rows of any width.
+  void SubImage(GLint level,
+                GLint x,
+                GLint y,
+                GLsizei width,
+                GLsizei height,
+                const GLubyte *pixels,
+                GLenum format = GL_RGBA) {
+    detail::UnpackAlignmentScope alignment(width * detail::ComponentCount(format));
+    SubImage(level, x, y, width, height, format, GL_UNSIGNED_BYTE, pixels);
+  }
+
+  void GenerateMipmaps() {
+    assert(Bound());
+    glGenerateMipmap(GL_TEXTURE_2D);
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+    // Storage() already accounted for every level
+    GLint immutable = GL_FALSE;
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable);
+    if (immutable) {
+      return;
+    }
+    // A full mip chain adds about a third of the base level size
+    GLint width, height, internal_format;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &internal_format);
+    detail::TrackBytes(kResourceTexture,
+                       id,
+                       (int64_t)width * height * detail::BytesPerTexel(internal_format) * 4 / 3);
+#endif
+  }
+
+  /// Allocates a full mip chain with Storage() and fills every level from
+  /// tightly packed 8-bit `pixels`, building the mips on the GPU or the CPU.
+  ///
+  /// @param format GL_RED, GL_RG, GL_RGB or GL_RGBA
+  /// @param srgb store color images as GL_SRGB8[_ALPHA8]
+  /// @param filter, pool only used with kMipGenerationCpu
+  void LoadImageMipmapped(const GLubyte *pixels,
+                          GLsizei width,
+                          GLsizei height,
+                          GLenum format,
+                          bool srgb,
+                          MipGeneration mips,
+                          MipFilter filter = kMipFilterBox,
+                          ThreadPool *pool = nullptr) {
+    PROTO3D_PROFILE_SCOPE("Texture2D::LoadImageMipmapped");
+    GLenum internal_format = detail::SizedInternalFormat(format);
+    if (srgb && internal_format == GL_RGB8) {
+      internal_format = GL_SRGB8;
+    } else if (srgb && internal_format == GL_RGBA8) {
+      internal_format = GL_SRGB8_ALPHA8;
+    }
+    Storage(internal_format, width, height);
+    SetGreySwizzle(format);
+    if (mips == kMipGenerationGpu) {
+      SubImage(0, 0, 0, width, height, pixels, format);
+      GenerateMipmaps();
+      return;
+    }
+    std::vector<MipLevel> levels;
+    GenerateMipChain(
+        pixels, width, height, detail::ComponentCount(format), srgb, filter, &levels, pool);
+    for (size_t level = 0; level < levels.size(); level++) {
+      const MipLevel &mip = levels[level];
+      SubImage((GLint)level, 0, 0, mip.width, mip.height, mip.pixels.data(), format);
+    }
+  }
+
+  /// Allocates level 0 with the sized version of `format` (GL_RGBA8 for
+  /// GL_RGBA...) and uploads `pixels`. Prefer Storage() + SubImage() for
+  /// textures with mipmaps.
+  ///
+  /// @param pixels For format=GL_RGBA it's a GLubyte[width][height][4] matrix
+  void LoadImage(GLsizei width, GLsizei height, GLubyte *pixels, GLenum format = GL_RGBA) {
+    PROTO3D_PROFILE_SCOPE("Texture2D::LoadImage");
+    assert(Bound());
+    GLenum internal_format = detail::SizedInternalFormat(format);
+    detail::UnpackAlignmentScope alignment(width * detail::ComponentCount(format));
+    glTexImage2D(GL_TEXTURE_2D,           // target
+                 0,                       // level (here the maximum level of detail)
+                 (GLint)internal_format,  // internalFormat
+                 width,
+                 height,
+                 0,                 // border (spec says it should always be 0)
+                 format,            // format
+                 GL_UNSIGNED_BYTE,  // color component datatype
+                 pixels);
+    detail::TrackBytes(
+        kResourceTexture, id, (int64_t)width * height * detail::BytesPerTexel(internal_format));
+  }
+
+#ifdef PROTO3D_USE_STB
+  /// Load an stb::Image into the texture
+  ///
+  /// @param level Specifies the level-of-detail number.  Level 0 is the base
+  /// image level.  Level n is the nth mipmap reduction image.
+  /// @param internal_format The texture internal format. It's the sized
+  /// format of the image (see stb::Image::GLInternalFormat()) by default.
+  void LoadImage(proto3d::stb::Image *img,
+                 GLint level           = 0,
+                 GLint internal_format = GL_INVALID_VALUE) {
+    PROTO3D_PROFILE_SCOPE("Texture2D::LoadImage");
+    GLsizei width   = img->width;
+    GLsizei height  = img->height;
+    GLubyte *pixels = img->raw();
+    GLenum format   = img->GLPixelFormat();
+    if (internal_format == GL_INVALID_VALUE) {
+      internal_format = (GLint)img->GLInternalFormat();
+    }
+
+    assert(Bound());
+    SetGreySwizzle(format);
+    detail::UnpackAlignmentScope alignment(width * detail::ComponentCount(format));
+    glTexImage2D(GL_TEXTURE_2D,  // target
+                 level,
+                 internal_format,
+                 width,
+                 height,
+                 0,                 // border (spec says it should always be 0)
+                 format,            // format
+                 GL_UNSIGNED_BYTE,  // color component datatype
+                 pixels);
+    if (level == 0) {
+      detail::TrackBytes(
+          kResourceTexture, id, (int64_t)width * height * detail::BytesPerTexel(internal_format));
+    }
+  }
+
+  /// Allocates storage for `levels` levels (0 for a full chain) with Storage()
+  /// and uploads the image to level 0. Call GenerateMipmaps() or fill the
+  /// other levels with SubImage() afterwards.
+  ///
+  /// @param srgb store color images as GL_SRGB8[_ALPHA8]
+  void LoadImageStorage(proto3d::stb::Image *img, GLsizei levels = 0, bool srgb = false) {
+    PROTO3D_PROFILE_SCOPE("Texture2D::LoadImageStorage");
+    GLenum format = img->GLPixelFormat();
+    Storage(img->GLInternalFormat(srgb), img->width, img->height, levels);
+    SetGreySwizzle(format);
+    SubImage(0, 0, 0, img->width, img->height, img->raw(), format);
+  }
+
+  /// LoadImageMipmapped() for an stb::Image.
+  void LoadImageMipmapped(proto3d::stb::Image *img,
+                          bool srgb,
+                          MipGeneration mips,
+                          MipFilter filter = kMipFilterBox,
+                          ThreadPool *pool = nullptr) {
+    LoadImageMipmapped(
+        img->raw(), img->width, img->height, img->GLPixelFormat(), srgb, mips, filter, pool);
+  }
+#endif  // PROTO3D_USE_STB
+};
+
+// Since OpenGL 3.0
+///
+/// Layers of the same size and format sampled with a sampler2DArray and a
+/// (u, v, layer) coordinate: one binding for many images, see TextureAtlas.
+class Texture2DArray
+    : public detail::TextureCommonTemplate<GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BINDING_2D_ARRAY> {
+ public:
+  Texture2DArray() = default;
+  Texture2DArray(GLuint id)  // NOLINT
+      : detail::TextureCommonTemplate<GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BINDING_2D_ARRAY>(id) {}
+
+  /// See Texture2D::SetFilterAndWrap()
+  void SetFilterAndWrap(GLint filter = GL_LINEAR, GLint wrap = GL_CLAMP_TO_EDGE) {
+    assert(Bound());
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, (GLint)detail::MagFilter(filter));
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, wrap);
+  }
+
+  /// Allocates `layers` layers of `levels` levels (0 for a full chain), with
+  /// glTexStorage3D where supported like Texture2D::Storage().
+  void Storage(GLenum internal_format,
+               GLsizei width,
+               GLsizei height,
+               GLsizei layers,
+               GLsizei levels = 0) {
+    assert(Bound());
+    if (levels == 0) {
+      levels = Texture2D::MipLevelCount(width, height);
+    }
+    if (Texture2D::ImmutableStorageSupported()) {
+      glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, internal_format, width, height, layers);
+    } else {
+      GLenum format, type;
+      detail::TransferFormat(internal_format, &format, &type);
+      for (GLint level = 0; level < levels; level++) {
+        GLsizei level_width  = (width >> level) > 0 ? (width >> level) : 1;
+        GLsizei level_height = (height >> level) > 0 ? (height >> level) : 1;
+        glTexImage3D(GL_TEXTURE_2D_ARRAY,
+                     level,
+                     (GLint)internal_format,
+                     level_width,
+                     level_height,
+                     layers,
+                     0,
+                     format,
+                     type,
+                     nullptr);
+      }
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+    }
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+    int64_t bytes = 0;
+    for (GLint level = 0; level < levels; level++) {
+      GLsizei level_width  = (width >> level) > 0 ? (width >> level) : 1;
+      GLsizei level_height = (height >> level) > 0 ? (height >> level) : 1;
+      bytes += (int64_t)level_width * level_height * detail::BytesPerTexel(internal_format);
+    }
+    detail::TrackBytes(kResourceTexture, id, bytes * layers);
+#endif
+  }
+
+  /// Updates a region of one layer of `level`.
+  void SubImage(GLint level,
+                GLint x,
+                GLint y,
+                GLint layer,
+                GLsizei width,
+                GLsizei height,
+                GLenum format,
+                GLenum type,
+                const void *pixels) {
+    assert(Bound());
+    glTexSubImage3D(
+        GL_TEXTURE_2D_ARRAY, level, x, y, layer, width, height, 1, format, type, pixels);
+  }
+
+  /// SubImage() for tightly packed GL_UNSIGNED_BYTE rows of any width.
+  void SubImage(GLint level,
+                GLint x,
+                GLint y,
+                GLint layer,
+                GLsizei width,
+                GLsizei height,
+                const GLubyte *pixels,
+                GLenum format = GL_RGBA) {
+    detail::UnpackAlignmentScope alignment(width * detail::ComponentCount(format));
+    SubImage(level, x, y, layer, width, height, format, GL_UNSIGNED_BYTE, pixels);
+  }
+
+  /// Storage() already accounted for every level.
+  void GenerateMipmaps() {
+    assert(Bound());
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+  }
+};
+
+class Textures {
+ public:
+  GLuint *ids;
+  GLsizei size;
+
+  Textures() : ids(nullptr), size(0) {}
+
+  Textures(Texture *textures, GLsizei _size) : size(_size) {
+    ids = reinterpret_cast<GLuint *>(textures);
+  }
+
+  void Gen(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    glGenTextures(size, ids);
+    detail::TrackCreate(kResourceTexture, ids, size, file, line);
+  }
+
+  void Delete() {
+    detail::TrackDelete(kResourceTexture, ids, size);
+    glDeleteTextures(size, ids);
+  }
+};
+
+class Textures2D : public Textures {
+ public:
+  Textures2D() : Textures() {}
+
+  Textures2D(Texture2D *textures, GLsizei _size) : Textures(textures, _size) {}
+
+  void Unbind() const { glBindTexture(GL_TEXTURE_2D, 0); }
+
+  Texture2D operator[](GLsizei i) const { return this->ids[i]; }
+
+  Texture2D &operator[](GLsizei i) { return reinterpret_cast<Texture2D &>(this->ids[i]); }
+};
+// }}} END of OpenGL Textures
+
+// Compressed textures {{{
+
+// From GL_EXT_texture_sRGB, missing in core headers
+#ifndef GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT 0x8C4C
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT 0x8C4D
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT 0x8C4E
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+#endif
+
+namespace detail {
+/// Block size in texels and bytes of a BCn, ETC2/EAC or ASTC format.
+///
+/// @return false if `internal_format` is not a known block-compressed format
+bool CompressedBlockInfo(GLenum internal_format,
+                         GLint *block_width,
+                         GLint *block_height,
+                         GLint *block_bytes);
+
+/// Size in bytes of a `width` x `height` image stored with a block-compressed
+/// format. Computed in 64 bits: sizes read from a file can overflow GLsizei.
+inline uint64_t CompressedImageSize(GLenum internal_format, GLsizei width, GLsizei height) {
+  GLint block_width, block_height, block_bytes;
+  if (!CompressedBlockInfo(internal_format, &block_width, &block_height, &block_bytes)) {
+    return 0;
+  }
+  uint64_t blocks_x = ((uint64_t)width + block_width - 1) / block_width;
+  uint64_t blocks_y = ((uint64_t)height + block_height - 1) / block_height;
+  return blocks_x * blocks_y * block_bytes;
+}
+
+/// Size in bytes of a tightly packed image, either block-compressed or with
+/// an 8 bits per component format (GL_R8, GL_RG8, GL_RGB8, GL_RGBA8, sRGB).
+inline uint64_t PackedImageSize(GLenum internal_format, GLsizei width, GLsizei height) {
+  GLint block_width, block_height, block_bytes;
+  if (CompressedBlockInfo(internal_format, &block_width, &block_height, &block_bytes)) {
+    return CompressedImageSize(internal_format, width, height);
+  }
+  GLenum format, type;
+  TransferFormat(internal_format, &format, &type);
+  return (uint64_t)width * height * ComponentCount(format);
+}
+}  // namespace detail
+
+/// A mip level of a CompressedImage. `data` points into the container.
+struct CompressedLevel {
+  const uint8_t *data;
+  GLsizei size;
+  GLsizei width;
+  GLsizei height;
+};
+
+/// A block-compressed 2D mip chain (BCn, ETC2/EAC or ASTC) found in a KTX2 or
+/// DDS container. Nothing is copied or decoded: the levels point into the
+/// container memory (usually a MappedFile), which must outlive the image.
+///
+/// KTX2 files may also hold 8 bits per component R, RG, RGB or RGBA levels
+/// (as written by proto3d_texcook without block compression).
+struct CompressedImage {
+  static const int kMaxLevels = 16;
+  /// Largest width or height accepted by Parse(). Keeps every level size
+  /// well within GLsizei.
+  static const uint32_t kMaxSize = 16384;
+
+  GLenum internal_format;
+  GLsizei width;
+  GLsizei height;
+  GLsizei level_count;
+  CompressedLevel levels[kMaxLevels];
+
+  /// Parses a KTX2 or DDS container, detected from its magic number.
+  ///
+  /// Only single-layer 2D textures without supercompression are supported.
+  ///
+  /// @return nullptr on success or a static string describing the problem
+  const char *Parse(const uint8_t *data, size_t size);
+
+  const char *ParseKTX2(const uint8_t *data, size_t size);
+  const char *ParseDDS(const uint8_t *data, size_t size);
+};
+
+/// A Texture2D filled with a pre-compressed mip chain, uploaded as is with
+/// glCompressedTex[Sub]Image2D, one call per level. Uncompressed KTX2 levels
+/// go through Texture2D::Storage() and SubImage().
+///
+///     MappedFile file;
+///     CompressedImage image;
+///     if (file.Open("rock_bc7.ktx2") && image.Parse(file.data, file.size) == nullptr) {
+///       texture.Gen();
+///       texture.Bind();
+///       const char *error = texture.Load(image);
+///     }
+class CompressedTexture2D : public Texture2D {
+ public:
+  CompressedTexture2D() = default;
+  CompressedTexture2D(GLuint id) : Texture2D(id) {}  // NOLINT
+
+  /// Whether the current context can sample `internal_format`.
+  static bool FormatSupported(GLenum internal_format);
+
+  /// Uploads all the levels of `image`. Uses immutable storage when
+  /// supported, otherwise sets GL_TEXTURE_MAX_LEVEL so a partial chain is
+  /// still mipmap complete.
+  ///
+  /// @return nullptr on success or a static string describing the problem
+  const char *Load(const CompressedImage &image);
+
+  /// Maps a KTX2 or DDS file and uploads it with Load(). The file is unmapped
+  /// before returning.
+  const char *LoadFile(const char *path);
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+bool detail::CompressedBlockInfo(GLenum internal_format,
+                                 GLint *block_width,
+                                 GLint *block_height,
+                                 GLint *block_bytes) {
+  // ASTC formats are numbered in the same order in both the linear and the
+  // sRGB ranges
+  static const GLint kAstcBlocks[14][2] = {
+      {4, 4}, {5, 4}, {5, 5}, {6, 5}, {6, 6}, {8, 5}, {8, 6},
+      {8, 8}, {10, 5}, {10, 6}, {10, 8}, {10, 10}, {12, 10}, {12, 12}};
+  if (internal_format >= GL_COMPRESSED_RGBA_ASTC_4x4_KHR &&
+      internal_format <= GL_COMPRESSED_RGBA_ASTC_12x12_KHR) {
+    *block_width  = kAstcBlocks[internal_format - GL_COMPRESSED_RGBA_ASTC_4x4_KHR][0];
+    *block_height = kAstcBlocks[internal_format - GL_COMPRESSED_RGBA_ASTC_4x4_KHR][1];
+    *block_bytes  = 16;
+    return true;
+  }
+  if (internal_format >= GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR &&
+      internal_format <= GL_COMPRESSED_SRGB8_ALPHA8_ASTC_12x12_KHR) {
+    *block_width  = kAstcBlocks[internal_format - GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR][0];
+    *block_height = kAstcBlocks[internal_format - GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR][1];
+    *block_bytes  = 16;
+    return true;
+  }
+  *block_width  = 4;
+  *block_height = 4;
+  switch (internal_format) {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RED_RGTC1:
+    case GL_COMPRESSED_SIGNED_RED_RGTC1:
+    case GL_COMPRESSED_RGB8_ETC2:
+    case GL_COMPRESSED_SRGB8_ETC2:
+    case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+    case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+    case GL_COMPRESSED_R11_EAC:
+    case GL_COMPRESSED_SIGNED_R11_EAC:
+      *block_bytes = 8;
+      return true;
+    case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+    case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT:
+    case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+    case GL_COMPRESSED_RG_RGTC2:
+    case GL_COMPRESSED_SIGNED_RG_RGTC2:
+    case GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT:
+    case GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT:
+    case GL_COMPRESSED_RGBA_BPTC_UNORM:
+    case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+    case GL_COMPRESSED_RGBA8_ETC2_EAC:
+    case GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC:
+    case GL_COMPRESSED_RG11_EAC:
+    case GL_COMPRESSED_SIGNED_RG11_EAC:
+      *block_bytes = 16;
+      return true;
+    default:
+      *block_bytes = 0;
+      return false;
+  }
+}
+
+namespace detail {
+inline uint32_t ReadU32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline uint64_t ReadU64(const uint8_t *p) {
+  return (uint64_t)ReadU32(p) | ((uint64_t)ReadU32(p + 4) << 32);
+}
+
+/// OpenGL format of a KTX2 VkFormat, GL_ZERO if unsupported.
+inline GLenum VkFormatToGL(uint32_t vk_format) {
+  // VK_FORMAT_ASTC_4x4_UNORM_BLOCK (157) to VK_FORMAT_ASTC_12x12_SRGB_BLOCK
+  // (184) alternate UNORM and SRGB
+  if (vk_format >= 157 && vk_format <= 184) {
+    uint32_t index = (vk_format - 157) / 2;
+    return (vk_format - 157) % 2 == 0 ? GL_COMPRESSED_RGBA_ASTC_4x4_KHR + index
+                                      : GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR + index;
+  }
+  // clang-format off
+  switch (vk_format) {
+    case 131: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;               // BC1_RGB_UNORM
+    case 132: return GL_COMPRESSED_SRGB_S3TC_DXT1_EXT;              // BC1_RGB_SRGB
+    case 133: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;              // BC1_RGBA_UNORM
+    case 134: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;        // BC1_RGBA_SRGB
+    case 135: return GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;              // BC2_UNORM
+    case 136: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT;        // BC2_SRGB
+    case 137: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;              // BC3_UNORM
+    case 138: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;        // BC3_SRGB
+    case 139: return GL_COMPRESSED_RED_RGTC1;                       // BC4_UNORM
+    case 140: return GL_COMPRESSED_SIGNED_RED_RGTC1;                // BC4_SNORM
+    case 141: return GL_COMPRESSED_RG_RGTC2;                        // BC5_UNORM
+    case 142: return GL_COMPRESSED_SIGNED_RG_RGTC2;                 // BC5_SNORM
+    case 143: return GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT;         // BC6H_UFLOAT
+    case 144: return GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT;           // BC6H_SFLOAT
+    case 145: return GL_COMPRESSED_RGBA_BPTC_UNORM;                 // BC7_UNORM
+    case 146: return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;           // BC7_SRGB
+    case 147: return GL_COMPRESSED_RGB8_ETC2;                       // ETC2_R8G8B8_UNORM
+    case 148: return GL_COMPRESSED_SRGB8_ETC2;                      // ETC2_R8G8B8_SRGB
+    case 149: return GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2;   // ETC2_R8G8B8A1_UNORM
+    case 150: return GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2;  // ETC2_R8G8B8A1_SRGB
+    case 151: return GL_COMPRESSED_RGBA8_ETC2_EAC;                  // ETC2_R8G8B8A8_UNORM
+    case 152: return GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC;           // ETC2_R8G8B8A8_SRGB
+    case 153: return GL_COMPRESSED_R11_EAC;                         // EAC_R11_UNORM
+    case 154: return GL_COMPRESSED_SIGNED_R11_EAC;                  // EAC_R11_SNORM
+    case 155: return GL_COMPRESSED_RG11_EAC;                        // EAC_R11G11_UNORM
+    case 156: return GL_COMPRESSED_SIGNED_RG11_EAC;                 // EAC_R11G11_SNORM
+    case 9:   return GL_R8;                                         // R8_UNORM
+    case 16:  return GL_RG8;                                        // R8G8_UNORM
+    case 23:  return GL_RGB8;                                       // R8G8B8_UNORM
+    case 29:  return GL_SRGB8;                                      // R8G8B8_SRGB
+    case 37:  return GL_RGBA8;                                      // R8G8B8A8_UNORM
+    case 43:  return GL_SRGB8_ALPHA8;                               // R8G8B8A8_SRGB
+    default: return GL_ZERO;
+  }
+  // clang-format on
+}
+
+/// OpenGL format of a DDS DX10 header DXGI_FORMAT, GL_ZERO if unsupported.
+inline GLenum DxgiFormatToGL(uint32_t dxgi_format) {
+  // clang-format off
+  switch (dxgi_format) {
+    case 71: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;        // BC1_UNORM
+    case 72: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT;  // BC1_UNORM_SRGB
+    case 74: return GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;        // BC2_UNORM
+    case 75: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT;  // BC2_UNORM_SRGB
+    case 77: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;        // BC3_UNORM
+    case 78: return GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT;  // BC3_UNORM_SRGB
+    case 80: return GL_COMPRESSED_RED_RGTC1;                 // BC4_UNORM
+    case 81: return GL_COMPRESSED_SIGNED_RED_RGTC1;          // BC4_SNORM
+    case 83: return GL_COMPRESSED_RG_RGTC2;                  // BC5_UNORM
+    case 84: return GL_COMPRESSED_SIGNED_RG_RGTC2;           // BC5_SNORM
+    case 95: return GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT;   // BC6H_UF16
+    case 96: return GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT;     // BC6H_SF16
+    case 98: return GL_COMPRESSED_RGBA_BPTC_UNORM;           // BC7_UNORM
+    case 99: return GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM;     // BC7_UNORM_SRGB
+    default: return GL_ZERO;
+  }
+  // clang-format on
+}
+
+inline GLsizei MipSize(GLsizei size, GLint level) {
+  return (size >> level) > 0 ? (size >> level) : 1;
+}
+}  // namespace detail
+
+const char *CompressedImage::Parse(const uint8_t *data, size_t size) {
+  static const uint8_t kKTX2Magic[12] = {
+      0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+  if (size >= sizeof(kKTX2Magic) && memcmp(data, kKTX2Magic, sizeof(kKTX2Magic)) == 0) {
+    return ParseKTX2(data, size);
+  }
+  if (size >= 4 && memcmp(data, "DDS ", 4) == 0) {
+    return ParseDDS(data, size);
+  }
+  return "Unknown texture container (expected KTX2 or DDS)";
+}
+
+const char *CompressedImage::ParseKTX2(const uint8_t *data, size_t size) {
+  // 48 bytes header, 32 bytes index, then 24 bytes per level
+  if (size < 80) {
+    return "Truncated KTX2 header";
+  }
+  uint32_t vk_format        = detail::ReadU32(data + 12);
+  uint32_t pixel_width      = detail::ReadU32(data + 20);
+  uint32_t pixel_height     = detail::ReadU32(data + 24);
+  uint32_t depth            = detail::ReadU32(data + 28);
+  uint32_t layers           = detail::ReadU32(data + 32);
+  uint32_t faces            = detail::ReadU32(data + 36);
+  uint32_t ktx_levels       = detail::ReadU32(data + 40);
+  uint32_t supercompression = detail::ReadU32(data + 44);
+  if (depth > 1 || layers > 1 || faces != 1 || pixel_width == 0 || pixel_height == 0) {
+    return "Only single-layer 2D KTX2 textures are supported";
+  }
+  if (pixel_width > kMaxSize || pixel_height > kMaxSize) {
+    return "KTX2 texture too large";
+  }
+  width  = (GLsizei)pixel_width;
+  height = (GLsizei)pixel_height;
+  if (supercompression != 0) {
+    return "Supercompressed KTX2 textures (BasisLZ, Zstandard) are not supported";
+  }
+  internal_format = detail::VkFormatToGL(vk_format);
+  if (internal_format == GL_ZERO) {
+    return "Unsupported KTX2 format";
+  }
+  level_count = ktx_levels == 0 ? 1 : (GLsizei)ktx_levels;
+  if (level_count > kMaxLevels) {
+    return "Too many KTX2 mip levels";
+  }
+  if (size < 80 + 24 * (size_t)level_count) {
+    return "Truncated KTX2 level index";
+  }
+  for (GLint level = 0; level < level_count; level++) {
+    const uint8_t *entry = data + 80 + 24 * level;
+    uint64_t offset      = detail::ReadU64(entry);
+    uint64_t length      = detail::ReadU64(entry + 8);
+    CompressedLevel &out = levels[level];
+    out.width            = detail::MipSize(width, level);
+    out.height           = detail::MipSize(height, level);
+    uint64_t level_size  = detail::PackedImageSize(internal_format, out.width, out.height);
+    if (offset > size || length > size - offset || length < level_size) {
+      return "KTX2 mip level outside of the file";
+    }
+    out.size = (GLsizei)level_size;
+    out.data = data + offset;
+  }
+  return nullptr;
+}
+
+const char *CompressedImage::ParseDDS(const uint8_t *data, size_t size) {
+  // "DDS " magic, 124 bytes DDS_HEADER, optional 20 bytes DDS_HEADER_DXT10
+  if (size < 128 || detail::ReadU32(data + 4) != 124) {
+    return "Truncated DDS header";
+  }
+  uint32_t pixel_height  = detail::ReadU32(data + 12);
+  uint32_t pixel_width   = detail::ReadU32(data + 16);
+  uint32_t mip_count     = detail::ReadU32(data + 28);
+  uint32_t pixel_flags   = detail::ReadU32(data + 80);
+  const uint8_t *four_cc = data + 84;
+  size_t offset          = 128;
+  if (pixel_width == 0 || pixel_height == 0 || pixel_width > kMaxSize ||
+      pixel_height > kMaxSize) {
+    return "Unsupported DDS texture size";
+  }
+  width  = (GLsizei)pixel_width;
+  height = (GLsizei)pixel_height;
+  // DDPF_FOURCC
+  if (!(pixel_flags & 0x4)) {
+    return "Uncompressed DDS textures are not supported";
+  }
+  if (memcmp(four_cc, "DX10", 4) == 0) {
+    if (size < 148) {
+      return "Truncated DDS DX10 header";
+    }
+    // Resource dimension 3 is DDS_DIMENSION_TEXTURE2D
+    if (detail::ReadU32(data + 132) != 3 || detail::ReadU32(data + 140) > 1) {
+      return "Only single-layer 2D DDS textures are supported";
+    }
+    internal_format = detail::DxgiFormatToGL(detail::ReadU32(data + 128));
+    offset          = 148;
+  } else if (memcmp(four_cc, "DXT1", 4) == 0) {
+    internal_format = GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+  } else if (memcmp(four_cc, "DXT3", 4) == 0) {
+    internal_format = GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+  } else if (memcmp(four_cc, "DXT5", 4) == 0) {
+    internal_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  } else if (memcmp(four_cc, "ATI1", 4) == 0 || memcmp(four_cc, "BC4U", 4) == 0) {
+    internal_format = GL_COMPRESSED_RED_RGTC1;
+  } else if (memcmp(four_cc, "ATI2", 4) == 0 || memcmp(four_cc, "BC5U", 4) == 0) {
+    internal_format = GL_COMPRESSED_RG_RGTC2;
+  } else {
+    internal_format = GL_ZERO;
+  }
+  if (internal_format == GL_ZERO) {
+    return "Unsupported DDS compression format";
+  }
+  level_count = mip_count == 0 ? 1 : (GLsizei)mip_count;
+  if (level_count > kMaxLevels) {
+    return "Too many DDS mip levels";
+  }
+  // Levels are stored back to back, from the largest
+  for (GLint level = 0; level < level_count; level++) {
+    CompressedLevel &out = levels[level];
+    out.width            = detail::MipSize(width, level);
+    out.height           = detail::MipSize(height, level);
+    uint64_t level_size  = detail::CompressedImageSize(internal_format, out.width, out.height);
+    if (level_size > size - offset) {
+      return "DDS mip level outside of the file";
+    }
+    out.size = (GLsizei)level_size;
+    out.data = data + offset;
+    offset += (size_t)out.size;
+  }
+  return nullptr;
+}
+
+bool CompressedTexture2D::FormatSupported(GLenum internal_format) {
+  GLint block_width, block_height, block_bytes;
+  if (!detail::CompressedBlockInfo(internal_format, &block_width, &block_height, &block_bytes)) {
+    // Uncompressed formats CompressedImage can hold are core since 3.0
+    return internal_format == GL_R8 || internal_format == GL_RG8 || internal_format == GL_RGB8 ||
+           internal_format == GL_SRGB8 || internal_format == GL_RGBA8 ||
+           internal_format == GL_SRGB8_ALPHA8;
+  }
+  switch (internal_format) {
+    case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+      return HasExtension("GL_EXT_texture_compression_s3tc");
+    case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT:
+    case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT:
+      return HasExtension("GL_EXT_texture_compression_s3tc") &&
+             (HasExtension("GL_EXT_texture_sRGB") || HasVersion(4, 0));
+    case GL_COMPRESSED_RED_RGTC1:
+    case GL_COMPRESSED_SIGNED_RED_RGTC1:
+    case GL_COMPRESSED_RG_RGTC2:
+    case GL_COMPRESSED_SIGNED_RG_RGTC2:
+      return HasVersion(3, 0);
+    case GL_COMPRESSED_RGB_BPTC_UNSIGNED_FLOAT:
+    case GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT:
+    case GL_COMPRESSED_RGBA_BPTC_UNORM:
+    case GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM:
+      return HasVersion(4, 2) || HasExtension("GL_ARB_texture_compression_bptc");
+    case GL_COMPRESSED_RGB8_ETC2:
+    case GL_COMPRESSED_SRGB8_ETC2:
+    case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+    case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+    case GL_COMPRESSED_RGBA8_ETC2_EAC:
+    case GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC:
+    case GL_COMPRESSED_R11_EAC:
+    case GL_COMPRESSED_SIGNED_R11_EAC:
+    case GL_COMPRESSED_RG11_EAC:
+    case GL_COMPRESSED_SIGNED_RG11_EAC:
+      return HasVersion(4, 3) || HasExtension("GL_ARB_ES3_compatibility");
+    default:  // ASTC
+      return HasExtension("GL_KHR_texture_compression_astc_ldr");
+  }
+}
+
+const char *CompressedTexture2D::Load(const CompressedImage &image) {
+  PROTO3D_PROFILE_SCOPE("CompressedTexture2D::Load");
+  assert(Bound());
+  if (!FormatSupported(image.internal_format)) {
+    return "Compressed texture format not supported by the OpenGL context";
+  }
+  GLint block_width, block_height, block_bytes;
+  if (!detail::CompressedBlockInfo(
+          image.internal_format, &block_width, &block_height, &block_bytes)) {
+    GLenum format, type;
+    detail::TransferFormat(image.internal_format, &format, &type);
+    Storage(image.internal_format, image.width, image.height, image.level_count);
+    for (GLint level = 0; level < image.level_count; level++) {
+      const CompressedLevel &source = image.levels[level];
+      SubImage(level, 0, 0, source.width, source.height, source.data, format);
+    }
+    return nullptr;
+  }
+  bool immutable = ImmutableStorageSupported();
+  if (immutable) {
+    glTexStorage2D(
+        GL_TEXTURE_2D, image.level_count, image.internal_format, image.width, image.height);
+  }
+  int64_t bytes = 0;
+  for (GLint level = 0; level < image.level_count; level++) {
+    const CompressedLevel &source = image.levels[level];
+    if (immutable) {
+      glCompressedTexSubImage2D(GL_TEXTURE_2D,
+                                level,
+                                0,
+                                0,
+                                source.width,
+                                source.height,
+                                image.internal_format,
+                                source.size,
+                                source.data);
+    } else {
+      glCompressedTexImage2D(GL_TEXTURE_2D,
+                             level,
+                             image.internal_format,
+                             source.width,
+                             source.height,
+                             0,
+                             source.size,
+                             source.data);
+    }
+    bytes += source.size;
+  }
+  if (!immutable) {
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.level_count - 1);
+  }
+  detail::TrackBytes(kResourceTexture, id, bytes);
+  return nullptr;
+}
+
+const char *CompressedTexture2D::LoadFile(const char *path) {
+  MappedFile file;
+  if (!file.Open(path)) {
+    return "Can't open the texture file";
+  }
+  CompressedImage image;
+  const char *error = image.Parse(file.data, file.size);
+  if (error != nullptr) {
+    return error;
+  }
+  return Load(image);
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Compressed textures
+
+// Samplers {{{
+
+namespace detail {
+/// glBindTextures(), glBindSamplers()... (OpenGL 4.4)
+inline bool MultiBindSupported() {
+  return HasVersion(4, 4) || HasExtension("GL_ARB_multi_bind");
+}
+}  // namespace detail
+
+/// Sampling state of a Sampler: what Texture2D::SetFilterAndWrap() and the
+/// other GL_TEXTURE_* parameters set per texture.
+struct SamplerDesc {
+  GLenum min_filter;
+  GLenum mag_filter;
+  GLenum wrap_s;
+  GLenum wrap_t;
+  GLenum wrap_r;
+  /// Only applied if > 1 and anisotropic filtering is supported
+  GLfloat max_anisotropy;
+  GLfloat lod_bias;
+  /// GL_COMPARE_REF_TO_TEXTURE for shadow map lookups
+  GLenum compare_mode;
+  GLenum compare_func;
+
+  /// The OpenGL defaults, except for GL_LINEAR_MIPMAP_LINEAR minification.
+  SamplerDesc()
+      : min_filter(GL_LINEAR_MIPMAP_LINEAR),
+        mag_filter(GL_LINEAR),
+        wrap_s(GL_REPEAT),
+        wrap_t(GL_REPEAT),
+        wrap_r(GL_REPEAT),
+        max_anisotropy(1.0f),
+        lod_bias(0.0f),
+        compare_mode(GL_NONE),
+        compare_func(GL_LEQUAL) {}
+
+  /// Same state as Texture2D::SetFilterAndWrap(filter, wrap).
+  static SamplerDesc FilterAndWrap(GLenum filter, GLenum wrap) {
+    SamplerDesc desc;
+    desc.min_filter = filter;
+    desc.mag_filter = detail::MagFilter(filter);
+    desc.wrap_s     = wrap;
+    desc.wrap_t     = wrap;
+    desc.wrap_r     = wrap;
+    return desc;
+  }
+
+  bool operator==(const SamplerDesc &other) const {
+    return min_filter == other.min_filter && mag_filter == other.mag_filter &&
+           wrap_s == other.wrap_s && wrap_t == other.wrap_t && wrap_r == other.wrap_r &&
+           max_anisotropy == other.max_anisotropy && lod_bias == other.lod_bias &&
+           compare_mode == other.compare_mode && compare_func == other.compare_func;
+  }
+
+  /// FNV-1a of the fields.
+  uint64_t Hash() const {
+    uint32_t fields[9] = {min_filter, mag_filter, wrap_s, wrap_t, wrap_r, 0, 0, compare_mode,
+                          compare_func};
+    memcpy(&fields[5], &max_anisotropy, sizeof(GLfloat));
+    memcpy(&fields[6], &lod_bias, sizeof(GLfloat));
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t field : fields) {
+      hash = (hash ^ field) * 1099511628211ull;
+    }
+    return hash;
+  }
+};
+
+/// Since OpenGL 3.3
+///
+/// A sampler bound to a texture unit overrides the sampling parameters of
+/// whatever texture is bound to that unit, so one sampler can serve every
+/// texture sampled the same way. Get shared samplers from a SamplerCache.
+class Sampler {
+ public:
+  GLuint id;
+
+  Sampler(GLuint id) : id(id) {}  // NOLINT
+
+  Sampler() : id(0) {}
+
+  void Create(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    assert(id == 0);
+    glGenSamplers(1, &id);
+    detail::TrackCreate(kResourceSampler, id, file, line);
+  }
+
+  void Delete() {
+    detail::TrackDelete(kResourceSampler, id);
+    glDeleteSamplers(1, &id);
+  }
+
+  void Bind(GLuint unit) const { glBindSampler(unit, id); }
+
+  static void Unbind(GLuint unit) { glBindSampler(unit, 0); }
+
+  void SetParameter(GLenum pname, GLint param) { glSamplerParameteri(id, pname, param); }
+
+  void SetParameter(GLenum pname, GLfloat param) { glSamplerParameterf(id, pname, param); }
+
+  /// Sets every parameter of `desc`. Samplers don't need to be bound to be
+  /// modified.
+  void SetDesc(const SamplerDesc &desc);
+
+  /// Binds `samplers` to texture units first_unit, first_unit + 1... with a
+  /// single glBindSamplers() call where supported (OpenGL 4.4).
+  static void BindRange(GLuint first_unit, GLsizei count, const Sampler *samplers);
+};
+
+/// Deduplicates sampling state: every SamplerDesc maps to a single Sampler,
+/// created on first use. Textures then keep their default parameters and
+/// draws bind the few shared samplers instead of calling glTexParameter* on
+/// each texture:
+///
+///     SamplerCache samplers;  // one per context (or share group)
+///     Sampler linear = samplers.Get(SamplerDesc::FilterAndWrap(GL_LINEAR, GL_REPEAT));
+///     ...
+///     linear.Bind(0);
+///     texture.Bind();
+///     glDrawArrays(...);
+///     ...
+///     samplers.Delete();
+///
+/// Applications typically use a handful of distinct descriptors, so they are
+/// kept in a small array and found by comparing their hashes.
+class SamplerCache {
+ public:
+  Sampler Get(const SamplerDesc &desc,
+              const char *file = PROTO3D_CALLER_FILE,
+              int line         = PROTO3D_CALLER_LINE) {
+    uint64_t hash = desc.Hash();
+    for (const Entry &entry : entries) {
+      if (entry.hash == hash && entry.desc == desc) {
+        return entry.sampler;
+      }
+    }
+    Entry entry;
+    entry.hash = hash;
+    entry.desc = desc;
+    entry.sampler.Create(file, line);
+    entry.sampler.SetDesc(desc);
+    entries.push_back(entry);
+    return entry.sampler;
+  }
+
+  /// Number of distinct samplers created.
+  size_t Size() const { return entries.size(); }
+
+  void Delete() {
+    for (Entry &entry : entries) {
+      entry.sampler.Delete();
+    }
+    entries.clear();
+  }
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    SamplerDesc desc;
+    Sampler sampler;
+  };
+
+  std::vector<Entry> entries;
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+void Sampler::SetDesc(const SamplerDesc &desc) {
+  SetParameter(GL_TEXTURE_MIN_FILTER, (GLint)desc.min_filter);
+  SetParameter(GL_TEXTURE_MAG_FILTER, (GLint)desc.mag_filter);
+  SetParameter(GL_TEXTURE_WRAP_S, (GLint)desc.wrap_s);
+  SetParameter(GL_TEXTURE_WRAP_T, (GLint)desc.wrap_t);
+  SetParameter(GL_TEXTURE_WRAP_R, (GLint)desc.wrap_r);
+  SetParameter(GL_TEXTURE_LOD_BIAS, desc.lod_bias);
+  SetParameter(GL_TEXTURE_COMPARE_MODE, (GLint)desc.compare_mode);
+  SetParameter(GL_TEXTURE_COMPARE_FUNC, (GLint)desc.compare_func);
+  if (desc.max_anisotropy > 1.0f &&
+      (HasVersion(4, 6) || HasExtension("GL_EXT_texture_filter_anisotropic"))) {
+    // GL_MAX_TEXTURE_MAX_ANISOTROPY has the same value as the EXT enum
+    GLfloat max_anisotropy = 1.0f;
+    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY, &max_anisotropy);
+    SetParameter(GL_TEXTURE_MAX_ANISOTROPY,
+                 desc.max_anisotropy < max_anisotropy ? desc.max_anisotropy : max_anisotropy);
+  }
+}
+
+void Sampler::BindRange(GLuint first_unit, GLsizei count, const Sampler *samplers) {
+  if (detail::MultiBindSupported()) {
+    glBindSamplers(first_unit, count, reinterpret_cast<const GLuint *>(samplers));
+  } else {
+    for (GLsizei i = 0; i < count; i++) {
+      samplers[i].Bind(first_unit + i);
+    }
+  }
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Samplers
+
+// Texture units {{{
+
+/// Shadow copy of the texture and sampler bound to each texture unit.
+///
+/// Set() and Acquire() only record the bindings a draw needs; Commit() then
+/// compares them with what is already bound and issues GL calls for the
+/// units that changed, a run of contiguous units at a time with one
+/// glBindTextures() and one glBindSamplers() call on OpenGL 4.4:
+///
+///     TextureUnits units(16, 2);  // units 0 and 1 are set by hand
+///     units.Set(0, shadow_map, shadow_sampler);
+///     for (const Material &material : materials) {
+///       program.SetUniform(albedo_location, (GLint)units.Acquire(material.albedo, linear));
+///       program.SetUniform(normal_location, (GLint)units.Acquire(material.normal, linear));
+///       units.Commit();
+///       glDrawElements(...);
+///     }
+///
+/// Units from `first_lru_unit` on are handed out by Acquire(): a texture that
+/// is still bound keeps its unit, others replace the least recently used
+/// one, so materials sharing textures don't rebind them.
+///
+/// Binding textures or samplers behind the manager's back (Texture2D::Bind()
+/// binds to the active unit, which Commit() may change without multi-bind)
+/// must be followed by Invalidate().
+class TextureUnits {
+ public:
+  explicit TextureUnits(GLuint unit_count = 16, GLuint first_lru_unit = 0)
+      : targets(unit_count, GL_TEXTURE_2D),
+        textures(unit_count, 0),
+        samplers(unit_count, 0),
+        bound_targets(unit_count),
+        bound_textures(unit_count),
+        bound_samplers(unit_count),
+        last_use(unit_count, 0),
+        first_lru_unit(first_lru_unit),
+        use_count(0),
+        commit_use_count(0),
+        bind_calls(0) {
+    assert(first_lru_unit <= unit_count);
+    Invalidate();
+  }
+
+  /// Records that `texture` (of type `target`) and `sampler` go to `unit` at
+  /// the next Commit().
+  void Set(GLuint unit, GLenum target, GLuint texture, GLuint sampler = 0) {
+    assert(unit < textures.size());
+    targets[unit]  = target;
+    textures[unit] = texture;
+    samplers[unit] = sampler;
+    last_use[unit] = ++use_count;
+  }
+
+  template <GLenum kTarget, GLenum kBinding>
+  void Set(GLuint unit,
+           const detail::TextureCommonTemplate<kTarget, kBinding> &texture,
+           Sampler sampler = Sampler()) {
+    Set(unit, kTarget, texture.id, sampler.id);
+  }
+
+  /// Picks a unit for `texture` and `sampler` among the LRU units and
+  /// records it like Set().
+  ///
+  /// At most `unit_count - first_lru_unit` different textures can be
+  /// acquired between two Commit() calls: evicting a unit the pending draw
+  /// already uses would silently rebind it, so that asserts.
+  /// @return the unit, to pass to the shader's sampler uniform
+  GLuint Acquire(GLenum target, GLuint texture, GLuint sampler = 0);
+
+  template <GLenum kTarget, GLenum kBinding>
+  GLuint Acquire(const detail::TextureCommonTemplate<kTarget, kBinding> &texture,
+                 Sampler sampler = Sampler()) {
+    return Acquire(kTarget, texture.id, sampler.id);
+  }
+
+  /// Binds what changed since the last Commit().
+  void Commit();
+
+  /// Forgets what is bound, so the next Commit() rebinds every unit.
+  void Invalidate() {
+    const GLuint kUnknown = 0xffffffff;
+    bound_targets.assign(bound_targets.size(), GL_TEXTURE_2D);
+    bound_textures.assign(bound_textures.size(), kUnknown);
+    bound_samplers.assign(bound_samplers.size(), kUnknown);
+  }
+
+  /// glBindTexture(s)/glBindSampler(s) calls made by Commit().
+  uint64_t BindCalls() const { return bind_calls; }
+
+ private:
+  /// Wanted state, what the next Commit() binds
+  std::vector<GLenum> targets;
+  std::vector<GLuint> textures;
+  std::vector<GLuint> samplers;
+  /// What the GL context has
+  std::vector<GLenum> bound_targets;
+  std::vector<GLuint> bound_textures;
+  std::vector<GLuint> bound_samplers;
+  std::vector<uint64_t> last_use;
+  GLuint first_lru_unit;
+  uint64_t use_count;
+  /// use_count at the last Commit(): units used after it are in use
+  uint64_t commit_use_count;
+  uint64_t bind_calls;
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+GLuint TextureUnits::Acquire(GLenum target, GLuint texture, GLuint sampler) {
+  GLuint unit_count = (GLuint)textures.size();
+  assert(first_lru_unit < unit_count && "No units left for TextureUnits::Acquire()");
+  GLuint lru_unit = first_lru_unit;
+  for (GLuint unit = first_lru_unit; unit < unit_count; unit++) {
+    if (textures[unit] == texture && samplers[unit] == sampler && targets[unit] == target) {
+      last_use[unit] = ++use_count;
+      return unit;
+    }
+    if (last_use[unit] < last_use[lru_unit]) {
+      lru_unit = unit;
+    }
+  }
+  assert(last_use[lru_unit] <= commit_use_count &&
+         "TextureUnits::Acquire() evicts a unit used since the last Commit()");
+  Set(lru_unit, target, texture, sampler);
+  return lru_unit;
+}
+
+void TextureUnits::Commit() {
+  PROTO3D_PROFILE_SCOPE("TextureUnits::Commit");
+  bool multi_bind   = detail::MultiBindSupported();
+  GLuint unit_count = (GLuint)textures.size();
+  commit_use_count  = use_count;
+
+  // Textures
+  for (GLuint first = 0; first < unit_count;) {
+    if (textures[first] == bound_textures[first] && targets[first] == bound_targets[first]) {
+      first++;
+      continue;
+    }
+    GLuint end = first + 1;
+    while (end < unit_count &&
+           (textures[end] != bound_textures[end] || targets[end] != bound_targets[end])) {
+      end++;
+    }
+    if (multi_bind) {
+      glBindTextures(first, end - first, &textures[first]);
+      bind_calls++;
+    } else {
+      for (GLuint unit = first; unit < end; unit++) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        if (targets[unit] != bound_targets[unit] && bound_textures[unit] != 0) {
+          glBindTexture(bound_targets[unit], 0);
+        }
+        glBindTexture(targets[unit], textures[unit]);
+        bind_calls++;
+      }
+    }
+    for (; first < end; first++) {
+      bound_textures[first] = textures[first];
+      bound_targets[first]  = targets[first];
+    }
+  }
+
+  // Samplers
+  for (GLuint first = 0; first < unit_count;) {
+    if (samplers[first] == bound_samplers[first]) {
+      first++;
+      continue;
+    }
+    GLuint end = first + 1;
+    while (end < unit_count && samplers[end] != bound_samplers[end]) {
+      end++;
+    }
+    if (multi_bind) {
+      glBindSamplers(first, end - first, &samplers[first]);
+      bind_calls++;
+    } else {
+      for (GLuint unit = first; unit < end; unit++) {
+        glBindSampler(unit, samplers[unit]);
+        bind_calls++;
+      }
+    }
+    for (; first < end; first++) {
+      bound_samplers[first] = samplers[first];
+    }
+  }
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Texture units
+
+// Texture atlas {{{
+
+/// Tightly packed 8-bit pixels of an image to put in a TextureAtlas, top row
+/// first like stb_image returns them.
+struct AtlasImage {
+  const GLubyte *pixels;
+  GLsizei width;
+  GLsizei height;
+};
+
+/// Where an image landed in a TextureAtlas.
+struct AtlasRegion {
+  /// Maps a uv of the image to the atlas layer: uv * xy + zw
+  Vec4 uv_transform;
+  GLint layer;
+  /// Texels of the image in the layer, padding excluded
+  GLint x;
+  GLint y;
+};
+
+/// Many small images (icons, sprites, glyphs) packed with a SkylinePacker
+/// into the layers of one Texture2DArray, so they can all be drawn with a
+/// single texture binding:
+///
+///     std::vector<AtlasRegion> regions(images.size());
+///     TextureAtlas atlas;
+///     const char *error = atlas.Build(
+///         images.data(), (int)images.size(), GL_RGBA, 2048, 2048, regions.data());
+///     ...
+///     // per vertex or instance: uv_transform and layer of the image
+///     vec3 atlas_uv = vec3(uv * uv_transform.xy + uv_transform.zw, layer);
+///     color         = texture(atlas, atlas_uv);
+///
+/// Every image is surrounded by `padding` copies of its edge texels, so
+/// bilinear filtering never blends in a neighbour. With mipmaps, the padding
+/// must be at least 2^(levels - 1) texels.
+class TextureAtlas {
+ public:
+  Texture2DArray texture;
+
+  TextureAtlas() : texture(0) {}
+
+  /// Packs `images` into as many layers of `page_width` x `page_height` as
+  /// needed, then creates `texture` (left bound to GL_TEXTURE_2D_ARRAY) and
+  /// uploads it one layer at a time.
+  ///
+  /// @param format GL_RED, GL_RG, GL_RGB or GL_RGBA, shared by every image
+  /// @param regions receives where each of the `count` images is
+  /// @param padding texels of edge copies around each image. Must be at least
+  /// 2^(levels - 1) so the smallest level doesn't blend neighbors together.
+  /// @param levels mip levels of `texture`, 0 for a full chain
+  /// @param srgb store color images as GL_SRGB8[_ALPHA8]
+  /// @return nullptr on success or a static string describing the problem
+  const char *Build(const AtlasImage *images,
+                    int count,
+                    GLenum format,
+                    GLsizei page_width,
+                    GLsizei page_height,
+                    AtlasRegion *regions,
+                    GLint padding  = 2,
+                    GLsizei levels = 1,
+                    bool srgb      = false);
+
+#ifdef PROTO3D_USE_STB
+  /// Build() for stb images, which must all have the same pixel format.
+  const char *Build(proto3d::stb::Image *const *images,
+                    int count,
+                    GLsizei page_width,
+                    GLsizei page_height,
+                    AtlasRegion *regions,
+                    GLint padding  = 2,
+                    GLsizei levels = 1,
+                    bool srgb      = false);
+#endif  // PROTO3D_USE_STB
+
+  void Delete() {
+    texture.Delete();
+    texture.id = 0;
+  }
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+namespace detail {
+/// Copies `image` into `page` with its top-left texel at (x, y), surrounded
+/// by `padding` copies of its edges.
+inline void BlitPadded(const AtlasImage &image,
+                       GLint components,
+                       GLint padding,
+                       GLubyte *page,
+                       GLsizei page_width,
+                       GLint x,
+                       GLint y) {
+  size_t texel     = (size_t)components;
+  size_t row_bytes = image.width * texel;
+  for (GLint row = -padding; row < image.height + padding; row++) {
+    GLint src_row      = std::min(std::max(row, 0), image.height - 1);
+    const GLubyte *src = image.pixels + src_row * row_bytes;
+    GLubyte *dst       = page + ((size_t)(y + row) * page_width + x) * texel;
+    memcpy(dst, src, row_bytes);
+    for (GLint i = 1; i <= padding; i++) {
+      memcpy(dst - i * texel, src, texel);
+      memcpy(dst + row_bytes + (i - 1) * texel, src + row_bytes - texel, texel);
+    }
+  }
+}
+}  // namespace detail
+
+const char *TextureAtlas::Build(const AtlasImage *images,
+                                int count,
+                                GLenum format,
+                                GLsizei page_width,
+                                GLsizei page_height,
+                                AtlasRegion *regions,
+                                GLint padding,
+                                GLsizei levels,
+                                bool srgb) {
+  PROTO3D_PROFILE_SCOPE("TextureAtlas::Build");
+  assert(texture.id == 0 && "TextureAtlas already built");
+  if (count <= 0) {
+    return "No atlas images";
+  }
+  if (levels == 0) {
+    levels = Texture2D::MipLevelCount(page_width, page_height);
+  }
+  assert(levels - 1 < 31 && padding >= (GLint)1 << (levels - 1) &&
+         "Atlas padding too small for the mip levels");
+  std::vector<int> widths((size_t)count), heights((size_t)count);
+  for (int i = 0; i < count; i++) {
+    if (images[i].width <= 0 || images[i].height <= 0) {
+      return "Empty atlas image";
+    }
+    widths[i]  = images[i].width + 2 * padding;
+    heights[i] = images[i].height + 2 * padding;
+  }
+  SkylinePacker packer(page_width, page_height);
+  std::vector<AtlasRect> rects((size_t)count);
+  if (!packer.PackAll(widths.data(), heights.data(), count, rects.data())) {
+    return "Atlas image larger than a page";
+  }
+
+  GLenum internal_format = detail::SizedInternalFormat(format);
+  if (srgb && internal_format == GL_RGB8) {
+    internal_format = GL_SRGB8;
+  } else if (srgb && internal_format == GL_RGBA8) {
+    internal_format = GL_SRGB8_ALPHA8;
+  }
+  texture.Gen();
+  texture.Bind();
+  texture.Storage(internal_format, page_width, page_height, packer.PageCount(), levels);
+  texture.SetGreySwizzle(format);
+
+  // Compose each layer in memory, unused texels included, and upload it at once
+  GLint components = detail::ComponentCount(format);
+  std::vector<GLubyte> page((size_t)page_width * page_height * components);
+  for (int layer = 0; layer < packer.PageCount(); layer++) {
+    std::fill(page.begin(), page.end(), 0);
+    for (int i = 0; i < count; i++) {
+      if (rects[i].page != layer) {
+        continue;
+      }
+      GLint x = rects[i].x + padding;
+      GLint y = rects[i].y + padding;
+      detail::BlitPadded(images[i], components, padding, page.data(), page_width, x, y);
+      regions[i].uv_transform = Vec4((float)images[i].width / page_width,
+                                     (float)images[i].height / page_height,
+                                     (float)x / page_width,
+                                     (float)y / page_height);
+      regions[i].layer        = layer;
+      regions[i].x            = x;
+      regions[i].y            = y;
+    }
+    texture.SubImage(0, 0, 0, layer, page_width, page_height, page.data(), format);
+  }
+  if (levels != 1) {
+    texture.GenerateMipmaps();
+  }
+  return nullptr;
+}
+
+#ifdef PROTO3D_USE_STB
+const char *TextureAtlas::Build(proto3d::stb::Image *const *images,
+                                int count,
+                                GLsizei page_width,
+                                GLsizei page_height,
+                                AtlasRegion *regions,
+                                GLint padding,
+                                GLsizei levels,
+                                bool srgb) {
+  if (count == 0) {
+    return "No atlas images";
+  }
+  GLenum format = images[0]->GLPixelFormat();
+  std::vector<AtlasImage> pixels((size_t)count);
+  for (int i = 0; i < count; i++) {
+    if (images[i]->GLPixelFormat() != format) {
+      return "Atlas images with different pixel formats";
+    }
+    pixels[i] = AtlasImage{images[i]->raw(), images[i]->width, images[i]->height};
+  }
+  return Build(
+      pixels.data(), count, format, page_width, page_height, regions, padding, levels, srgb);
+}
+#endif  // PROTO3D_USE_STB
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Texture atlas
+
+// Texture residency {{{
+
+/// Reloads the levels of a texture that TextureResidency evicted, from disk
+/// for instance: fills `levels` with at least the first `level_count` levels
+/// of the chain given to TextureResidency::Add(). Returns false on failure,
+/// the texture then stays at its reduced resolution until the next Use().
+typedef bool (*MipChainLoader)(void *user, GLint level_count, std::vector<MipLevel> *levels);
+
+/// Keeps the estimated GPU memory of a set of textures under a budget by
+/// dropping the top mip levels of the least recently used ones, rather than
+/// letting the driver page whole textures in and out when VRAM runs out:
+///
+///     TextureResidency residency(256 << 20);
+///     int rock = residency.Add(levels.data(), (int)levels.size(), GL_RGBA, true);
+///     ...
+///     // every frame, for every texture drawn
+///     units.Set(0, residency.Use(rock), sampler);
+///     ...
+///     residency.EndFrame();
+///
+/// The textures have mutable storage (glTexImage2D): evicting levels [0, n)
+/// sets GL_TEXTURE_BASE_LEVEL to n and re-specifies those levels empty, so the
+/// driver reallocates the texture smaller. Use() uploads them again from the
+/// copy kept by Add(), or through a MipChainLoader when only a disk copy is
+/// kept.
+///
+/// Add(), Use(), Remove() and EndFrame() restore the GL_TEXTURE_2D binding.
+class TextureResidency {
+ public:
+  /// @param budget_bytes estimated GPU memory allowed for all the textures
+  /// @param min_size levels no larger than `min_size` x `min_size` are never
+  /// evicted, so every texture keeps something to sample
+  explicit TextureResidency(int64_t budget_bytes, GLsizei min_size = 64)
+      : frame(0),
+        budget(budget_bytes),
+        resident_bytes(0),
+        min_size(min_size),
+        evicted_levels(0),
+        restored_levels(0) {}
+
+  /// Creates a texture from a mip chain, see GenerateMipChain().
+  ///
+  /// Without a `loader`, a copy of the evictable levels is kept to restore
+  /// them. With one, nothing is kept and `loader(user, ...)` is called when
+  /// levels have to be restored.
+  ///
+  /// @param format GL_RED, GL_RG, GL_RGB or GL_RGBA
+  /// @param srgb store color images as GL_SRGB8[_ALPHA8]
+  /// @return handle for Use() and Remove()
+  int Add(const MipLevel *levels,
+          int level_count,
+          GLenum format,
+          bool srgb,
+          MipChainLoader loader = nullptr,
+          void *user            = nullptr,
+          const char *file      = PROTO3D_CALLER_FILE,
+          int line              = PROTO3D_CALLER_LINE);
+
+  /// Marks the texture as used this frame and restores its evicted levels.
+  Texture2D Use(int handle);
+
+  /// Deletes the texture, `handle` may be reused by Add().
+  void Remove(int handle);
+
+  /// While over budget, evicts levels of the textures not used this frame,
+  /// least recently used first, then starts a new frame.
+  void EndFrame();
+
+  /// Deletes every texture.
+  void Delete();
+
+  void SetBudget(int64_t budget_bytes) { budget = budget_bytes; }
+
+  int64_t Budget() const { return budget; }
+
+  /// Estimated GPU memory of the levels currently resident.
+  int64_t ResidentBytes() const { return resident_bytes; }
+
+  /// First resident level of the texture, 0 when nothing is evicted.
+  GLint BaseLevel(int handle) const { return entries[handle].base_level; }
+
+  /// Number of levels evicted and restored so far.
+  uint64_t EvictedLevels() const { return evicted_levels; }
+  uint64_t RestoredLevels() const { return restored_levels; }
+
+ private:
+  struct Entry {
+    Texture2D texture;
+    GLenum format;
+    GLenum internal_format;
+    GLsizei width;
+    GLsizei height;
+    GLint level_count;
+    /// Levels below `base_level` are evicted, those from `max_base_level`
+    /// never are
+    GLint base_level;
+    GLint max_base_level;
+    uint64_t last_used_frame;
+    MipChainLoader loader;
+    void *user;
+    /// Copy of levels [0, max_base_level) when there's no loader
+    std::vector<MipLevel> levels;
+  };
+
+  int64_t LevelBytes(const Entry &entry, GLint level) const;
+  /// Evicts levels [base_level, new_base_level) of `entry`
+  void Evict(Entry *entry, GLint new_base_level);
+  /// Restores every evicted level of `entry`
+  void Restore(Entry *entry);
+
+  std::vector<Entry> entries;
+  std::vector<int> free_handles;
+  uint64_t frame;
+  int64_t budget;
+  int64_t resident_bytes;
+  GLsizei min_size;
+  uint64_t evicted_levels;
+  uint64_t restored_levels;
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+int TextureResidency::Add(const MipLevel *levels,
+                          int level_count,
+                          GLenum format,
+                          bool srgb,
+                          MipChainLoader loader,
+                          void *user,
+                          const char *file,
+                          int line) {
+  PROTO3D_PROFILE_SCOPE("TextureResidency::Add");
+  assert(level_count > 0);
+  int handle;
+  if (free_handles.empty()) {
+    handle = (int)entries.size();
+    entries.push_back(Entry());
+  } else {
+    handle = free_handles.back();
+    free_handles.pop_back();
+  }
+  Entry &entry          = entries[handle];
+  entry.format          = format;
+  entry.internal_format = detail::SizedInternalFormat(format);
+  if (srgb && entry.internal_format == GL_RGB8) {
+    entry.internal_format = GL_SRGB8;
+  } else if (srgb && entry.internal_format == GL_RGBA8) {
+    entry.internal_format = GL_SRGB8_ALPHA8;
+  }
+  entry.width           = levels[0].width;
+  entry.height          = levels[0].height;
+  entry.level_count     = level_count;
+  entry.base_level      = 0;
+  entry.last_used_frame = frame;
+  entry.loader          = loader;
+  entry.user            = user;
+  entry.max_base_level  = 0;
+  while (entry.max_base_level < level_count - 1 &&
+         (levels[entry.max_base_level].width > min_size ||
+          levels[entry.max_base_level].height > min_size)) {
+    entry.max_base_level++;
+  }
+  entry.levels.clear();
+  if (!loader) {
+    entry.levels.assign(levels, levels + entry.max_base_level);
+  }
+
+  GLint previous;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+  entry.texture.Gen(file, line);
+  entry.texture.Bind();
+  for (GLint level = 0; level < level_count; level++) {
+    const MipLevel &mip = levels[level];
+    detail::UnpackAlignmentScope alignment(mip.width * detail::ComponentCount(format));
+    glTexImage2D(GL_TEXTURE_2D,
+                 level,
+                 (GLint)entry.internal_format,
+                 mip.width,
+                 mip.height,
+                 0,
+                 format,
+                 GL_UNSIGNED_BYTE,
+                 mip.pixels.data());
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level_count - 1);
+  entry.texture.SetGreySwizzle(format);
+  glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+
+  int64_t bytes = 0;
+  for (GLint level = 0; level < level_count; level++) {
+    bytes += LevelBytes(entry, level);
+  }
+  resident_bytes += bytes;
+  detail::TrackBytes(kResourceTexture, entry.texture.id, bytes);
+  return handle;
+}
+
+Texture2D TextureResidency::Use(int handle) {
+  Entry &entry = entries[handle];
+  assert(entry.texture.id && "Texture removed");
+  entry.last_used_frame = frame;
+  if (entry.base_level > 0) {
+    Restore(&entry);
+  }
+  return entry.texture;
+}
+
+void TextureResidency::Remove(int handle) {
+  Entry &entry = entries[handle];
+  assert(entry.texture.id && "Texture removed twice");
+  for (GLint level = entry.base_level; level < entry.level_count; level++) {
+    resident_bytes -= LevelBytes(entry, level);
+  }
+  entry.texture.Delete();
+  entry.texture.id = 0;
+  entry.levels.clear();
+  entry.levels.shrink_to_fit();
+  free_handles.push_back(handle);
+}
+
+void TextureResidency::EndFrame() {
+  if (resident_bytes > budget) {
+    PROTO3D_PROFILE_SCOPE("TextureResidency::EndFrame (evict)");
+    std::vector<Entry *> candidates;
+    for (Entry &entry : entries) {
+      if (entry.texture.id && entry.last_used_frame != frame &&
+          entry.base_level < entry.max_base_level) {
+        candidates.push_back(&entry);
+      }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](const Entry *a, const Entry *b) {
+      return a->last_used_frame < b->last_used_frame;
+    });
+    for (size_t i = 0; i < candidates.size() && resident_bytes > budget; i++) {
+      Entry *entry         = candidates[i];
+      GLint new_base_level = entry->base_level;
+      int64_t bytes        = resident_bytes;
+      while (bytes > budget && new_base_level < entry->max_base_level) {
+        bytes -= LevelBytes(*entry, new_base_level);
+        new_base_level++;
+      }
+      Evict(entry, new_base_level);
+    }
+  }
+  frame++;
+}
+
+void TextureResidency::Delete() {
+  for (Entry &entry : entries) {
+    if (entry.texture.id) {
+      entry.texture.Delete();
+    }
+  }
+  entries.clear();
+  free_handles.clear();
+  resident_bytes = 0;
+}
+
+int64_t TextureResidency::LevelBytes(const Entry &entry, GLint level) const {
+  GLsizei level_width  = (entry.width >> level) > 0 ? (entry.width >> level) : 1;
+  GLsizei level_height = (entry.height >> level) > 0 ? (entry.height >> level) : 1;
+  return (int64_t)level_width * level_height * detail::BytesPerTexel(entry.internal_format);
+}
+
+void TextureResidency::Evict(Entry *entry, GLint new_base_level) {
+  GLint previous;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+  entry->texture.Bind();
+  // Raise the base level first so the texture stays complete
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, new_base_level);
+  for (GLint level = entry->base_level; level < new_base_level; level++) {
+    glTexImage2D(GL_TEXTURE_2D,
+                 level,
+                 (GLint)entry->internal_format,
+                 0,
+                 0,
+                 0,
+                 entry->format,
+                 GL_UNSIGNED_BYTE,
+                 nullptr);
+    resident_bytes -= LevelBytes(*entry, level);
+  }
+  glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+  evicted_levels += new_base_level - entry->base_level;
+  entry->base_level = new_base_level;
+
+  int64_t bytes = 0;
+  for (GLint level = new_base_level; level < entry->level_count; level++) {
+    bytes += LevelBytes(*entry, level);
+  }
+  detail::TrackBytes(kResourceTexture, entry->texture.id, bytes);
+}
+
+void TextureResidency::Restore(Entry *entry) {
+  PROTO3D_PROFILE_SCOPE("TextureResidency::Restore");
+  std::vector<MipLevel> loaded;
+  const std::vector<MipLevel> *levels = &entry->levels;
+  if (entry->loader) {
+    if (!entry->loader(entry->user, entry->base_level, &loaded) ||
+        (GLint)loaded.size() < entry->base_level) {
+      return;
+    }
+    levels = &loaded;
+  }
+  for (GLint level = 0; level < entry->base_level; level++) {
+    const MipLevel &mip = (*levels)[level];
+    if (mip.width != ((entry->width >> level) > 0 ? (entry->width >> level) : 1) ||
+        mip.height != ((entry->height >> level) > 0 ? (entry->height >> level) : 1)) {
+      return;
+    }
+  }
+
+  GLint previous;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+  entry->texture.Bind();
+  for (GLint level = 0; level < entry->base_level; level++) {
+    const MipLevel &mip = (*levels)[level];
+    detail::UnpackAlignmentScope alignment(mip.width * detail::ComponentCount(entry->format));
+    glTexImage2D(GL_TEXTURE_2D,
+                 level,
+                 (GLint)entry->internal_format,
+                 mip.width,
+                 mip.height,
+                 0,
+                 entry->format,
+                 GL_UNSIGNED_BYTE,
+                 mip.pixels.data());
+    resident_bytes += LevelBytes(*entry, level);
+  }
+  // Lower the base level last, once the levels are back
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+  glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+  restored_levels += entry->base_level;
+  entry->base_level = 0;
+
+  int64_t bytes = 0;
+  for (GLint level = 0; level < entry->level_count; level++) {
+    bytes += LevelBytes(*entry, level);
+  }
+  detail::TrackBytes(kResourceTexture, entry->texture.id, bytes);
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Texture residency
+
+// Texture streaming {{{
+
+/// Reads an image file that isn't KTX2 or DDS for TextureStreamer: fills
+/// `width`, `height` and `components` and, if `levels` isn't nullptr, decodes
+/// it into its full 8 bits per component mip chain.
+/// @return false if the file can't be read
+typedef bool (*ImageFileDecoder)(const uint8_t *data,
+                                 size_t size,
+                                 bool srgb,
+                                 int *width,
+                                 int *height,
+                                 int *components,
+                                 std::vector<MipLevel> *levels);
+
+#ifdef PROTO3D_USE_STB
+namespace detail {
+/// ImageFileDecoder for the formats stb_image reads. Only referenced from
+/// inline code, so programs that don't stream images don't need
+/// STB_IMAGE_IMPLEMENTATION.
+inline bool DecodeStbImageFile(const uint8_t *data,
+                               size_t size,
+                               bool srgb,
+                               int *width,
+                               int *height,
+                               int *components,
+                               std::vector<MipLevel> *levels) {
+  if (levels == nullptr) {
+    return stb::Image::InfoFromMemory(data, size, width, height, components);
+  }
+  std::unique_ptr<stb::Image> image = stb::Image::CreateFromMemory(data, size);
+  if (image == nullptr) {
+    return false;
+  }
+  *width      = image->width;
+  *height     = image->height;
+  *components = image->pixel_format;
+  GenerateMipChain(image->raw(), *width, *height, *components, srgb, kMipFilterBox, levels);
+  return true;
+}
+}  // namespace detail
+#endif  // PROTO3D_USE_STB
+
+/// Creates textures from files in a few milliseconds with only their mip tail,
+/// then refines them in the background, the textures the renderer reports as
+/// covering the most screen pixels per resident texel first:
+///
+///     TextureStreamer streamer;
+///     streamer.Create();
+///     int rock;
+///     const char *error = streamer.Add("rock.ktx2", true, &rock);
+///     ...
+///     // every frame
+///     streamer.ReportCoverage(rock, projected_area_in_pixels);
+///     units.Set(0, streamer.Texture(rock), sampler);
+///     ...
+///     streamer.Update(8 << 20);
+///
+/// Storage for the whole chain is allocated up front and GL_TEXTURE_BASE_LEVEL
+/// is lowered as the levels arrive, so Texture() can be sampled at any time.
+///
+/// KTX2 and DDS files (see CompressedImage) have their levels no larger than
+/// `tail_size` uploaded by Add(). The larger ones are read from the mapping by
+/// a worker thread, one level at a time and only down to the level the
+/// coverage calls for. Other images (with PROTO3D_USE_STB) have to be decoded
+/// whole: they start as a grey 1x1 level until the worker has decoded them and
+/// built their mip chain with GenerateMipChain().
+///
+/// Add(), Update() and Delete() restore the GL_TEXTURE_2D binding.
+class TextureStreamer {
+ public:
+  TextureStreamer() : busy(0), quit(false) {}
+  ~TextureStreamer() { StopWorker(); }
+
+  TextureStreamer(const TextureStreamer &) = delete;
+  TextureStreamer &operator=(const TextureStreamer &) = delete;
+
+  /// Starts the worker thread.
+  void Create();
+
+  /// Stops the worker thread and deletes every texture.
+  void Delete();
+
+  /// Creates a texture for the image at `path` with its mip tail uploaded.
+  ///
+  /// @param srgb store color images as GL_SRGB8[_ALPHA8], KTX2 and DDS files
+  /// have their own format
+  /// @param tail_size levels no larger than `tail_size` x `tail_size` are
+  /// loaded first whatever the coverage
+  /// @param handle receives the handle of the texture on success
+  /// @return nullptr on success or a static string describing the problem
+  const char *Add(const char *path,
+                  bool srgb,
+                  int *handle,
+                  GLsizei tail_size = 64,
+                  const char *file  = PROTO3D_CALLER_FILE,
+                  int line          = PROTO3D_CALLER_LINE) {
+#ifdef PROTO3D_USE_STB
+    return AddFile(path, srgb, handle, tail_size, detail::DecodeStbImageFile, file, line);
+#else
+    return AddFile(path, srgb, handle, tail_size, nullptr, file, line);
+#endif
+  }
+
+  /// The texture, complete from the first level loaded so far.
+  Texture2D Texture(int handle) const { return entries[handle]->texture; }
+
+  /// Number of screen pixels the texture covers this frame (the largest of the
+  /// reported values). Textures with no coverage are not refined past their
+  /// tail.
+  void ReportCoverage(int handle, float pixels) {
+    Entry &entry   = *entries[handle];
+    entry.coverage = pixels > entry.coverage ? pixels : entry.coverage;
+  }
+
+  /// Uploads the levels the worker has read or decoded, at most
+  /// `upload_budget_bytes` per call but always at least one level, and queues
+  /// the levels needed by this frame's coverage. Call once per frame.
+  void Update(int64_t upload_budget_bytes);
+
+  /// First uploaded level of the texture, the level count while a decoded
+  /// image still shows its placeholder.
+  GLint BaseLevel(int handle) const { return entries[handle]->base_level; }
+
+  /// Whether the image couldn't be decoded, the texture keeps its placeholder.
+  bool Failed(int handle) const { return entries[handle]->failed; }
+
+  /// Whether no level is being read or waiting for Update().
+  bool Idle() const;
+
+ private:
+  struct Entry {
+    Texture2D texture;
+    MappedFile file;
+    /// Levels of a KTX2 or DDS file, pointing into `file`
+    CompressedImage image;
+    /// Decoded whole by the worker with `decoder`, not a KTX2 or DDS file
+    bool decode;
+    ImageFileDecoder decoder;
+    bool srgb;
+    bool compressed;
+    GLenum format;
+    GLenum internal_format;
+    GLsizei width;
+    GLsizei height;
+    GLint level_count;
+    GLint tail_level;
+    GLint base_level;
+    /// Levels from `requested_level` are staged, queued or uploaded
+    GLint requested_level;
+    float coverage;
+    float priority;
+    bool failed;
+    /// Levels read by the worker: pixels, or blocks of compressed formats
+    std::vector<MipLevel> staged;
+    /// Which `staged` levels the worker handed over, only used by Update()
+    std::vector<bool> ready;
+  };
+
+  /// Read levels [first_level, last_level] of an entry, largest level index
+  /// first.
+  struct Request {
+    int handle;
+    Entry *entry;
+    GLint first_level;
+    GLint last_level;
+    float priority;
+  };
+
+  /// A staged level (every level for decoded images), -1 if decoding failed.
+  struct Done {
+    int handle;
+    GLint level;
+  };
+
+  /// Add() with `decoder` for the files that aren't KTX2 or DDS, nullptr to
+  /// reject them.
+  const char *AddFile(const char *path,
+                      bool srgb,
+                      int *handle,
+                      GLsizei tail_size,
+                      ImageFileDecoder decoder,
+                      const char *file,
+                      int line);
+  void WorkerLoop();
+  void StopWorker();
+  /// Fills `entry->staged[level]`, or every level of a decoded image.
+  static bool Stage(Entry *entry, GLint level);
+  /// Uploads a staged level and makes it the base level
+  static void UploadLevel(Entry *entry, GLint level);
+  /// Texels of `level`, at least 1
+  static float LevelTexels(const Entry &entry, GLint level);
+
+  std::vector<std::unique_ptr<Entry>> entries;
+  std::thread worker;
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  /// Sorted by priority, the next request is at the back
+  std::vector<Request> requests;
+  std::vector<Done> done;
+  int busy;
+  bool quit;
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+void TextureStreamer::Create() {
+  assert(!worker.joinable());
+  quit   = false;
+  worker = std::thread(&TextureStreamer::WorkerLoop, this);
+}
+
+void TextureStreamer::StopWorker() {
+  if (!worker.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  wake.notify_all();
+  worker.join();
+}
+
+void TextureStreamer::Delete() {
+  StopWorker();
+  for (const std::unique_ptr<Entry> &entry : entries) {
+    entry->texture.Delete();
+  }
+  entries.clear();
+  requests.clear();
+  done.clear();
+}
+
+const char *TextureStreamer::AddFile(const char *path,
+                                     bool srgb,
+                                     int *handle,
+                                     GLsizei tail_size,
+                                     ImageFileDecoder decoder,
+                                     const char *file,
+                                     int line) {
+  PROTO3D_PROFILE_SCOPE("TextureStreamer::Add");
+  std::unique_ptr<Entry> entry(new Entry());
+  if (!entry->file.Open(path)) {
+    return "Can't open the texture file";
+  }
+  entry->srgb     = srgb;
+  entry->coverage = 0.0f;
+  entry->priority = 0.0f;
+  entry->failed   = false;
+  entry->decode   = entry->image.Parse(entry->file.data, entry->file.size) != nullptr;
+  if (!entry->decode) {
+    const CompressedImage &image = entry->image;
+    if (!CompressedTexture2D::FormatSupported(image.internal_format)) {
+      return "Compressed texture format not supported by the OpenGL context";
+    }
+    GLint block_width, block_height, block_bytes;
+    entry->compressed = detail::CompressedBlockInfo(
+        image.internal_format, &block_width, &block_height, &block_bytes);
+
+    entry->internal_format = image.internal_format;
+    entry->width           = image.width;
+    entry->height          = image.height;
+    entry->level_count     = image.level_count;
+    entry->format          = GL_ZERO;
+    if (!entry->compressed) {
+      GLenum type;
+      detail::TransferFormat(image.internal_format, &entry->format, &type);
+    }
+  } else {
+    if (decoder == nullptr) {
+      return "Unsupported image file, not a KTX2 or DDS file and PROTO3D_USE_STB is not defined";
+    }
+    static const GLenum kFormats[4] = {GL_RED, GL_RG, GL_RGB, GL_RGBA};
+    int width, height, components;
+    if (!decoder(entry->file.data, entry->file.size, srgb, &width, &height, &components, nullptr) ||
+        width <= 0 || height <= 0 || components < 1 || components > 4) {
+      return "Unsupported image file";
+    }
+    entry->decoder         = decoder;
+    entry->width           = width;
+    entry->height          = height;
+    entry->compressed      = false;
+    entry->format          = kFormats[components - 1];
+    entry->internal_format = detail::SizedInternalFormat(entry->format);
+    if (srgb && entry->internal_format == GL_RGB8) {
+      entry->internal_format = GL_SRGB8;
+    } else if (srgb && entry->internal_format == GL_RGBA8) {
+      entry->internal_format = GL_SRGB8_ALPHA8;
+    }
+    entry->level_count = Texture2D::MipLevelCount(entry->width, entry->height);
+  }
+  entry->staged.resize((size_t)entry->level_count);
+  entry->ready.assign((size_t)entry->level_count, false);
+  entry->tail_level = entry->level_count - 1;
+  while (entry->tail_level > 0 && (entry->width >> (entry->tail_level - 1)) <= tail_size &&
+         (entry->height >> (entry->tail_level - 1)) <= tail_size) {
+    entry->tail_level--;
+  }
+
+  GLint previous;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+  Texture2D &texture = entry->texture;
+  texture.Gen(file, line);
+  texture.Bind();
+  if (!entry->compressed) {
+    texture.Storage(entry->internal_format, entry->width, entry->height, entry->level_count);
+    texture.SetGreySwizzle(entry->format);
+  } else if (Texture2D::ImmutableStorageSupported()) {
+    glTexStorage2D(
+        GL_TEXTURE_2D, entry->level_count, entry->internal_format, entry->width, entry->height);
+  } else {
+    for (GLint level = 0; level < entry->level_count; level++) {
+      const CompressedLevel &source = entry->image.levels[level];
+      glCompressedTexImage2D(GL_TEXTURE_2D,
+                             level,
+                             entry->internal_format,
+                             source.width,
+                             source.height,
+                             0,
+                             source.size,
+                             nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, entry->level_count - 1);
+  }
+  if (entry->compressed) {
+    int64_t bytes = 0;
+    for (GLint level = 0; level < entry->level_count; level++) {
+      bytes += entry->image.levels[level].size;
+    }
+    detail::TrackBytes(kResourceTexture, texture.id, bytes);
+  }
+
+  if (!entry->decode) {
+    // The tail is small enough to read right away
+    for (GLint level = entry->level_count - 1; level >= entry->tail_level; level--) {
+      Stage(entry.get(), level);
+      UploadLevel(entry.get(), level);
+    }
+    entry->requested_level = entry->tail_level;
+  } else {
+    // Grey until decoded, the real 1x1 level is uploaded with the others
+    static const GLubyte kGrey[4] = {128, 128, 128, 255};
+    GLint last_level              = entry->level_count - 1;
+    texture.SubImage(last_level, 0, 0, 1, 1, kGrey, entry->format);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, last_level);
+    entry->base_level      = entry->level_count;
+    entry->requested_level = entry->level_count;
+  }
+  glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+
+  *handle = (int)entries.size();
+  entries.push_back(std::move(entry));
+  return nullptr;
+}
+
+void TextureStreamer::Update(int64_t upload_budget_bytes) {
+  PROTO3D_PROFILE_SCOPE("TextureStreamer::Update");
+  std::vector<Done> finished;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished.swap(done);
+  }
+  for (const Done &item : finished) {
+    Entry &entry = *entries[item.handle];
+    if (item.level < 0) {
+      entry.failed = true;
+    } else if (entry.decode) {
+      entry.ready.assign(entry.ready.size(), true);
+    } else {
+      entry.ready[item.level] = true;
+    }
+  }
+
+  // Priority: screen pixels per resident texel, the blurriest textures first
+  std::vector<Entry *> uploads;
+  for (const std::unique_ptr<Entry> &entry : entries) {
+    entry->priority = entry->coverage / LevelTexels(*entry, entry->base_level);
+    if (entry->base_level > 0 && entry->ready[entry->base_level - 1]) {
+      uploads.push_back(entry.get());
+    }
+  }
+  std::sort(uploads.begin(), uploads.end(), [](const Entry *a, const Entry *b) {
+    return a->priority > b->priority;
+  });
+  GLint previous;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+  int64_t uploaded = 0;
+  for (Entry *entry : uploads) {
+    entry->texture.Bind();
+    while (entry->base_level > 0 && entry->ready[entry->base_level - 1] &&
+           (uploaded == 0 || uploaded < upload_budget_bytes)) {
+      GLint level = entry->base_level - 1;
+      uploaded += (int64_t)entry->staged[level].pixels.size();
+      UploadLevel(entry, level);
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < entries.size(); i++) {
+      Entry &entry = *entries[i];
+      // The smallest level with at least as many texels as covered pixels
+      GLint wanted = entry.tail_level;
+      while (wanted > 0 && LevelTexels(entry, wanted) < entry.coverage) {
+        wanted--;
+      }
+      if (!entry.failed && wanted < entry.requested_level) {
+        requests.push_back(Request{(int)i, &entry, wanted, entry.requested_level - 1, 0.0f});
+        entry.requested_level = entry.decode ? 0 : wanted;
+      }
+      entry.coverage = 0.0f;
+    }
+    for (Request &request : requests) {
+      request.priority = request.entry->priority;
+    }
+    std::stable_sort(requests.begin(), requests.end(), [](const Request &a, const Request &b) {
+      return a.priority < b.priority;
+    });
+  }
+  wake.notify_one();
+}
+
+bool TextureStreamer::Idle() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!requests.empty() || !done.empty() || busy) {
+    return false;
+  }
+  for (const std::unique_ptr<Entry> &entry : entries) {
+    if (entry->base_level > 0 && entry->ready[entry->base_level - 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TextureStreamer::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  for (;;) {
+    wake.wait(lock, [this] { return quit || !requests.empty(); });
+    if (quit) {
+      return;
+    }
+    Request request = requests.back();
+    requests.pop_back();
+    Entry *entry = request.entry;
+    busy++;
+    lock.unlock();
+    bool staged = Stage(entry, request.last_level);
+    lock.lock();
+    busy--;
+    done.push_back(Done{request.handle, staged ? request.last_level : -1});
+    // Requeue the rest so a more urgent texture can go first
+    if (staged && !entry->decode && request.last_level > request.first_level) {
+      request.last_level--;
+      requests.push_back(request);
+    }
+  }
+}
+
+bool TextureStreamer::Stage(Entry *entry, GLint level) {
+  if (!entry->decode) {
+    PROTO3D_PROFILE_SCOPE("TextureStreamer::Stage (read)");
+    const CompressedLevel &source = entry->image.levels[level];
+    MipLevel &staged              = entry->staged[level];
+    staged.width                  = source.width;
+    staged.height                 = source.height;
+    staged.pixels.assign(source.data, source.data + source.size);
+    return true;
+  }
+  PROTO3D_PROFILE_SCOPE("TextureStreamer::Stage (decode)");
+  int width, height, components;
+  if (!entry->decoder(entry->file.data,
+                      entry->file.size,
+                      entry->srgb,
+                      &width,
+                      &height,
+                      &components,
+                      &entry->staged)) {
+    return false;
+  }
+  return width == entry->width && height == entry->height &&
+         components == detail::ComponentCount(entry->format);
+}
+
+void TextureStreamer::UploadLevel(Entry *entry, GLint level) {
+  MipLevel &source = entry->staged[level];
+  if (entry->compressed) {
+    glCompressedTexSubImage2D(GL_TEXTURE_2D,
+                              level,
+                              0,
+                              0,
+                              source.width,
+                              source.height,
+                              entry->internal_format,
+                              (GLsizei)source.pixels.size(),
+                              source.pixels.data());
+  } else {
+    entry->texture.SubImage(
+        level, 0, 0, source.width, source.height, source.pixels.data(), entry->format);
+  }
+  std::vector<uint8_t>().swap(source.pixels);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+  entry->base_level = level;
+}
+
+float TextureStreamer::LevelTexels(const Entry &entry, GLint level) {
+  GLsizei width  = (entry.width >> level) > 0 ? (entry.width >> level) : 1;
+  GLsizei height = (entry.height >> level) > 0 ? (entry.height >> level) : 1;
+  return (float)width * height;
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Texture streaming
+
+// Bindless textures {{{
+
+/// Textures that shaders pick by integer index, so a material loop needs no
+/// texture binds and draws differing only by texture can be merged:
+///
+///     BindlessTextureTable table;
+///     table.Create(1024, 1024, 1024, GL_SRGB8_ALPHA8);
+///     std::string source = std::string("#version 450\n") + table.GlslSource() + shader_body;
+///     ...
+///     table.SetupProgram(program, 0);
+///     GLuint rock;
+///     table.Add(rock_texture, trilinear, &rock);
+///     ...
+///     // every frame, for every texture drawn
+///     table.Use(rock);
+///     ... pass `rock` per draw or instance (flat), then in the shader:
+///     color = Proto3dTexture(material_texture, uv);
+///     ...
+///     table.Bind(0);  // once, before the draws
+///     ...
+///     table.EndFrame();
+///
+/// With GL_ARB_bindless_texture and shader storage buffers (OpenGL 4.3), the
+/// table is a buffer of texture handles. Use() makes handles resident and
+/// EndFrame() makes those unused for `max_idle_frames` frames non-resident
+/// again, so only the textures in use count against the driver's residency
+/// limits.
+///
+/// Otherwise the textures are copied into the layers of a Texture2DArray,
+/// so they must all be `width` x `height` with `internal_format`. The whole
+/// array is sampled with the sampler of the first Add().
+class BindlessTextureTable {
+ public:
+  explicit BindlessTextureTable(uint64_t max_idle_frames = 2)
+      : buffer(0),
+        array(0),
+        sampler(0),
+        capacity(0),
+        bindless(false),
+        generate_mipmaps(false),
+        dirty_begin(0),
+        dirty_end(0),
+        frame(0),
+        max_idle_frames(max_idle_frames) {}
+
+  /// Whether the context has everything the bindless path needs.
+  static bool BindlessSupported() {
+    return HasExtension("GL_ARB_bindless_texture") &&
+           (HasVersion(4, 3) || HasExtension("GL_ARB_shader_storage_buffer_object"));
+  }
+
+  /// @param capacity maximum number of textures
+  /// @param width, height, internal_format, levels layers of the fallback
+  /// Texture2DArray (levels 0 for a full chain)
+  /// @param allow_bindless use the fallback even if bindless is supported
+  void Create(GLsizei capacity,
+              GLsizei width,
+              GLsizei height,
+              GLenum internal_format,
+              GLsizei levels      = 0,
+              bool allow_bindless = true,
+              const char *file    = PROTO3D_CALLER_FILE,
+              int line            = PROTO3D_CALLER_LINE);
+
+  /// Makes handles non-resident and deletes the table, not the textures added.
+  void Delete();
+
+  /// Whether the table holds bindless handles rather than array layers.
+  bool Bindless() const { return bindless; }
+
+  /// Declarations to insert after the #version line of the shaders: the table
+  /// and `vec4 Proto3dTexture(uint index, vec2 uv)`.
+  const char *GlslSource() const;
+
+  /// Points the table of `program` at `binding`: the shader storage block
+  /// binding, or the texture unit of the fallback array.
+  void SetupProgram(Program program, GLuint binding) const;
+
+  /// Adds `texture` with the state of `sampler` (Sampler(0) for the texture's
+  /// own parameters). In the fallback, the texture is copied and can be
+  /// deleted afterwards.
+  ///
+  /// @param index receives the index shaders pass to Proto3dTexture()
+  /// @return nullptr on success or a static string describing the problem
+  const char *Add(Texture2D texture, Sampler sampler, GLuint *index);
+
+  /// Frees `index` for a later Add().
+  void Remove(GLuint index);
+
+  /// Marks the texture as used this frame and makes its handle resident.
+  void Use(GLuint index) {
+    entries[index].last_used_frame = frame;
+    if (bindless && !entries[index].resident) {
+      glMakeTextureHandleResidentARB(entries[index].handle);
+      entries[index].resident = true;
+    }
+  }
+
+  /// Uploads the handles changed since the last call and binds the table to
+  /// `binding`, see SetupProgram(). The fallback changes the active texture
+  /// unit to `binding` and back to 0, call TextureUnits::Invalidate() if it
+  /// manages that unit.
+  void Bind(GLuint binding);
+
+  /// Makes the handles unused for `max_idle_frames` frames non-resident.
+  void EndFrame();
+
+  /// Number of resident handles.
+  size_t ResidentCount() const;
+
+ private:
+  struct Entry {
+    GLuint64 handle;
+    uint64_t last_used_frame;
+    bool used;
+    bool resident;
+  };
+
+  void MakeNonResident(Entry *entry) {
+    if (entry->resident) {
+      glMakeTextureHandleNonResidentARB(entry->handle);
+      entry->resident = false;
+    }
+  }
+
+  void MarkDirty(GLuint index) {
+    if (dirty_begin == dirty_end) {
+      dirty_begin = index;
+      dirty_end   = index + 1;
+    } else {
+      dirty_begin = std::min(dirty_begin, index);
+      dirty_end   = std::max(dirty_end, index + 1);
+    }
+  }
+
+  /// Copies every level of `texture` the array has into `layer`.
+  const char *CopyToLayer(Texture2D texture, GLint layer);
+
+  GLuint buffer;
+  Texture2DArray array;
+  Sampler sampler;
+  GLsizei capacity;
+  GLsizei width;
+  GLsizei height;
+  GLenum internal_format;
+  GLsizei levels;
+  bool bindless;
+  /// Some layers were copied without their mip levels
+  bool generate_mipmaps;
+  std::vector<Entry> entries;
+  std::vector<GLuint> free_indices;
+  /// Handles to upload: [dirty_begin, dirty_end)
+  GLuint dirty_begin;
+  GLuint dirty_end;
+  uint64_t frame;
+  uint64_t max_idle_frames;
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+void BindlessTextureTable::Create(GLsizei capacity,
+                                  GLsizei width,
+                                  GLsizei height,
+                                  GLenum internal_format,
+                                  GLsizei levels,
+                                  bool allow_bindless,
+                                  const char *file,
+                                  int line) {
+  assert(buffer == 0 && array.id == 0 && "BindlessTextureTable already created");
+  this->capacity        = capacity;
+  this->width           = width;
+  this->height          = height;
+  this->internal_format = internal_format;
+  this->levels          = levels == 0 ? Texture2D::MipLevelCount(width, height) : levels;
+  bindless              = allow_bindless && BindlessSupported();
+  if (bindless) {
+    glGenBuffers(1, &buffer);
+    detail::TrackCreate(kResourceBuffer, buffer, file, line);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,
+                 capacity * (GLsizeiptr)sizeof(GLuint64),
+                 nullptr,
+                 GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    detail::TrackBytes(kResourceBuffer, buffer, capacity * (int64_t)sizeof(GLuint64));
+  } else {
+    GLint previous;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D_ARRAY, &previous);
+    array.Gen(file, line);
+    array.Bind();
+    array.Storage(internal_format, width, height, capacity, this->levels);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, (GLuint)previous);
+  }
+}
+
+void BindlessTextureTable::Delete() {
+  if (bindless) {
+    for (Entry &entry : entries) {
+      MakeNonResident(&entry);
+    }
+    detail::TrackDelete(kResourceBuffer, buffer);
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+  } else if (array.id) {
+    array.Delete();
+    array.id = 0;
+  }
+  entries.clear();
+  free_indices.clear();
+  sampler          = Sampler(0);
+  generate_mipmaps = false;
+  dirty_begin      = 0;
+  dirty_end        = 0;
+}
+
+const char *BindlessTextureTable::GlslSource() const {
+  if (bindless) {
+    return "#extension GL_ARB_bindless_texture : require\n"
+           "layout(std430) readonly buffer Proto3dTextureTable {\n"
+           "  sampler2D proto3d_textures[];\n"
+           "};\n"
+           "vec4 Proto3dTexture(uint index, vec2 uv) {\n"
+           "  return texture(proto3d_textures[index], uv);\n"
+           "}\n";
+  }
+  return "uniform sampler2DArray proto3d_textures;\n"
+         "vec4 Proto3dTexture(uint index, vec2 uv) {\n"
+         "  return texture(proto3d_textures, vec3(uv, float(index)));\n"
+         "}\n";
+}
+
+void BindlessTextureTable::SetupProgram(Program program, GLuint binding) const {
+  if (bindless) {
+    GLuint block =
+        glGetProgramResourceIndex(program.id, GL_SHADER_STORAGE_BLOCK, "Proto3dTextureTable");
+    if (block != GL_INVALID_INDEX) {
+      glShaderStorageBlockBinding(program.id, block, binding);
+    }
+    return;
+  }
+  GLint previous;
+  glGetIntegerv(GL_CURRENT_PROGRAM, &previous);
+  program.Use();
+  glUniform1i(program.UniformLocation("proto3d_textures"), (GLint)binding);
+  glUseProgram((GLuint)previous);
+}
+
+const char *BindlessTextureTable::Add(Texture2D texture, Sampler sampler, GLuint *index) {
+  PROTO3D_PROFILE_SCOPE("BindlessTextureTable::Add");
+  GLuint slot;
+  if (!free_indices.empty()) {
+    slot = free_indices.back();
+  } else if ((GLsizei)entries.size() < capacity) {
+    slot = (GLuint)entries.size();
+  } else {
+    return "BindlessTextureTable full";
+  }
+
+  Entry entry = {0, frame, true, false};
+  if (bindless) {
+    entry.handle = sampler.id ? glGetTextureSamplerHandleARB(texture.id, sampler.id)
+                              : glGetTextureHandleARB(texture.id);
+    if (entry.handle == 0) {
+      return "Can't get a bindless handle for the texture";
+    }
+  } else {
+    const char *error = CopyToLayer(texture, (GLint)slot);
+    if (error != nullptr) {
+      return error;
+    }
+    if (this->sampler.id == 0) {
+      this->sampler = sampler;
+    }
+  }
+
+  if (slot == entries.size()) {
+    entries.push_back(entry);
+  } else {
+    free_indices.pop_back();
+    entries[slot] = entry;
+  }
+  MarkDirty(slot);
+  *index = slot;
+  return nullptr;
+}
+
+void BindlessTextureTable::Remove(GLuint index) {
+  Entry &entry = entries[index];
+  assert(entry.used && "Texture removed twice");
+  if (bindless) {
+    MakeNonResident(&entry);
+  }
+  entry.used = false;
+  free_indices.push_back(index);
+  MarkDirty(index);
+}
+
+void BindlessTextureTable::Bind(GLuint binding) {
+  if (!bindless) {
+    glActiveTexture(GL_TEXTURE0 + binding);
+    array.Bind();
+    if (generate_mipmaps) {
+      array.GenerateMipmaps();
+      generate_mipmaps = false;
+    }
+    if (sampler.id) {
+      sampler.Bind(binding);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    return;
+  }
+  if (dirty_begin != dirty_end) {
+    PROTO3D_PROFILE_SCOPE("BindlessTextureTable::Bind (upload)");
+    std::vector<GLuint64> handles(dirty_end - dirty_begin);
+    for (GLuint i = dirty_begin; i < dirty_end; i++) {
+      handles[i - dirty_begin] = entries[i].used ? entries[i].handle : 0;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                    dirty_begin * (GLintptr)sizeof(GLuint64),
+                    handles.size() * (GLsizeiptr)sizeof(GLuint64),
+                    handles.data());
+    dirty_begin = dirty_end = 0;
+  }
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+}
+
+void BindlessTextureTable::EndFrame() {
+  if (bindless) {
+    for (Entry &entry : entries) {
+      if (entry.resident && frame - entry.last_used_frame >= max_idle_frames) {
+        MakeNonResident(&entry);
+      }
+    }
+  }
+  frame++;
+}
+
+size_t BindlessTextureTable::ResidentCount() const {
+  size_t count = 0;
+  for (const Entry &entry : entries) {
+    count += entry.resident ? 1 : 0;
+  }
+  return count;
+}
+
+const char *BindlessTextureTable::CopyToLayer(Texture2D texture, GLint layer) {
+  GLint previous;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+  texture.Bind();
+  GLint source_width, source_height, source_format;
+  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &source_width);
+  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &source_height);
+  glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &source_format);
+  if (source_width != width || source_height != height ||
+      (GLenum)source_format != internal_format) {
+    glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+    return "Texture size or format differs from the BindlessTextureTable layers";
+  }
+  // Levels outside [GL_TEXTURE_BASE_LEVEL, GL_TEXTURE_MAX_LEVEL] or never
+  // specified are rebuilt with glGenerateMipmap() on the next Bind()
+  GLint base_level, max_level;
+  glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, &base_level);
+  glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, &max_level);
+  GLint copied = 0;
+  while (copied < levels && copied <= max_level && base_level == 0) {
+    GLint level_width;
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, copied, GL_TEXTURE_WIDTH, &level_width);
+    if (level_width == 0) {
+      break;
+    }
+    copied++;
+  }
+  if (copied == 0) {
+    glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+    return "Texture level 0 is not resident";
+  }
+
+  // glCopyImageSubData() fails on incomplete textures, which mutable ones with
+  // missing levels are: read those back instead
+  GLint block_width, block_height, block_bytes, immutable;
+  bool compressed =
+      detail::CompressedBlockInfo(internal_format, &block_width, &block_height, &block_bytes);
+  glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable);
+  bool copy_image = (immutable || compressed || copied == levels) &&
+                    (HasVersion(4, 3) || HasExtension("GL_ARB_copy_image"));
+  if (!copy_image && compressed) {
+    glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+    return "Copying compressed textures needs OpenGL 4.3 or GL_ARB_copy_image";
+  }
+  GLint previous_array;
+  glGetIntegerv(GL_TEXTURE_BINDING_2D_ARRAY, &previous_array);
+  array.Bind();
+  std::vector<uint8_t> pixels;
+  for (GLint level = 0; level < copied; level++) {
+    GLsizei level_width  = (width >> level) > 0 ? (width >> level) : 1;
+    GLsizei level_height = (height >> level) > 0 ? (height >> level) : 1;
+    if (copy_image) {
+      glCopyImageSubData(texture.id,
+                         GL_TEXTURE_2D,
+                         level,
+                         0,
+                         0,
+                         0,
+                         array.id,
+                         GL_TEXTURE_2D_ARRAY,
+                         level,
+                         0,
+                         0,
+                         layer,
+                         level_width,
+                         level_height,
+                         1);
+    } else {
+      // Sized from the transfer format, which for float formats is wider than
+      // the texels (GL_RGBA16F is read back as GL_FLOAT)
+      GLenum format, type;
+      detail::TransferFormat(internal_format, &format, &type);
+      pixels.resize((size_t)level_width * level_height *
+                    detail::TransferBytesPerPixel(format, type));
+      {
+        detail::PackStateScope pack_state(1);
+        glGetTexImage(GL_TEXTURE_2D, level, format, type, pixels.data());
+      }
+      detail::UnpackAlignmentScope alignment(1);
+      array.SubImage(level, 0, 0, layer, level_width, level_height, format, type, pixels.data());
+    }
+  }
+  generate_mipmaps = generate_mipmaps || copied < levels;
+  glBindTexture(GL_TEXTURE_2D_ARRAY, (GLuint)previous_array);
+  glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+  return nullptr;
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Bindless textures
+
+// Framebuffers {{{
+
+// Since OpenGL 3.0
+class Renderbuffer {
+ public:
+  GLuint id;
+
+  Renderbuffer(GLuint id) : id(id) {}  // NOLINT
+
+  Renderbuffer() : id(0) {}
+
+  void Create(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    assert(id == 0);
+    glGenRenderbuffers(1, &id);
+    detail::TrackCreate(kResourceRenderbuffer, id, file, line);
+  }
+
+  void Delete() {
+    detail::TrackDelete(kResourceRenderbuffer, id);
+    glDeleteRenderbuffers(1, &id);
+  }
+
+  void Bind() const {
+    assert(id != 0);
+    glBindRenderbuffer(GL_RENDERBUFFER, id);
+  }
+
+  void Unbind() const { glBindRenderbuffer(GL_RENDERBUFFER, 0); }
+
+  bool Bound() const {
+    GLint current;
+    glGetIntegerv(GL_RENDERBUFFER_BINDING, &current);
+    return id && id == (GLuint)current;
+  }
+
+  /// @param internal_format sized format: GL_RGBA8, GL_DEPTH24_STENCIL8...
+  /// @param samples 0 for a single-sampled renderbuffer
+  void Storage(GLenum internal_format, GLsizei width, GLsizei height, GLsizei samples = 0) {
+    assert(Bound());
+    if (samples > 0) {
+      glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, internal_format, width, height);
+    } else {
+      glRenderbufferStorage(GL_RENDERBUFFER, internal_format, width, height);
+    }
+    detail::TrackBytes(kResourceRenderbuffer,
+                       id,
+                       (int64_t)width * height * detail::BytesPerTexel(internal_format) *
+                           (samples > 0 ? samples : 1));
   }
+};
 
-  void EnableArray(GLint index) {
+// Since OpenGL 3.0
+class Framebuffer {
+ public:
+  GLuint id;
+
+  Framebuffer(GLuint id) : id(id) {}  // NOLINT
+
+  Framebuffer() : id(0) {}
+
+  void Create(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE) {
+    assert(id == 0);
+    glGenFramebuffers(1, &id);
+    detail::TrackCreate(kResourceFramebuffer, id, file, line);
+  }
+
+  void Delete() {
+    detail::TrackDelete(kResourceFramebuffer, id);
+    glDeleteFramebuffers(1, &id);
+  }
+
+  /// @param target GL_FRAMEBUFFER, GL_DRAW_FRAMEBUFFER or GL_READ_FRAMEBUFFER
+  void Bind(GLenum target = GL_FRAMEBUFFER) const {
+    assert(id != 0);
+    glBindFramebuffer(target, id);
+  }
+
+  /// Binds the default framebuffer.
+  void Unbind(GLenum target = GL_FRAMEBUFFER) const { glBindFramebuffer(target, 0); }
+
+  bool Bound() const { return id && id == CurrentBinding().id; }
+
+  static Framebuffer CurrentBinding() {
+    GLint current;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &current);
+    return Framebuffer((GLuint)current);
+  }
+
+  /// @param attachment GL_COLOR_ATTACHMENTi, GL_DEPTH_ATTACHMENT,
+  /// GL_STENCIL_ATTACHMENT or GL_DEPTH_STENCIL_ATTACHMENT
+  void AttachTexture(GLenum attachment, const Texture2D &texture, GLint level = 0) {
     assert(Bound());
-    assert(index < MaxNumberOfArrays());
-    glEnableVertexAttribArray(index);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, texture.id, level);
   }
 
-  void DisableArray(GLint index) {
+  void AttachRenderbuffer(GLenum attachment, const Renderbuffer &renderbuffer) {
     assert(Bound());
-    glDisableVertexAttribArray(index);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, attachment, GL_RENDERBUFFER, renderbuffer.id);
   }
 
-  void AddArray(GLint index, const VBO vbo, const VertexPointerFormat &format) {
-    assert(vbo.Bound());
-    SetArrayFormat(index, format);
-    EnableArray(index);
+  /// Selects the color attachments fragment outputs are written to. Pass
+  /// count = 0 for a depth-only framebuffer.
+  void SetDrawBuffers(const GLenum *buffers, GLsizei count) {
+    assert(Bound());
+    if (count == 0) {
+      glDrawBuffer(GL_NONE);
+      glReadBuffer(GL_NONE);
+    } else {
+      glDrawBuffers(count, buffers);
+    }
   }
 
-  VBO AddArray(GLint index,
-               const GLvoid *data,
-               GLsizeiptr size,
-               GLenum usage,
-               const VertexPointerFormat &format) {
-    assert(VBO::CurrentBinding().id == 0 && "No VBO should be bound before VBO::AddArray()");
-    VBO vbo;
-    vbo.Create();
-    vbo.Bind();
-    vbo.LoadBufferData(data, size, usage);
-    AddArray(index, vbo, format);
-    vbo.Unbind();
-    return vbo;
+  /// @return nullptr if the bound framebuffer is complete, see
+  /// FramebufferStatusString()
+  const char *StatusString() const {
+    assert(Bound());
+    return FramebufferStatusString();
   }
+};
 
-  VBO AddArray(GLint index,
-               const GLvoid *data,
-               GLsizeiptr size,
-               const VertexPointerFormat &format) {
-    return AddArray(index, data, size, GL_STATIC_DRAW, format);
+/// What a pooled render target is: targets with the same description are
+/// interchangeable.
+struct RenderTargetDesc {
+  GLsizei width;
+  GLsizei height;
+  /// Sized format: GL_RGBA8, GL_RGBA16F, GL_DEPTH24_STENCIL8...
+  GLenum internal_format;
+  /// 0 for a sampleable Texture2D, > 0 for a multisampled Renderbuffer
+  GLsizei samples;
+
+  bool operator==(const RenderTargetDesc &other) const {
+    return width == other.width && height == other.height &&
+           internal_format == other.internal_format && samples == other.samples;
   }
 };
 
-void Create(VAO *vao_arr, GLuint count);
-void Delete(VAO *vao_arr, GLuint count);
+/// A texture (samples == 0) or a multisampled renderbuffer handed out by a
+/// RenderTargetPool.
+struct RenderTarget {
+  RenderTargetDesc desc;
+  GLuint id;
+
+  bool IsTexture() const { return desc.samples == 0; }
+
+  /// Texture and renderbuffer names may collide, the key does not.
+  GLuint Key() const { return IsTexture() ? id : id | 0x80000000u; }
+
+  Texture2D AsTexture() const {
+    assert(IsTexture());
+    return Texture2D(id);
+  }
+
+  Renderbuffer AsRenderbuffer() const {
+    assert(!IsTexture());
+    return Renderbuffer(id);
+  }
+};
+
+/// Recycles transient render targets and the framebuffers built from them.
+///
+/// A pass Acquire()s the targets it writes and Release()s its inputs as soon
+/// as the last pass reading them is recorded. A released target is handed
+/// out again to the next pass asking for the same RenderTargetDesc in the
+/// same frame, so a post-processing chain ping-pongs between a couple of
+/// textures instead of allocating one per effect:
+///
+///     RenderTarget hdr   = pool.Acquire({w, h, GL_RGBA16F, 0});
+///     ... draw scene into pool.GetFramebuffer(&hdr, 1, &depth) ...
+///     RenderTarget bloom = pool.Acquire({w / 2, h / 2, GL_RGBA16F, 0});
+///     ... downsample hdr into bloom ...
+///     RenderTarget tonemapped = pool.Acquire({w, h, GL_RGBA8, 0});
+///     ... tonemap hdr + bloom ...
+///     pool.Release(hdr);
+///     pool.Release(bloom);
+///     ...
+///     pool.EndFrame();
+///
+/// Targets not acquired for `max_idle_frames` frames (e.g. the old size after
+/// a window resize) are deleted in EndFrame(), together with the framebuffers
+/// that use them.
+class RenderTargetPool {
+ public:
+  static const int kMaxColorAttachments = 4;
+
+  explicit RenderTargetPool(uint64_t max_idle_frames = 2)
+      : frame(0), max_idle_frames(max_idle_frames) {}
+
+  /// Returns a free target matching `desc`, creating one if needed. Changes
+  /// the GL_TEXTURE_2D or GL_RENDERBUFFER binding when a target is created.
+  RenderTarget Acquire(const RenderTargetDesc &desc,
+                       const char *file = PROTO3D_CALLER_FILE,
+                       int line         = PROTO3D_CALLER_LINE);
+
+  /// Makes `target` available to later Acquire() calls. Its content is not
+  /// preserved.
+  void Release(const RenderTarget &target);
+
+  /// Framebuffer with `colors` attached to GL_COLOR_ATTACHMENT0.. and `depth`
+  /// (may be null) to the depth or depth-stencil attachment, created on first
+  /// use and cached. Draw buffers are set to all the color attachments.
+  /// Restores the framebuffer binding when one is created.
+  Framebuffer GetFramebuffer(const RenderTarget *colors,
+                             int color_count,
+                             const RenderTarget *depth);
+
+  /// Deletes targets idle for more than `max_idle_frames` frames.
+  void EndFrame();
+
+  /// Deletes every target and framebuffer, acquired or not.
+  void Delete();
+
+  /// GPU memory held by the pool.
+  int64_t Bytes() const;
+
+  size_t TargetCount() const { return entries.size(); }
+
+ private:
+  struct Entry {
+    RenderTarget target;
+    bool in_use;
+    uint64_t last_used_frame;
+  };
+
+  struct CachedFramebuffer {
+    /// RenderTarget::Key() of the color attachments then depth, 0 if unused
+    GLuint attachments[kMaxColorAttachments + 1];
+    Framebuffer framebuffer;
+  };
+
+  void DeleteTarget(const RenderTarget &target);
+
+  std::vector<Entry> entries;
+  std::vector<CachedFramebuffer> framebuffers;
+  uint64_t frame;
+  uint64_t max_idle_frames;
+};
+
+/// A rectangle of a PosterLayout, in image pixels with y going down (file
+/// order, unlike glViewport()).
+struct PosterTile {
+  GLint x;
+  GLint y;
+  GLsizei width;
+  GLsizei height;
+};
+
+/// Splits an image larger than a render target can be (GL_MAX_TEXTURE_SIZE,
+/// or just too much memory) into tiles of at most `tile_size` pixels, which
+/// can be rendered independently, even by different contexts:
+///
+///     PosterLayout layout = {32768, 32768, 4096};
+///     for (int i = 0; i < layout.TileCount(); i++) {
+///       PosterTile tile = layout.Tile(i);
+///       ... bind a tile.width x tile.height target ...
+///       program.SetUniformMat4(loc, layout.Projection(projection, tile) * view);
+///       ... draw, then read back into the image at (tile.x, tile.y) ...
+///     }
+struct PosterLayout {
+  GLsizei width;
+  GLsizei height;
+  GLsizei tile_size;
+
+  int Columns() const { return (width + tile_size - 1) / tile_size; }
+  int Rows() const { return (height + tile_size - 1) / tile_size; }
+  int TileCount() const { return Columns() * Rows(); }
+
+  /// Tiles are numbered row by row from the top-left corner.
+  PosterTile Tile(int index) const {
+    PosterTile tile;
+    tile.x      = (index % Columns()) * tile_size;
+    tile.y      = (index / Columns()) * tile_size;
+    tile.width  = (width - tile.x < tile_size) ? width - tile.x : tile_size;
+    tile.height = (height - tile.y < tile_size) ? height - tile.y : tile_size;
+    return tile;
+  }
+
+  /// `projection` of the whole image narrowed to `tile`: scales and offsets
+  /// the clip space so the tile covers the full viewport. Works for any
+  /// projection since it's applied after it.
+  Mat4 Projection(const Mat4 &projection, const PosterTile &tile) const {
+    GLint gl_y = height - (tile.y + tile.height);  // bottom-up
+    Mat4 crop  = Mat4::Identity();
+    crop(0, 0) = (float)width / tile.width;
+    crop(1, 1) = (float)height / tile.height;
+    crop(0, 3) = (float)(width - 2 * tile.x) / tile.width - 1.0f;
+    crop(1, 3) = (float)(height - 2 * gl_y) / tile.height - 1.0f;
+    return crop * projection;
+  }
+};
 
 #ifdef PROTO3D_IMPLEMENTATION
-void Create(VAO *vao_arr, GLuint count) {
-  glGenVertexArrays(count, reinterpret_cast<GLuint *>(vao_arr));
+RenderTarget RenderTargetPool::Acquire(const RenderTargetDesc &desc, const char *file, int line) {
+  for (Entry &entry : entries) {
+    if (!entry.in_use && entry.target.desc == desc) {
+      entry.in_use          = true;
+      entry.last_used_frame = frame;
+      return entry.target;
+    }
+  }
+  PROTO3D_PROFILE_SCOPE("RenderTargetPool::Acquire (create)");
+  RenderTarget target;
+  target.desc = desc;
+  if (desc.samples == 0) {
+    GLint previous;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+    Texture2D texture;
+    texture.Gen(file, line);
+    texture.Bind();
+    texture.Storage(desc.internal_format, desc.width, desc.height, 1);
+    texture.SetFilterAndWrap(GL_LINEAR, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, (GLuint)previous);
+    target.id = texture.id;
+  } else {
+    GLint previous;
+    glGetIntegerv(GL_RENDERBUFFER_BINDING, &previous);
+    Renderbuffer renderbuffer;
+    renderbuffer.Create(file, line);
+    renderbuffer.Bind();
+    renderbuffer.Storage(desc.internal_format, desc.width, desc.height, desc.samples);
+    glBindRenderbuffer(GL_RENDERBUFFER, (GLuint)previous);
+    target.id = renderbuffer.id;
+  }
+  entries.push_back(Entry{target, true, frame});
+  return target;
 }
 
-void Delete(VAO *vao_arr, GLuint count) {
-  for (GLuint i = 0; i < count; i++) {
-    assert(!vao_arr[i].Bound());
+void RenderTargetPool::Release(const RenderTarget &target) {
+  for (Entry &entry : entries) {
+    if (entry.target.Key() == target.Key()) {
+      assert(entry.in_use && "Render target released twice");
+      entry.in_use = false;
+      return;
+    }
   }
-  glDeleteVertexArrays(count, reinterpret_cast<GLuint *>(vao_arr));
+  assert(false && "Render target not from this pool");
 }
-#endif  // PROTO3D_IMPLEMENTATION
-// }}} END of OpenGL objects
 
-// OpenGL Shaders {{{
+Framebuffer RenderTargetPool::GetFramebuffer(const RenderTarget *colors,
+                                             int color_count,
+                                             const RenderTarget *depth) {
+  assert(color_count <= kMaxColorAttachments);
+  GLuint key[kMaxColorAttachments + 1] = {0};
+  for (int i = 0; i < color_count; i++) {
+    key[i] = colors[i].Key();
+  }
+  key[kMaxColorAttachments] = depth != nullptr ? depth->Key() : 0;
+  for (const CachedFramebuffer &cached : framebuffers) {
+    if (memcmp(cached.attachments, key, sizeof(key)) == 0) {
+      return cached.framebuffer;
+    }
+  }
 
-/// OpenGL Shader class
+  PROTO3D_PROFILE_SCOPE("RenderTargetPool::GetFramebuffer (create)");
+  GLint previous;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+  CachedFramebuffer cached;
+  memcpy(cached.attachments, key, sizeof(key));
+  cached.framebuffer.Create();
+  cached.framebuffer.Bind();
+  GLenum draw_buffers[kMaxColorAttachments];
+  for (int i = 0; i < color_count; i++) {
+    draw_buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    if (colors[i].IsTexture()) {
+      cached.framebuffer.AttachTexture(draw_buffers[i], colors[i].AsTexture());
+    } else {
+      cached.framebuffer.AttachRenderbuffer(draw_buffers[i], colors[i].AsRenderbuffer());
+    }
+  }
+  if (depth != nullptr) {
+    GLenum format = depth->desc.internal_format;
+    GLenum attachment =
+        (format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8)
+            ? GL_DEPTH_STENCIL_ATTACHMENT
+            : GL_DEPTH_ATTACHMENT;
+    if (depth->IsTexture()) {
+      cached.framebuffer.AttachTexture(attachment, depth->AsTexture());
+    } else {
+      cached.framebuffer.AttachRenderbuffer(attachment, depth->AsRenderbuffer());
+    }
+  }
+  cached.framebuffer.SetDrawBuffers(draw_buffers, color_count);
+  assert(cached.framebuffer.StatusString() == nullptr && "Incomplete pooled framebuffer");
+  glBindFramebuffer(GL_FRAMEBUFFER, (GLuint)previous);
+  framebuffers.push_back(cached);
+  return cached.framebuffer;
+}
+
+void RenderTargetPool::DeleteTarget(const RenderTarget &target) {
+  // Framebuffers using the target go first
+  for (size_t i = 0; i < framebuffers.size();) {
+    bool uses_target = false;
+    for (GLuint attachment : framebuffers[i].attachments) {
+      uses_target = uses_target || attachment == target.Key();
+    }
+    if (uses_target) {
+      framebuffers[i].framebuffer.Delete();
+      framebuffers[i] = framebuffers.back();
+      framebuffers.pop_back();
+    } else {
+      i++;
+    }
+  }
+  if (target.IsTexture()) {
+    target.AsTexture().Delete();
+  } else {
+    target.AsRenderbuffer().Delete();
+  }
+}
+
+void RenderTargetPool::EndFrame() {
+  for (size_t i = 0; i < entries.size();) {
+    if (!entries[i].in_use && frame - entries[i].last_used_frame >= max_idle_frames) {
+      DeleteTarget(entries[i].target);
+      entries[i] = entries.back();
+      entries.pop_back();
+    } else {
+      i++;
+    }
+  }
+  frame++;
+}
+
+void RenderTargetPool::Delete() {
+  for (const Entry &entry : entries) {
+    DeleteTarget(entry.target);
+  }
+  entries.clear();
+  assert(framebuffers.empty());
+}
+
+int64_t RenderTargetPool::Bytes() const {
+  int64_t bytes = 0;
+  for (const Entry &entry : entries) {
+    const RenderTargetDesc &desc = entry.target.desc;
+    bytes += (int64_t)desc.width * desc.height * detail::BytesPerTexel(desc.internal_format) *
+             (desc.samples > 0 ? desc.samples : 1);
+  }
+  return bytes;
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Framebuffers
+
+// Asynchronous readback {{{
+
+/// Pixels of a finished ReadbackQueue::Read(). `pixels` points into a mapped
+/// pixel pack buffer and is only valid during the callback. It is nullptr if
+/// the readback failed (the buffer couldn't be mapped or the fence wait
+/// failed), so the callback can still release what `user` owns.
+struct ReadbackResult {
+  const void *pixels;
+  GLint x;
+  GLint y;
+  GLsizei width;
+  GLsizei height;
+  GLenum format;
+  GLenum type;
+  /// Rows are bottom-up and padded to 4 bytes: Read() sets GL_PACK_ALIGNMENT
+  /// to 4 and clears GL_PACK_ROW_LENGTH for the copy.
+  GLsizeiptr row_bytes;
+  /// Tag passed to Read(), e.g. a frame number
+  uint64_t tag;
+};
+
+/// Reads framebuffer regions back to the CPU without stalling the pipeline.
 ///
-/// Usage example:
+/// Read() issues glReadPixels into one of `ring_size` GL_PIXEL_PACK_BUFFERs
+/// and fences it, so the copy happens on the GPU timeline. Poll(), called
+/// once per frame, maps the buffers whose fence is signaled, typically
+/// `ring_size - 1` frames later, and hands the mapped pointer to the
+/// callback: nothing is copied on the render thread unless the consumer
+/// copies it.
 ///
-///     Shader shader;
-///     shader.Create(GL_VERTEX_SHADER);
-///     // You can get the type
-///     assert(shader.GetType() == GL_VERTEX_SHADER);
-///     // set the source from a C string or a proto3d::sdl::SourceFile
-///     shader.SetSource(sdl::SourceFile("shader.vert");
-///     // and compile the shader.
-///     std::unique_ptr<char> compilation_error = shader.Compile();
-///     if (compilation_error == nullptr) {
-///       bool compiled = shader.IsCompiled(); // true
-///       ...
+///     ReadbackQueue readback(3);
+///     readback.Create();
+///     while (rendering) {
+///       ... draw frame ...
+///       readback.Read(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, WriteThumbnail, &writer, frame);
+///       readback.Poll();
 ///     }
-///     // Shaders have to be deleted manually
-///     shader.Delete();
-class Shader {
+///     readback.Flush();
+///     readback.Delete();
+///
+/// If every buffer is still in flight, Read() waits for the oldest one and
+/// counts a stall: raise `ring_size` if Stalls() keeps growing.
+class ReadbackQueue {
  public:
-  /// The shader name.
-  GLuint id;
+  /// Runs on the GL thread and must not call Read().
+  typedef void (*Callback)(const ReadbackResult &result, void *user);
+
+  explicit ReadbackQueue(int ring_size = 3)
+      : slots(ring_size), head(0), in_flight(0), stalls(0) {}
+
+  /// Generate the pack buffers. They are sized on first use.
+  void Create(const char *file = PROTO3D_CALLER_FILE, int line = PROTO3D_CALLER_LINE);
+
+  /// Drops the readbacks still in flight without calling their callbacks.
+  void Delete();
+
+  /// Queue a readback of a region of the GL_READ_FRAMEBUFFER's read buffer.
+  /// `type` is GL_UNSIGNED_BYTE, GL_HALF_FLOAT, GL_FLOAT or GL_UNSIGNED_INT.
+  void Read(GLint x,
+            GLint y,
+            GLsizei width,
+            GLsizei height,
+            GLenum format,
+            GLenum type,
+            Callback callback,
+            void *user,
+            uint64_t tag = 0);
+
+  /// Calls the callbacks of the finished readbacks, oldest first. Readbacks
+  /// whose fence wait fails are delivered with `pixels` == nullptr.
+  /// @param wait block until the oldest readback is finished
+  /// @return the number of callbacks called
+  int Poll(bool wait = false);
+
+  /// Waits for and delivers every readback in flight.
+  void Flush() {
+    while (in_flight > 0) {
+      Poll(true);
+    }
+  }
 
-  Shader() = default;
+  int InFlight() const { return in_flight; }
 
-  Shader(GLuint id) : id(id) {}  // NOLINT
+  /// Number of Read() calls that had to wait for the GPU.
+  uint64_t Stalls() const { return stalls; }
 
-  /// Create the Shader in OpenGL memory.
-  ///
-  /// @param shader_type Specifies the type of shader to be created.
-  ///                    Must be one of GL_VERTEX_SHADER,
-  ///                    GL_GEOMETRY_SHADER or GL_FRAGMENT_SHADER.
-  void Create(GLenum shader_type) { id = glCreateShader(shader_type); }
+ private:
+  struct Slot {
+    VBO buffer;
+    GLsizeiptr capacity;
+    GLsync fence;
+    ReadbackResult result;
+    Callback callback;
+    void *user;
+
+    Slot() : capacity(0), fence(nullptr), callback(nullptr), user(nullptr) {}
+  };
+
+  /// Maps the oldest slot unless `failed`, calls its callback and frees it.
+  void Deliver(bool failed);
+
+  std::vector<Slot> slots;
+  int head;  // oldest slot in flight
+  int in_flight;
+  uint64_t stalls;
+};
 
-  void Delete() {
-    // It's OK to delete a shader even if it's linked to one or many programs.
-    // The shader will simply be flagged for deletion and once the programs are
-    // deleted, the shader is finally deleted.
-    //
-    // Program::Link(shaders...) attaches, links, and then detaches the shaders.
-    // It's recommended that you Delete(shaders...) after linking.
-    glDeleteShader(id);
+#ifdef PROTO3D_IMPLEMENTATION
+namespace detail {
+inline GLsizeiptr PackedRowBytes(GLsizei width, GLenum format, GLenum type) {
+  GLsizeiptr component_bytes;
+  switch (type) {
+    case GL_HALF_FLOAT:
+      component_bytes = 2;
+      break;
+    case GL_FLOAT:
+    case GL_UNSIGNED_INT:
+      component_bytes = 4;
+      break;
+    default:
+      component_bytes = 1;
+      break;
+  }
+  GLint components = (format == GL_DEPTH_COMPONENT) ? 1 : ComponentCount(format);
+  return ((GLsizeiptr)width * components * component_bytes + 3) & ~(GLsizeiptr)3;
+}
+}  // namespace detail
+
+void ReadbackQueue::Create(const char *file, int line) {
+  for (Slot &slot : slots) {
+    slot.buffer.Create(file, line);
   }
+}
 
-  void SetSource(const char *source) { glShaderSource(id, 1, &source, nullptr); }
+void ReadbackQueue::Delete() {
+  for (Slot &slot : slots) {
+    if (slot.fence != nullptr) {
+      glDeleteSync(slot.fence);
+      slot.fence = nullptr;
+    }
+    slot.buffer.Delete();
+    slot.buffer.id = 0;
+    slot.capacity  = 0;
+  }
+  head      = 0;
+  in_flight = 0;
+}
 
-  void SetSources(GLsizei count, const char **sources) {
-    glShaderSource(id, count, sources, nullptr);
+void ReadbackQueue::Read(GLint x,
+                         GLint y,
+                         GLsizei width,
+                         GLsizei height,
+                         GLenum format,
+                         GLenum type,
+                         Callback callback,
+                         void *user,
+                         uint64_t tag) {
+  PROTO3D_PROFILE_SCOPE("ReadbackQueue::Read");
+  if (in_flight == (int)slots.size()) {
+    stalls++;
+    Poll(true);
+  }
+  Slot &slot = slots[(head + in_flight) % slots.size()];
+  in_flight++;
+
+  slot.result = ReadbackResult{nullptr,
+                               x,
+                               y,
+                               width,
+                               height,
+                               format,
+                               type,
+                               detail::PackedRowBytes(width, format, type),
+                               tag};
+  slot.callback = callback;
+  slot.user     = user;
+
+  GLint previous;
+  glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previous);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer.id);
+  GLsizeiptr size = slot.result.row_bytes * height;
+  if (size > slot.capacity) {
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+    detail::TrackBytes(kResourceBuffer, slot.buffer.id, size);
+    slot.capacity = size;
+  }
+  // With a pack buffer bound, the last argument is an offset into it and the
+  // call returns without waiting for the GPU. The pack state must match the
+  // row_bytes the callback sees.
+  {
+    detail::PackStateScope pack_state(4);
+    glReadPixels(x, y, width, height, format, type, nullptr);
   }
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, (GLuint)previous);
+}
 
-  /// @return nullptr if success or the compilation error message in case of
-  /// failure
-  std::unique_ptr<char> Compile() {
-    glCompileShader(id);
-    if (IsCompiled()) {
-      return nullptr;
+int ReadbackQueue::Poll(bool wait) {
+  int delivered = 0;
+  while (in_flight > 0) {
+    // Fences are signaled in order, so stop at the first one that isn't. The
+    // flush bit makes sure the fence is submitted in headless loops that
+    // never swap buffers.
+    GLuint64 timeout = (wait && delivered == 0) ? GL_TIMEOUT_IGNORED : 0;
+    GLenum status    = glClientWaitSync(slots[head].fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+    if (status == GL_TIMEOUT_EXPIRED) {
+      break;
     }
-    return GetInfoLog();
+    // GL_WAIT_FAILED won't clear by waiting again: drop the slot, otherwise
+    // Flush() would spin forever
+    Deliver(status == GL_WAIT_FAILED);
+    delivered++;
   }
+  return delivered;
+}
 
-  std::unique_ptr<char> GetInfoLog(GLsizei *length_ptr = nullptr) const {
-    char *info_log;
+void ReadbackQueue::Deliver(bool failed) {
+  Slot &slot = slots[head];
+  glDeleteSync(slot.fence);
+  slot.fence = nullptr;
+  head       = (head + 1) % (int)slots.size();
+  in_flight--;
+
+  if (failed) {
+    slot.result.pixels = nullptr;
+    slot.callback(slot.result, slot.user);
+    return;
+  }
+  GLint previous;
+  glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previous);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer.id);
+  GLsizeiptr size    = slot.result.row_bytes * slot.result.height;
+  slot.result.pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT);
+  // The callback runs even if the map failed, it may own `user`
+  slot.callback(slot.result, slot.user);
+  if (slot.result.pixels != nullptr) {
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  slot.result.pixels = nullptr;
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, (GLuint)previous);
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Asynchronous readback
+
+// OpenGL object ownership {{{
+
+/// Move-only owner of an OpenGL object.
+///
+/// `T` is one of the plain handle classes (VBO, VAO, Texture2D, Shader,
+/// Program...) which stay copyable and non-owning. `Unique<T>` has the same
+/// size as the GLuint name and calls T::Delete() when it goes out of scope.
+///
+///     Unique<VBO> vbo(vao.AddArray(0, data, sizeof(data), format));
+///     vbo->Bind();
+///     ...
+///     pool.Release(std::move(vbo));  // or let it be deleted right away
+template <class T>
+class Unique {
+ private:
+  T object;
+
+ public:
+  Unique() : object(0) {}
 
-    // The size of the info log. size is better name than length because it
-    // includes the 0 terminating byte. size may be 0 though, in case it has no
-    // information log.
-    GLint size;
-    glGetShaderiv(id, GL_INFO_LOG_LENGTH, &size);
+  explicit Unique(T object) : object(object) {}
 
-    if (size == 0) {
-      return nullptr;
-    }
-    info_log = new char[size + 1];
-    glGetShaderInfoLog(id, size, length_ptr, info_log);
+  Unique(Unique &&other) : object(other.Release()) {}  // NOLINT(build/c++11)
 
-    return std::unique_ptr<char>(info_log);
+  Unique &operator=(Unique &&other) {  // NOLINT(build/c++11)
+    Reset(other.Release());
+    return *this;
   }
 
-  /// Returns the concatenation of the source strings that make up the shader
-  /// source for the shader, including the null termination character.
-  std::unique_ptr<char> GetSource(GLsizei *length_ptr = nullptr) const {
-    char *source;
+  Unique(const Unique &) = delete;
+  Unique &operator=(const Unique &) = delete;
 
-    // The size includes the 0 terminating character.
-    GLint size;
-    glGetShaderiv(id, GL_SHADER_SOURCE_LENGTH, &size);
+  ~Unique() { Reset(); }
 
-    if (size == 0) {
-      return nullptr;
-    }
-    source = new char[size + 1];
-    glGetShaderSource(id, size, length_ptr, source);
+  T &operator*() { return object; }
+  const T &operator*() const { return object; }
+  T *operator->() { return &object; }
+  const T *operator->() const { return &object; }
 
-    return std::unique_ptr<char>(source);
-  }
+  T Get() const { return object; }
 
-  GLenum GetType() const {
-    GLint type;
-    glGetShaderiv(id, GL_SHADER_TYPE, &type);
-    return type;
-  }
+  explicit operator bool() const { return object.id != 0; }
 
-  /// Returns whether the shader is flagged for deletion.
-  bool IsDeleted() const {
-    GLint deleted;
-    glGetShaderiv(id, GL_DELETE_STATUS, &deleted);
-    return deleted == GL_TRUE;
+  /// Give up ownership without deleting the object.
+  T Release() {
+    T released = object;
+    object     = T(0);
+    return released;
   }
 
-  bool IsCompiled() const {
-    GLint compiled;
-    glGetShaderiv(id, GL_COMPILE_STATUS, &compiled);
-    return compiled == GL_TRUE;
+  /// Delete the owned object (if any) and take ownership of `new_object`.
+  void Reset(T new_object = T(0)) {
+    if (object.id != 0) {
+      object.Delete();
+    }
+    object = new_object;
   }
 };
 
-class Program {
+static_assert(sizeof(Unique<VBO>) == sizeof(GLuint), "Unique<T> must be as small as a GLuint");
+
+typedef Unique<VBO> UniqueVBO;
+typedef Unique<VAO> UniqueVAO;
+typedef Unique<Texture2D> UniqueTexture2D;
+typedef Unique<Shader> UniqueShader;
+typedef Unique<Program> UniqueProgram;
+typedef Unique<Framebuffer> UniqueFramebuffer;
+typedef Unique<Renderbuffer> UniqueRenderbuffer;
+typedef Unique<Sampler> UniqueSampler;
+
+/// Batches glGen* and glDelete* calls of buffers, vertex arrays, textures
+/// and programs. Shaders, framebuffers, renderbuffers and samplers can be
+/// released too.
+///
+/// Names are generated `batch_size` at a time and handed out by Acquire*().
+/// Released objects are queued and, at EndFrame(), a fence is inserted after
+/// the frame's commands. The queued objects are deleted with one glDelete*
+/// call per type only once that fence is signaled, i.e. when the GPU is done
+/// with every command that could reference them. EndFrame() never blocks.
+///
+/// Like the other proto3d objects, a pool must be explicitly deleted with
+/// Delete() while its context is current.
+class HandlePool {
  public:
-  /// The program name.
-  GLuint id;
+  explicit HandlePool(GLsizei batch_size = 64) : batch_size(batch_size) {}
 
-  Program() = default;
+  VBO AcquireVBO() { return VBO(Acquire(&free_buffers, &HandlePool::GenBuffers)); }
 
-  Program(GLuint id) : id(id) {}  // NOLINT
+  VAO AcquireVAO() { return VAO(Acquire(&free_vertex_arrays, &HandlePool::GenVertexArrays)); }
 
-  void Create() { id = glCreateProgram(); }
+  Texture2D AcquireTexture2D() {
+    return Texture2D(Acquire(&free_textures, &HandlePool::GenTextures));
+  }
 
-  void Delete() { glDeleteProgram(id); }
+  void Release(VBO vbo) { pending.buffers.push_back(vbo.id); }
 
-  void AttachShaders(Shader shader) { glAttachShader(id, shader.id); }
+  void Release(VAO vao) { pending.vertex_arrays.push_back(vao.id); }
 
-  /// Attach shaders to this program.
-  template <class Shader, class... Shaders>
-  void AttachShaders(Shader shader, Shaders... shaders) {
-    glAttachShader(id, shader.id);
-    AttachShaders(shaders...);
-  }
+  void Release(Texture texture) { pending.textures.push_back(texture.id); }
 
-  void AttachShaders(Shader *shaders, int size) {
-    for (int i = 0; i < size; i++) {
-      AttachShaders(shaders[i]);
-    }
-  }
+  void Release(Program program) { pending.programs.push_back(program.id); }
 
-  void DetachShaders(Shader shader) { glDetachShader(id, shader.id); }
+  void Release(Shader shader) { pending.shaders.push_back(shader.id); }
 
-  /// Detach shaders from this program.
-  template <class... Shaders>
-  void DetachShaders(Shader shader, Shaders... shaders) {
-    glDetachShader(id, shader.id);
-    DetachShaders(shaders...);
-  }
+  void Release(Framebuffer framebuffer) { pending.framebuffers.push_back(framebuffer.id); }
 
-  void DetachShaders(Shader *shaders, int size) {
-    for (int i = 0; i < size; i++) {
-      DetachShaders(shaders[i]);
-    }
-  }
+  void Release(Renderbuffer renderbuffer) { pending.renderbuffers.push_back(renderbuffer.id); }
 
-  /// Link all the attached shaders to finish building the program.
-  std::unique_ptr<char> Link() {
-    glLinkProgram(id);
-    if (IsLinked()) {
-      return nullptr;
-    }
-    return GetInfoLog();
-  }
+  void Release(Sampler sampler) { pending.samplers.push_back(sampler.id); }
 
-  template <class Shader, class... Shaders>
-  std::unique_ptr<char> Link(Shader shader, Shaders... shaders) {
-    AttachShaders(shader, shaders...);
-    auto message = Link();
-    DetachShaders(shader, shaders...);
-    return message;
+  template <class T>
+  void Release(Unique<T> &&object) {  // NOLINT(build/c++11)
+    if (object) {
+      Release(object.Release());
+    }
   }
 
-  std::unique_ptr<char> Link(Shader *shaders, int size) {
-    AttachShaders(shaders, size);
-    auto message = Link();
-    DetachShaders(shaders, size);
-    return message;
-  }
+  /// Fence the objects released during this frame and delete the objects
+  /// of previous frames the GPU has finished with. Call after the frame's
+  /// draw calls were issued (e.g. right before swapping buffers).
+  void EndFrame();
 
-  std::unique_ptr<char> GetInfoLog(GLsizei *length_p = nullptr) const {
-    char *info_log;
+  /// Number of frames whose released objects are still waiting on a fence.
+  size_t FramesInFlight() const { return in_flight.size(); }
 
-    // The size of the info log. size is better name than length because it
-    // includes the 0 terminating byte. size may be 0 though, in case it has no
-    // information log.
-    GLint size;
-    glGetProgramiv(id, GL_INFO_LOG_LENGTH, &size);
+  /// Wait for the GPU and delete every queued and unused name.
+  void Delete();
 
-    if (size == 0) {
-      return nullptr;
+ private:
+  struct Batch {
+    GLsync fence;
+    std::vector<GLuint> buffers;
+    std::vector<GLuint> vertex_arrays;
+    std::vector<GLuint> textures;
+    std::vector<GLuint> programs;
+    std::vector<GLuint> shaders;
+    std::vector<GLuint> framebuffers;
+    std::vector<GLuint> renderbuffers;
+    std::vector<GLuint> samplers;
+
+    Batch() : fence(nullptr) {}
+
+    bool Empty() const {
+      return buffers.empty() && vertex_arrays.empty() && textures.empty() && programs.empty() &&
+             shaders.empty() && framebuffers.empty() && renderbuffers.empty() && samplers.empty();
     }
-    info_log = new char[size + 1];
-    glGetProgramInfoLog(id, size, length_p, info_log);
-    return std::unique_ptr<char>(info_log);
-  }
 
-  std::unique_ptr<char> ValidationLog(bool *is_valid, GLsizei *length_ptr = nullptr) const {
-    // Validate the program
-    glValidateProgram(id);
+    void DeleteObjects();
+  };
 
-    // Query the validation status
-    GLint is_valid_i;
-    glGetProgramiv(id, GL_VALIDATE_STATUS, &is_valid_i);
-    *is_valid = is_valid_i;
+  GLsizei batch_size;
+  std::vector<GLuint> free_buffers;
+  std::vector<GLuint> free_vertex_arrays;
+  std::vector<GLuint> free_textures;
+  Batch pending;
+  std::vector<Batch> in_flight;  // oldest first
 
-    // Return the info log that contains validation information
-    return GetInfoLog(length_ptr);
+  GLuint Acquire(std::vector<GLuint> *free_list, void (HandlePool::*gen)(GLuint *)) {
+    if (free_list->empty()) {
+      free_list->resize(batch_size);
+      (this->*gen)(free_list->data());
+    }
+    GLuint id = free_list->back();
+    free_list->pop_back();
+    return id;
   }
 
-  std::unique_ptr<Shader> GetAttachedShaders(GLint *count_ptr) const {
-    glGetProgramiv(id, GL_ATTACHED_SHADERS, count_ptr);
-    if (*count_ptr == 0) {
-      return nullptr;
-    }
+  void GenBuffers(GLuint *ids) { Create(reinterpret_cast<VBO *>(ids), batch_size); }
 
-    auto shaders = new GLuint[*count_ptr];
-    glGetAttachedShaders(id, *count_ptr, count_ptr, shaders);
+  void GenVertexArrays(GLuint *ids) { Create(reinterpret_cast<VAO *>(ids), batch_size); }
 
-    return std::unique_ptr<Shader>(reinterpret_cast<Shader *>(shaders));
+  void GenTextures(GLuint *ids) { Textures(reinterpret_cast<Texture *>(ids), batch_size).Gen(); }
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+void HandlePool::Batch::DeleteObjects() {
+  if (!buffers.empty()) {
+    gl::Delete(reinterpret_cast<VBO *>(buffers.data()), (GLuint)buffers.size());
+  }
+  if (!vertex_arrays.empty()) {
+    gl::Delete(reinterpret_cast<VAO *>(vertex_arrays.data()), (GLuint)vertex_arrays.size());
+  }
+  if (!textures.empty()) {
+    Textures(reinterpret_cast<Texture *>(textures.data()), (GLsizei)textures.size()).Delete();
+  }
+  // There's no batched glDeleteProgram or glDeleteShader
+  for (GLuint program : programs) {
+    detail::TrackDelete(kResourceProgram, program);
+    glDeleteProgram(program);
+  }
+  for (GLuint shader : shaders) {
+    detail::TrackDelete(kResourceShader, shader);
+    glDeleteShader(shader);
+  }
+  if (!framebuffers.empty()) {
+    detail::TrackDelete(kResourceFramebuffer, framebuffers.data(), (GLsizei)framebuffers.size());
+    glDeleteFramebuffers((GLsizei)framebuffers.size(), framebuffers.data());
   }
+  if (!renderbuffers.empty()) {
+    detail::TrackDelete(
+        kResourceRenderbuffer, renderbuffers.data(), (GLsizei)renderbuffers.size());
+    glDeleteRenderbuffers((GLsizei)renderbuffers.size(), renderbuffers.data());
+  }
+  if (!samplers.empty()) {
+    detail::TrackDelete(kResourceSampler, samplers.data(), (GLsizei)samplers.size());
+    glDeleteSamplers((GLsizei)samplers.size(), samplers.data());
+  }
+  buffers.clear();
+  vertex_arrays.clear();
+  textures.clear();
+  programs.clear();
+  shaders.clear();
+  framebuffers.clear();
+  renderbuffers.clear();
+  samplers.clear();
+}
 
-  bool IsLinked() const {
-    GLint linked;
-    glGetProgramiv(id, GL_LINK_STATUS, &linked);
-    return linked == GL_TRUE;
+void HandlePool::EndFrame() {
+  if (!pending.Empty()) {
+    pending.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    in_flight.push_back(std::move(pending));
+    pending = Batch();
   }
 
-  bool IsDeleted() const {
-    GLint deleted;
-    glGetProgramiv(id, GL_DELETE_STATUS, &deleted);
-    return deleted == GL_TRUE;
+  // Fences are signaled in order, so stop at the first one that isn't.
+  size_t retired = 0;
+  for (; retired < in_flight.size(); retired++) {
+    Batch &batch  = in_flight[retired];
+    GLenum status = glClientWaitSync(batch.fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+      break;
+    }
+    glDeleteSync(batch.fence);
+    batch.DeleteObjects();
   }
+  in_flight.erase(in_flight.begin(), in_flight.begin() + retired);
+}
 
-  void Use() const { glUseProgram(id); }
+void HandlePool::Delete() {
+  for (Batch &batch : in_flight) {
+    glClientWaitSync(batch.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(batch.fence);
+    batch.DeleteObjects();
+  }
+  in_flight.clear();
+  pending.DeleteObjects();
+
+  // Names that were never bound are not objects yet, but must be freed too.
+  pending.buffers.swap(free_buffers);
+  pending.vertex_arrays.swap(free_vertex_arrays);
+  pending.textures.swap(free_textures);
+  pending.DeleteObjects();
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of OpenGL object ownership
+
+// GPU profiling {{{
+
+/// A timed GPU scope. Scopes of a frame are stored in the order they begin,
+/// so a frame is a pre-order flattened tree.
+struct GpuTiming {
+  const char *name;
+  /// Index of the enclosing scope in the same frame or -1.
+  GLint parent;
+  GLint depth;
+  /// GL_TIMESTAMP values in nanoseconds.
+  GLuint64 begin_ns;
+  GLuint64 end_ns;
+};
 
-  void Bind() const { glUseProgram(id); }
+/// Measures GPU time of nested render passes with GL_TIMESTAMP queries.
+///
+/// Each scope issues a glQueryCounter() at its beginning and end. Query
+/// objects come from per-frame pools, `frames_in_flight` frames deep, and a
+/// frame's results are only read once GL_QUERY_RESULT_AVAILABLE is set, so
+/// the profiler never stalls the pipeline. If a pool has to be reused before
+/// its results are available the frame is dropped (see DroppedFrames()).
+///
+/// Scope names are not copied: use string literals.
+///
+///     GpuProfiler profiler;
+///     profiler.Create();
+///     while (running) {
+///       profiler.BeginFrame();
+///       {
+///         GpuProfiler::Scope scope(&profiler, "shadows");
+///         ...
+///       }
+///       profiler.EndFrame();
+///       for (const GpuTiming &t : profiler.LastResolvedFrame()) { ... }
+///     }
+///     profiler.Delete();
+class GpuProfiler {
+ public:
+  explicit GpuProfiler(GLint frames_in_flight = 4, GLint max_scopes_per_frame = 128)
+      : frames(frames_in_flight),
+        max_scopes(max_scopes_per_frame),
+        frame_index(0),
+        dropped_frames(0),
+        capturing(false) {}
 
-  void Unbind() const { glUseProgram(0); }
+  /// RAII helper that calls BeginScope() and EndScope().
+  class Scope {
+   public:
+    Scope(GpuProfiler *profiler, const char *name)
+        : profiler(profiler), index(profiler->BeginScope(name)) {}
+    ~Scope() { profiler->EndScope(index); }
 
-  /// Get the location of an attribute variable.
-  ///
-  /// Attribute variables can have a different value for each vertex (e.g. the
-  /// color of a corner of a triangle).
-  GLint AttribLocation(const GLchar *attrib_name) const {
-    GLint location = glGetAttribLocation(id, attrib_name);
-    return location;
-  }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
 
-  /// Get the location of an uniform variable.
-  ///
-  /// Uniform variables keep the same value for multiple vertices (e.g. the
-  /// color of the whole triangle).
-  GLint UniformLocation(const GLchar *uniform_name) const {
-    GLint location = glGetUniformLocation(id, uniform_name);
-    return location;
-  }
+   private:
+    GpuProfiler *profiler;
+    GLint index;
+  };
 
-  // Uniform setters using locations {{{
+  /// Generate all the query objects.
+  void Create();
 
-  /// Sets a shader uniform with up to 4 parameters for the vector components.
-  template <typename T, typename... U>
-  void SetUniform(GLint location, T v0, U... values) {
-    detail::UniformSetterFn<T> setter;
-    setter(location, v0, values...);
-  }
+  void Delete();
 
-  // Versions for pointer parameters
+  /// Collect the results that are already available and start recording a
+  /// new frame.
+  void BeginFrame();
 
-  template <typename T>
-  void SetUniformVec1(GLint location, GLsizei count, const T *value_ptr) {
-    detail::UniformVec1SetterFn<T> setter;
-    setter(location, count, value_ptr);
-  }
+  void EndFrame() { assert(Current().open_scope == -1 && "Unbalanced GpuProfiler scopes"); }
 
-  template <typename T>
-  void SetUniformVec2(GLint location, GLsizei count, const T *value_ptr) {
-    detail::UniformVec2SetterFn<T> setter;
-    setter(location, count, value_ptr);
-  }
+  /// @return the scope index to pass to EndScope() or -1 if this frame
+  /// already has `max_scopes_per_frame` scopes.
+  GLint BeginScope(const char *name);
 
-  template <typename T>
-  void SetUniformVec3(GLint location, GLsizei count, const T *value_ptr) {
-    detail::UniformVec3SetterFn<T> setter;
-    setter(location, count, value_ptr);
-  }
+  void EndScope(GLint index);
 
-  template <typename T>
-  void SetUniformVec4(GLint location, GLsizei count, const T *value_ptr) {
-    detail::UniformVec4SetterFn<T> setter;
-    setter(location, count, value_ptr);
-  }
+  /// Timings of the most recent frame whose results were collected.
+  const std::vector<GpuTiming> &LastResolvedFrame() const { return last_resolved; }
 
-#define UNIFORM_MATRIX_SETTER(DIMENSIONS)                                             \
-  void SetUniformMat##DIMENSIONS(                                                     \
-      GLint location, GLsizei count, GLboolean transpose, const GLfloat *value_ptr) { \
-    glUniformMatrix##DIMENSIONS##fv(location, count, transpose, value_ptr);           \
-  }
+  GLuint64 DroppedFrames() const { return dropped_frames; }
 
-  UNIFORM_MATRIX_SETTER(2)
-  UNIFORM_MATRIX_SETTER(3)
-  UNIFORM_MATRIX_SETTER(4)
-  UNIFORM_MATRIX_SETTER(2x3)
-  UNIFORM_MATRIX_SETTER(3x2)
-  UNIFORM_MATRIX_SETTER(2x4)
-  UNIFORM_MATRIX_SETTER(4x2)
-  UNIFORM_MATRIX_SETTER(3x4)
-  UNIFORM_MATRIX_SETTER(4x3)
+  /// Accumulate every resolved frame until WriteChromeTrace() is called.
+  void StartCapture() { capturing = true; }
 
-#undef UNIFORM_MATRIX_SETTER
+  /// Write the captured timings as Chrome trace JSON and clear the capture.
+  void WriteChromeTrace(FILE *file);
 
-#ifdef PROTO3D_USE_GLM
-  // Versions for GLM types
+ private:
+  struct Frame {
+    std::vector<GLuint> queries;  // 2 per scope: begin and end
+    std::vector<GpuTiming> timings;
+    GLint open_scope;
+    /// Index in `queries` of the last glQueryCounter() issued, -1 if none
+    GLint last_query;
+    bool pending;
+
+    Frame() : open_scope(-1), last_query(-1), pending(false) {}
+  };
+
+  std::vector<Frame> frames;
+  GLint max_scopes;
+  GLuint64 frame_index;
+  GLuint64 dropped_frames;
+  std::vector<GpuTiming> last_resolved;
+  bool capturing;
+  std::vector<GpuTiming> captured;
+
+  Frame &Current() { return frames[frame_index % frames.size()]; }
+
+  bool TryResolve(Frame *frame);
+};
 
-  /// Sets a GLM vector as a shader uniform variable.
-  template <class T>
-  void SetVecUniform(GLint location, const T &value) {
-    detail::UniformGLMVecSetterFn setter;
-    setter(location, value);
+#ifdef PROTO3D_IMPLEMENTATION
+void GpuProfiler::Create() {
+  for (Frame &frame : frames) {
+    frame.queries.resize(2 * max_scopes);
+    glGenQueries((GLsizei)frame.queries.size(), frame.queries.data());
+    frame.timings.reserve(max_scopes);
   }
+}
 
-  /// Sets a GLM matrix as a shader uniform variable.
-  template <class T>
-  void SetUniformMat(GLint location, const T &value) {
-    detail::UniformGLMMatSetterFn setter;
-    setter(location, value, GL_FALSE);
+void GpuProfiler::Delete() {
+  for (Frame &frame : frames) {
+    glDeleteQueries((GLsizei)frame.queries.size(), frame.queries.data());
+    frame.queries.clear();
   }
+}
 
-  /// Sets a GLM matrix as a shader uniform variable.
-  template <class T>
-  void SetMatUniform(GLint location, GLboolean transpose, const T &value) {
-    detail::UniformGLMMatSetterFn setter;
-    setter(location, value, transpose);
+bool GpuProfiler::TryResolve(Frame *frame) {
+  if (!frame->timings.empty()) {
+    // Queries complete in order, so the last one issued tells about all of
+    // them. With nested scopes it's the end of an outer scope, not the end of
+    // the last scope begun.
+    GLint available;
+    glGetQueryObjectiv(frame->queries[frame->last_query], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      return false;
+    }
+    for (size_t i = 0; i < frame->timings.size(); i++) {
+      glGetQueryObjectui64v(frame->queries[2 * i], GL_QUERY_RESULT, &frame->timings[i].begin_ns);
+      glGetQueryObjectui64v(frame->queries[2 * i + 1], GL_QUERY_RESULT, &frame->timings[i].end_ns);
+    }
   }
-#endif  // PROTO3D_USE_GLM
-
-  // }}}
-
-  // Uniform setters using names {{{
+  frame->pending = false;
+  last_resolved.swap(frame->timings);
+  if (capturing) {
+    captured.insert(captured.end(), last_resolved.begin(), last_resolved.end());
+  }
+  return true;
+}
 
-  /// Sets a shader uniform variable.
-  ///
-  /// @return the location of the uniform variable of -1 in case of error
-  template <typename... T>
-  GLint SetUniform(const GLchar *uniform_name, T... values) {
-    GLint location = UniformLocation(uniform_name);
-    if (location >= 0) {
-      SetUniform(location, values...);
+void GpuProfiler::BeginFrame() {
+  // Resolve older frames first so LastResolvedFrame() ends up being the newest.
+  for (size_t i = 1; i <= frames.size(); i++) {
+    Frame &frame = frames[(frame_index + i) % frames.size()];
+    if (frame.pending && !TryResolve(&frame)) {
+      break;
     }
-    return location;
   }
 
-#define UNIFORM_VECTOR_SETTER_BY_NAME(DIMENSION)                       \
-  template <typename T>                                                \
-  GLint SetVec##DIMENSION##Uniform(                                    \
-      const GLchar *uniform_name, GLsizei count, const T *value_ptr) { \
-    GLint location = UniformLocation(uniform_name);                    \
-    if (location >= 0) {                                               \
-      SetVec##DIMENSION##Uniform(location, count, value_ptr);          \
-    }                                                                  \
-    return location;                                                   \
+  frame_index++;
+  Frame &frame = Current();
+  if (frame.pending) {
+    dropped_frames++;
+    frame.pending = false;
+  }
+  frame.timings.clear();
+  frame.open_scope = -1;
+  frame.last_query = -1;
+}
+
+GLint GpuProfiler::BeginScope(const char *name) {
+  Frame &frame = Current();
+  if ((GLint)frame.timings.size() >= max_scopes) {
+    return -1;
+  }
+  GpuTiming timing;
+  timing.name     = name;
+  timing.parent   = frame.open_scope;
+  timing.depth    = (frame.open_scope < 0) ? 0 : frame.timings[frame.open_scope].depth + 1;
+  timing.begin_ns = 0;
+  timing.end_ns   = 0;
+
+  GLint index = (GLint)frame.timings.size();
+  frame.timings.push_back(timing);
+  frame.open_scope = index;
+  frame.pending    = true;
+  glQueryCounter(frame.queries[2 * index], GL_TIMESTAMP);
+  return index;
+}
+
+void GpuProfiler::EndScope(GLint index) {
+  if (index < 0) {
+    return;
   }
+  Frame &frame = Current();
+  assert(frame.open_scope == index && "GpuProfiler scopes must be properly nested");
+  glQueryCounter(frame.queries[2 * index + 1], GL_TIMESTAMP);
+  frame.open_scope = frame.timings[index].parent;
+  frame.last_query = 2 * index + 1;
+}
 
-  UNIFORM_VECTOR_SETTER_BY_NAME(1)
-  UNIFORM_VECTOR_SETTER_BY_NAME(2)
-  UNIFORM_VECTOR_SETTER_BY_NAME(3)
-  UNIFORM_VECTOR_SETTER_BY_NAME(4)
+void GpuProfiler::WriteChromeTrace(FILE *file) {
+  ChromeTraceWriter writer(file);
+  writer.Begin();
+  for (const GpuTiming &timing : captured) {
+    writer.CompleteEvent(timing.name,
+                         "gpu",
+                         0,
+                         0,
+                         timing.begin_ns / 1000.0,
+                         (timing.end_ns - timing.begin_ns) / 1000.0);
+  }
+  writer.End();
+  captured.clear();
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of GPU profiling
 
-#undef UNIFORM_VECTOR_SETTER_BY_NAME
+// Query objects {{{
 
-#define UNIFORM_MATRIX_SETTER_BY_NAME(DIMENSIONS)                                                 \
-  GLint Set##DIMENSIONS##UniformMat(                                                              \
-      const GLchar *uniform_name, GLsizei count, GLboolean transpose, const GLfloat *value_ptr) { \
-    GLint location = UniformLocation(uniform_name);                                               \
-    if (location >= 0) {                                                                          \
-      glUniformMatrix##DIMENSIONS##fv(location, count, transpose, value_ptr);                     \
-    }                                                                                             \
-    return location;                                                                              \
-  }
+/// OpenGL query object.
+///
+/// Results should be read only once ResultAvailable() is true, unless you
+/// really want Result() to wait for the GPU.
+class Query {
+ public:
+  GLuint id;
 
-  UNIFORM_MATRIX_SETTER_BY_NAME(2)
-  UNIFORM_MATRIX_SETTER_BY_NAME(3)
-  UNIFORM_MATRIX_SETTER_BY_NAME(4)
-  UNIFORM_MATRIX_SETTER_BY_NAME(2x3)
-  UNIFORM_MATRIX_SETTER_BY_NAME(3x2)
-  UNIFORM_MATRIX_SETTER_BY_NAME(2x4)
-  UNIFORM_MATRIX_SETTER_BY_NAME(4x2)
-  UNIFORM_MATRIX_SETTER_BY_NAME(3x4)
-  UNIFORM_MATRIX_SETTER_BY_NAME(4x3)
+  Query(GLuint id) : id(id) {}  // NOLINT
 
-#undef UNIFORM_MATRIX_SETTER_BY_NAME
+  Query() : id(0) {}
 
-  /// Sets a shader uniform variable.
-  ///
-  /// @return the location of the uniform variable of -1 in case of error
-  template <class T>
-  GLint SetVecUniform(const GLchar *uniform_name, const T &value) {
-    GLint location = UniformLocation(uniform_name);
-    if (location >= 0) {
-      SetVecUniform(location, value);
-    }
-    return location;
+  void Create() {
+    assert(id == 0);
+    glGenQueries(1, &id);
   }
 
-  /// Sets a shader uniform variable.
-  ///
-  /// @return the location of the uniform variable of -1 in case of error
-  template <class T>
-  GLint SetUniformMat(const GLchar *uniform_name, GLboolean transpose, const T &value) {
-    GLint location = UniformLocation(uniform_name);
-    if (location >= 0) {
-      SetUniformMat(location, transpose, value);
-    }
-    return location;
+  void Delete() { glDeleteQueries(1, &id); }
+
+  /// @param target GL_SAMPLES_PASSED, GL_ANY_SAMPLES_PASSED,
+  /// GL_ANY_SAMPLES_PASSED_CONSERVATIVE, GL_PRIMITIVES_GENERATED,
+  /// GL_TIME_ELAPSED, GL_VERTEX_SHADER_INVOCATIONS...
+  void Begin(GLenum target) { glBeginQuery(target, id); }
+
+  static void End(GLenum target) { glEndQuery(target); }
+
+  bool ResultAvailable() const {
+    GLint available;
+    glGetQueryObjectiv(id, GL_QUERY_RESULT_AVAILABLE, &available);
+    return available == GL_TRUE;
   }
 
-  /// Sets a shader uniform variable.
-  ///
-  /// @return the location of the uniform variable of -1 in case of error
-  template <class T>
-  GLint SetUniformMat(const GLchar *uniform_name, const T &value) {
-    GLint location = UniformLocation(uniform_name);
-    if (location >= 0) {
-      SetUniformMat(location, value);
-    }
-    return location;
+  /// Waits for the result if it's not available yet.
+  GLuint64 Result() const {
+    GLuint64 result;
+    glGetQueryObjectui64v(id, GL_QUERY_RESULT, &result);
+    return result;
   }
+};
 
-  // }}}
+/// Counters PassCounters can collect for each render pass.
+enum PassCounter {
+  kSamplesPassed,                // GL_SAMPLES_PASSED
+  kAnySamplesPassed,             // GL_ANY_SAMPLES_PASSED_CONSERVATIVE (GL 4.3)
+  kPrimitivesGenerated,          // GL_PRIMITIVES_GENERATED
+  kVertexShaderInvocations,      // ARB_pipeline_statistics_query (GL 4.6)
+  kFragmentShaderInvocations,    // ARB_pipeline_statistics_query (GL 4.6)
+  kPassCounterCount
 };
-// }}} END of OpenGL Shaders
 
-// OpenGL Textures {{{
+/// Counter values of one render pass. Counters that were not requested or
+/// are not supported are 0.
+struct PassCounterValues {
+  const char *name;
+  GLuint64 values[kPassCounterCount];
+};
 
-class Texture {
+/// Collects workload counters (samples passed, primitives generated, shader
+/// invocations...) per render pass.
+///
+/// Works like GpuProfiler: query objects are preallocated for
+/// `frames_in_flight` frames and results are only read once they're all
+/// available, dropping the frame instead of waiting if they're late. Only one
+/// query per target may be active at a time, so passes can't be nested.
+///
+/// kSamplesPassed and kAnySamplesPassed are both occlusion queries and GL
+/// allows only one active occlusion query, so Create() keeps kSamplesPassed
+/// when both are requested. For the same reason OcclusionCuller::TestBoxes()
+/// must not run inside a pass that counts samples.
+///
+///     PassCounters counters;
+///     counters.Create((1 << kSamplesPassed) | (1 << kFragmentShaderInvocations));
+///     ...
+///     counters.BeginFrame();
+///     counters.BeginPass("gbuffer");
+///     ...
+///     counters.EndPass();
+///     counters.EndFrame();
+///     for (const PassCounterValues &pass : counters.LastResolvedFrame()) { ... }
+class PassCounters {
  public:
-  GLuint id;
+  explicit PassCounters(GLint frames_in_flight = 4, GLint max_passes_per_frame = 32)
+      : frames(frames_in_flight),
+        max_passes(max_passes_per_frame),
+        counters_mask(0),
+        frame_index(0),
+        dropped_frames(0),
+        pass_open(false) {}
 
-  Texture() = default;
+  static GLenum Target(PassCounter counter);
 
-  Texture(GLuint id) : id(id) {}  // NOLINT
+  /// Whether the current context can collect `counter`.
+  static bool Supported(PassCounter counter);
 
-  void Gen() { glGenTextures(1, &id); }
+  /// Generate the query objects for the counters in `requested_mask` (bits
+  /// are 1 << PassCounter) that the context supports. kAnySamplesPassed is
+  /// dropped if kSamplesPassed is also requested.
+  void Create(unsigned requested_mask);
 
-  void Delete() { glDeleteTextures(1, &id); }
-};
+  void Delete();
 
-namespace detail {
+  unsigned CountersMask() const { return counters_mask; }
 
-template <GLenum kTarget, GLenum kBinding>
-class TextureCommonTemplate : public Texture {
- public:
-  TextureCommonTemplate() = default;
-  TextureCommonTemplate(GLuint id) : Texture(id) {}  // NOLINT
+  void BeginFrame();
 
-  void Bind() const { glBindTexture(kTarget, id); }
+  void EndFrame() { assert(!pass_open && "PassCounters::EndPass() missing"); }
 
-  void Unbind() const { glBindTexture(kTarget, 0); }
+  /// @return false if the frame already has `max_passes_per_frame` passes, in
+  /// which case the pass is not counted.
+  bool BeginPass(const char *name);
 
-  bool Bound() const {
-    GLint current_texture;
-    glGetIntegerv(kBinding, &current_texture);
-    return this->id && this->id == (GLuint)current_texture;
-  }
+  void EndPass();
 
-  template <typename T>
-  void SetParameter(GLenum pname, T param) {
-    assert(Bound());
-    detail::TexParameterSetterFn<T> setter;
-    setter(kTarget, pname, param);
+  const std::vector<PassCounterValues> &LastResolvedFrame() const { return last_resolved; }
+
+  GLuint64 DroppedFrames() const { return dropped_frames; }
+
+ private:
+  struct Frame {
+    std::vector<GLuint> queries;  // kPassCounterCount per pass
+    std::vector<PassCounterValues> passes;
+    bool pending;
+
+    Frame() : pending(false) {}
+  };
+
+  std::vector<Frame> frames;
+  GLint max_passes;
+  unsigned counters_mask;
+  GLuint64 frame_index;
+  GLuint64 dropped_frames;
+  bool pass_open;
+  std::vector<PassCounterValues> last_resolved;
+
+  Frame &Current() { return frames[frame_index % frames.size()]; }
+
+  bool TryResolve(Frame *frame);
+};
+
+#ifdef PROTO3D_IMPLEMENTATION
+GLenum PassCounters::Target(PassCounter counter) {
+  switch (counter) {
+    case kSamplesPassed:
+      return GL_SAMPLES_PASSED;
+    case kAnySamplesPassed:
+      return GL_ANY_SAMPLES_PASSED_CONSERVATIVE;
+    case kPrimitivesGenerated:
+      return GL_PRIMITIVES_GENERATED;
+    case kVertexShaderInvocations:
+      return GL_VERTEX_SHADER_INVOCATIONS_ARB;
+    case kFragmentShaderInvocations:
+      return GL_FRAGMENT_SHADER_INVOCATIONS_ARB;
+    default:
+      assert(false && "Invalid PassCounter");
+      return GL_ZERO;
   }
+}
 
-  template <typename T, typename InternalFormatT = GLfloat>
-  void SetVecParameter(GLenum pname, const T *params) {
-    assert(Bound());
-    detail::VecTexParameterSetterFn<T, InternalFormatT> setter;
-    setter(kTarget, pname, params);
+bool PassCounters::Supported(PassCounter counter) {
+  switch (counter) {
+    case kSamplesPassed:
+    case kPrimitivesGenerated:
+      return true;
+    case kAnySamplesPassed:
+      return HasVersion(4, 3) || HasExtension("GL_ARB_ES3_compatibility");
+    case kVertexShaderInvocations:
+    case kFragmentShaderInvocations:
+      return HasVersion(4, 6) || HasExtension("GL_ARB_pipeline_statistics_query");
+    default:
+      return false;
   }
-};
+}
 
-};  // namespace detail
+void PassCounters::Create(unsigned requested_mask) {
+  counters_mask = 0;
+  for (int counter = 0; counter < kPassCounterCount; counter++) {
+    if ((requested_mask & (1u << counter)) && Supported((PassCounter)counter)) {
+      counters_mask |= 1u << counter;
+    }
+  }
+  // Only one occlusion query can be active at a time
+  if (counters_mask & (1u << kSamplesPassed)) {
+    counters_mask &= ~(1u << kAnySamplesPassed);
+  }
+  for (Frame &frame : frames) {
+    frame.queries.resize(kPassCounterCount * max_passes);
+    glGenQueries((GLsizei)frame.queries.size(), frame.queries.data());
+    frame.passes.reserve(max_passes);
+  }
+}
 
-// Since OpenGL 1.1
-class Texture2D : public detail::TextureCommonTemplate<GL_TEXTURE_2D, GL_TEXTURE_BINDING_2D> {
- public:
-  Texture2D() = default;
-  Texture2D(GLuint id)  // NOLINT
-      : detail::TextureCommonTemplate<GL_TEXTURE_2D, GL_TEXTURE_BINDING_2D>(id) {}
+void PassCounters::Delete() {
+  for (Frame &frame : frames) {
+    glDeleteQueries((GLsizei)frame.queries.size(), frame.queries.data());
+    frame.queries.clear();
+  }
+}
 
-  /// Sets GL_TEXTURE_WRAP_(S|T) and GL_TEXTURE_(MIN|MAG)_FILTER
-  ///
-  /// @param wrap
-  ///   GL_CLAMP_TO_EDGE
-  ///   GL_CLAMP_TO_BORDER
-  ///   GL_REPEAT
-  ///   GL_MIRRORED_REPEAT.
-  ///
-  /// @param filter
-  ///  - `GL_NEAREST`: Returns the pixel that is closest to the coordinates.
-  ///  - `GL_LINEAR`:  Returns the weighted average of the 4 pixels surrounding the
-  ///    given coordinates.
-  ///  - `GL_NEAREST_MIPMAP_NEAREST`, `GL_LINEAR_MIPMAP_NEAREST`,
-  ///  `GL_NEAREST_MIPMAP_LINEAR`, `GL_LINEAR_MIPMAP_LINEAR`: Sample from mipmaps
-  ///  instead.
-  ///
-  void SetFilterAndWrap(GLint filter = GL_LINEAR, GLint wrap = GL_CLAMP_TO_EDGE) {
-    assert(Bound());
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap);
+bool PassCounters::TryResolve(Frame *frame) {
+  for (size_t pass = 0; pass < frame->passes.size(); pass++) {
+    for (int counter = 0; counter < kPassCounterCount; counter++) {
+      if ((counters_mask & (1u << counter)) &&
+          !Query(frame->queries[pass * kPassCounterCount + counter]).ResultAvailable()) {
+        return false;
+      }
+    }
+  }
+  for (size_t pass = 0; pass < frame->passes.size(); pass++) {
+    for (int counter = 0; counter < kPassCounterCount; counter++) {
+      frame->passes[pass].values[counter] =
+          (counters_mask & (1u << counter))
+              ? Query(frame->queries[pass * kPassCounterCount + counter]).Result()
+              : 0;
+    }
   }
+  frame->pending = false;
+  last_resolved.swap(frame->passes);
+  return true;
+}
 
-  void GenerateMipmaps() {
-    assert(Bound());
-    glGenerateMipmap(GL_TEXTURE_2D);
+void PassCounters::BeginFrame() {
+  for (size_t i = 1; i <= frames.size(); i++) {
+    Frame &frame = frames[(frame_index + i) % frames.size()];
+    if (frame.pending && !TryResolve(&frame)) {
+      break;
+    }
   }
 
-  /// @param pixels For format=GL_RGBA it's a GLubyte[width][height][4] matrix
-  void LoadImage(GLsizei width, GLsizei height, GLubyte *pixels, GLenum format = GL_RGBA) {
-    assert(Bound());
-    glTexImage2D(GL_TEXTURE_2D,  // target
-                 0,              // level (here the maximum level of detail)
-                 format,         // internalFormat (here the same as the image format)
-                 width,
-                 height,
-                 0,                 // border (spec says it should always be 0)
-                 format,            // format
-                 GL_UNSIGNED_BYTE,  // color component datatype
-                 pixels);
+  frame_index++;
+  Frame &frame = Current();
+  if (frame.pending) {
+    dropped_frames++;
+    frame.pending = false;
   }
+  frame.passes.clear();
+}
 
-#ifdef PROTO3D_USE_STB
-  /// Load an stb::Image into the texture
-  ///
-  /// @param level Specifies the level-of-detail number.  Level 0 is the base
-  /// image level.  Level n is the nth mipmap reduction image.
-  /// @param internal_format The texture internal format. It's the same as the
-  /// image format by default.
-  void LoadImage(proto3d::stb::Image *img,
-                 GLint level           = 0,
-                 GLint internal_format = GL_INVALID_VALUE) {
-    GLsizei width   = img->width;
-    GLsizei height  = img->height;
-    GLubyte *pixels = img->raw();
-    GLenum format   = img->GLPixelFormat();
+bool PassCounters::BeginPass(const char *name) {
+  assert(!pass_open && "PassCounters passes can't be nested");
+  Frame &frame = Current();
+  if ((GLint)frame.passes.size() >= max_passes) {
+    return false;
+  }
+  GLuint *queries = &frame.queries[frame.passes.size() * kPassCounterCount];
+  PassCounterValues pass;
+  pass.name = name;
+  frame.passes.push_back(pass);
+  for (int counter = 0; counter < kPassCounterCount; counter++) {
+    if (counters_mask & (1u << counter)) {
+      Query(queries[counter]).Begin(Target((PassCounter)counter));
+    }
+  }
+  frame.pending = true;
+  pass_open     = true;
+  return true;
+}
 
-    assert(Bound());
-    glTexImage2D(
-        GL_TEXTURE_2D,  // target
-        level,
-        (internal_format == GL_INVALID_VALUE) ? format : internal_format,  // internalFormat
-        width,
-        height,
-        0,                 // border (spec says it should always be 0)
-        format,            // format
-        GL_UNSIGNED_BYTE,  // color component datatype
-        pixels);
+void PassCounters::EndPass() {
+  if (!pass_open) {
+    return;
   }
-#endif  // PROTO3D_USE_STB
-};
+  for (int counter = 0; counter < kPassCounterCount; counter++) {
+    if (counters_mask & (1u << counter)) {
+      Query::End(Target((PassCounter)counter));
+    }
+  }
+  pass_open = false;
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Query objects
 
-class Textures {
- public:
-  GLuint *ids;
-  GLsizei size;
+// Occlusion culling {{{
 
-  Textures() : ids(nullptr), size(0) {}
+/// Skips draw calls of objects hidden behind occluders, without ever making
+/// the CPU wait for the GPU.
+///
+/// Every frame:
+///
+///  1. BeginOccluderPass() binds a low resolution depth-only framebuffer.
+///     Draw the big occluders (buildings, terrain...) depth-only.
+///  2. TestBoxes() draws the bounding box of every object into it with
+///     color and depth writes disabled, one GL_ANY_SAMPLES_PASSED query per
+///     box.
+///  3. EndOccluderPass() restores the previous framebuffer, viewport, depth
+///     test and depth mask.
+///  4. Wrap each object's draw calls in BeginConditionalRender(i) and
+///     EndConditionalRender(). They use GL_QUERY_NO_WAIT: if the result of a
+///     query isn't ready yet the object is simply drawn.
+///
+/// The box queries are occlusion queries, so TestBoxes() must not run inside a
+/// PassCounters pass that counts kSamplesPassed or kAnySamplesPassed.
+///
+/// The low resolution depth buffer is the coarse level of a depth hierarchy:
+/// occluders smaller than a texel may not occlude anything. Boxes that
+/// intersect the near plane are clipped and must not be culled, so draw those
+/// objects without conditional rendering.
+class OcclusionCuller {
+ public:
+  OcclusionCuller() : width(0), height(0), box_to_clip_location(-1) {}
+
+  /// @param width, height size of the occluder depth buffer (e.g. 256x128)
+  /// @param max_objects maximum number of boxes tested per frame
+  /// @return false if the box shaders fail to compile, in which case the
+  /// reason is written to `log`.
+  bool Create(GLsizei width, GLsizei height, GLsizei max_objects, InfoLog *log);
+
+  void Delete();
+
+  void BeginOccluderPass();
+
+  /// @param box_to_clip `count` column-major 4x4 matrices that map the
+  /// [-1, 1] cube to each object's bounding box in clip space, i.e.
+  /// projection * view * model * box.
+  void TestBoxes(const GLfloat *box_to_clip, GLsizei count);
+
+  void EndOccluderPass() {
+    glBindFramebuffer(GL_FRAMEBUFFER, previous_framebuffer);
+    glViewport(previous_viewport[0],
+               previous_viewport[1],
+               previous_viewport[2],
+               previous_viewport[3]);
+    if (!previous_depth_test) {
+      glDisable(GL_DEPTH_TEST);
+    }
+    glDepthMask(previous_depth_mask);
+  }
 
-  Textures(Texture *textures, GLsizei _size) : size(_size) {
-    ids = reinterpret_cast<GLuint *>(textures);
+  void BeginConditionalRender(GLsizei object) {
+    assert(object < (GLsizei)queries.size());
+    glBeginConditionalRender(queries[object].id, GL_QUERY_NO_WAIT);
   }
 
-  void Gen() { glGenTextures(size, ids); }
+  void EndConditionalRender() { glEndConditionalRender(); }
 
-  void Delete() { glDeleteTextures(size, ids); }
+ private:
+  GLsizei width;
+  GLsizei height;
+  Framebuffer framebuffer;
+  GLint previous_framebuffer;
+  GLint previous_viewport[4];
+  GLboolean previous_depth_test;
+  GLboolean previous_depth_mask;
+  Texture2D depth_texture;
+  VAO box_vao;
+  VBO box_vbo;
+  Program box_program;
+  GLint box_to_clip_location;
+  GLenum query_target;
+  std::vector<Query> queries;
 };
 
-class Textures2D : public Textures {
- public:
-  Textures2D() : Textures() {}
-
-  Textures2D(Texture2D *textures, GLsizei _size) : Textures(textures, _size) {}
+#ifdef PROTO3D_IMPLEMENTATION
+bool OcclusionCuller::Create(GLsizei width, GLsizei height, GLsizei max_objects, InfoLog *log) {
+  this->width  = width;
+  this->height = height;
+
+  // Depth-only shaders
+  const char *vertex_source =
+      "#version 330\n"
+      "uniform mat4 box_to_clip;\n"
+      "in vec3 position;\n"
+      "void main() { gl_Position = box_to_clip * vec4(position, 1.0); }\n";
+  const char *fragment_source =
+      "#version 330\n"
+      "void main() {}\n";
+  Shader shaders[2];
+  shaders[0].Create(GL_VERTEX_SHADER);
+  shaders[0].SetSource(vertex_source);
+  shaders[1].Create(GL_FRAGMENT_SHADER);
+  shaders[1].SetSource(fragment_source);
+  bool ok = shaders[0].Compile(log) && shaders[1].Compile(log);
+  if (ok) {
+    box_program.Create();
+    box_program.AttachShaders(shaders[0]);
+    box_program.AttachShaders(shaders[1]);
+    glBindAttribLocation(box_program.id, 0, "position");
+    ok = box_program.Link(log);
+    box_program.DetachShaders(shaders, 2);
+    if (!ok) {
+      box_program.Delete();
+    }
+  }
+  shaders[0].Delete();
+  shaders[1].Delete();
+  if (!ok) {
+    return false;
+  }
+  box_to_clip_location = box_program.UniformLocation("box_to_clip");
+
+  // Unit cube as a 14 vertex triangle strip
+  // clang-format off
+  static const GLfloat cube_strip[] = {
+     1,  1,  1,  -1,  1,  1,   1,  1, -1,  -1,  1, -1,  -1, -1, -1,
+    -1,  1,  1,  -1, -1,  1,   1,  1,  1,   1, -1,  1,   1,  1, -1,
+     1, -1, -1,  -1, -1, -1,   1, -1,  1,  -1, -1,  1
+  };
+  // clang-format on
+  box_vao.Create();
+  box_vao.Bind();
+  box_vbo = box_vao.AddArray(0, cube_strip, sizeof(cube_strip), VertexPointerFormat(3));
+  box_vao.Unbind();
+
+  // Low resolution depth target
+  depth_texture.Gen();
+  depth_texture.Bind();
+  depth_texture.SetFilterAndWrap(GL_NEAREST, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D,
+               0,
+               GL_DEPTH_COMPONENT24,
+               width,
+               height,
+               0,
+               GL_DEPTH_COMPONENT,
+               GL_UNSIGNED_INT,
+               nullptr);
+  detail::TrackBytes(kResourceTexture,
+                     depth_texture.id,
+                     (int64_t)width * height * detail::BytesPerTexel(GL_DEPTH_COMPONENT24));
+  depth_texture.Unbind();
+
+  GLint current_framebuffer;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &current_framebuffer);
+  framebuffer.Create();
+  framebuffer.Bind();
+  framebuffer.AttachTexture(GL_DEPTH_ATTACHMENT, depth_texture);
+  framebuffer.SetDrawBuffers(nullptr, 0);
+  assert(framebuffer.StatusString() == nullptr && "Incomplete occluder framebuffer");
+  glBindFramebuffer(GL_FRAMEBUFFER, current_framebuffer);
+
+  query_target = PassCounters::Supported(kAnySamplesPassed) ? GL_ANY_SAMPLES_PASSED_CONSERVATIVE
+                                                            : GL_ANY_SAMPLES_PASSED;
+  queries.resize(max_objects);
+  for (Query &query : queries) {
+    query.Create();
+  }
+  return true;
+}
 
-  void Unbind() const { glBindTexture(GL_TEXTURE_2D, 0); }
+void OcclusionCuller::Delete() {
+  for (Query &query : queries) {
+    query.Delete();
+  }
+  queries.clear();
+  framebuffer.Delete();
+  framebuffer = Framebuffer();
+  depth_texture.Delete();
+  box_vao.Delete();
+  box_vbo.Delete();
+  box_program.Delete();
+}
 
-  Texture2D operator[](GLsizei i) const { return this->ids[i]; }
+void OcclusionCuller::BeginOccluderPass() {
+  PROTO3D_PROFILE_SCOPE("OcclusionCuller::BeginOccluderPass");
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous_framebuffer);
+  glGetIntegerv(GL_VIEWPORT, previous_viewport);
+  previous_depth_test = glIsEnabled(GL_DEPTH_TEST);
+  glGetBooleanv(GL_DEPTH_WRITEMASK, &previous_depth_mask);
+  framebuffer.Bind();
+  glViewport(0, 0, width, height);
+  glDepthMask(GL_TRUE);
+  glClear(GL_DEPTH_BUFFER_BIT);
+  glEnable(GL_DEPTH_TEST);
+}
 
-  Texture2D &operator[](GLsizei i) { return reinterpret_cast<Texture2D &>(this->ids[i]); }
-};
-// }}} END of OpenGL Textures
+void OcclusionCuller::TestBoxes(const GLfloat *box_to_clip, GLsizei count) {
+  PROTO3D_PROFILE_SCOPE("OcclusionCuller::TestBoxes");
+  assert(count <= (GLsizei)queries.size());
+  GLboolean color_mask[4];
+  GLboolean depth_mask;
+  glGetBooleanv(GL_COLOR_WRITEMASK, color_mask);
+  glGetBooleanv(GL_DEPTH_WRITEMASK, &depth_mask);
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  glDepthMask(GL_FALSE);
+  // Boxes must be rasterized whichever side faces the camera
+  const GLboolean cull_face = glIsEnabled(GL_CULL_FACE);
+  glDisable(GL_CULL_FACE);
+  box_program.Use();
+  box_vao.Bind();
+  for (GLsizei i = 0; i < count; i++) {
+    box_program.SetUniformMat4(box_to_clip_location, 1, GL_FALSE, box_to_clip + 16 * i);
+    queries[i].Begin(query_target);
+    glDrawArrays(GL_TRIANGLE_STRIP, 0, 14);
+    Query::End(query_target);
+  }
+  box_vao.Unbind();
+  glColorMask(color_mask[0], color_mask[1], color_mask[2], color_mask[3]);
+  glDepthMask(depth_mask);
+  if (cull_face) {
+    glEnable(GL_CULL_FACE);
+  }
+}
+#endif  // PROTO3D_IMPLEMENTATION
+// }}} END of Occlusion culling
 
 namespace shader {
 // Shader Facade {{{
@@ -1514,6 +8741,26 @@ namespace gl {
 
 const char *LastErrorString() { return Proto3dGlLastErrorString(); }
 
+bool HasVersion(GLint major, GLint minor) {
+  GLint loaded_major, loaded_minor;
+  if (Proto3dGlLoadedVersion(&loaded_major, &loaded_minor) < 0) {
+    return false;
+  }
+  return loaded_major > major || (loaded_major == major && loaded_minor >= minor);
+}
+
+bool HasExtension(const char *extension) {
+  GLint count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (GLint i = 0; i < count; i++) {
+    const char *name = (const char *)glGetStringi(GL_EXTENSIONS, i);
+    if (name != nullptr && strcmp(name, extension) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
 const char *FramebufferStatusString() {
   switch (glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
     case GL_FRAMEBUFFER_INCOMPLETE_ATTACHMENT:
@@ -1537,7 +8784,37 @@ const char *FramebufferStatusString() {
   }
 }
 
+#ifdef PROTO3D_USE_RESOURCE_REGISTRY
+/// Check if we're leaking OpenGL objects by reporting every object still
+/// alive in the ResourceRegistry. Cheap enough for release builds.
+void CheckLeaks() {
+  ResourceRegistry &registry = ResourceRegistry::Global();
+  registry.ForEachLive([](const ResourceInfo &info) {
+    PROTO3D_TRACE("OpenGL: leaked %s handle %u (%" PRId64 " bytes) created at %s:%d\n",
+                  ResourceTypeName(info.type),
+                  (unsigned int)info.id,
+                  info.bytes,
+                  info.file ? info.file : "unknown",
+                  info.line);
+  });
+  if (registry.Untracked() > 0) {
+    PROTO3D_TRACE("OpenGL: %" PRId64 " objects did not fit in the resource registry\n",
+                  registry.Untracked());
+  }
+  for (int type = 0; type < kResourceTypeCount; type++) {
+    ResourceStats stats = registry.Live((ResourceType)type);
+    if (stats.count > 0) {
+      PROTO3D_TRACE("OpenGL: %" PRId64 " %s objects alive (%" PRId64 " bytes)\n",
+                    stats.count,
+                    ResourceTypeName((ResourceType)type),
+                    stats.bytes);
+    }
+  }
+  PROTO3D_TRACE("OpenGL: leak check done.\n");
+}
+#else
 /// Check if we're leaking OpenGL objects. Very inneficient, use for debug only.
+/// Define PROTO3D_USE_RESOURCE_REGISTRY for a fast version.
 ///
 /// Idea and implementation by @rygorous.
 void CheckLeaks() {
@@ -1554,6 +8831,7 @@ void CheckLeaks() {
     CHECK_GL_LEAK(Buffer);
     CHECK_GL_LEAK(Framebuffer);
     CHECK_GL_LEAK(Renderbuffer);
+    CHECK_GL_LEAK(Sampler);
     CHECK_GL_LEAK(VertexArray);
     CHECK_GL_LEAK(Shader);
     CHECK_GL_LEAK(Program);
@@ -1564,6 +8842,7 @@ void CheckLeaks() {
   PROTO3D_TRACE("OpenGL: leak check done.\n");
   glGetError();  // Reset GL error flag
 }
+#endif  // PROTO3D_USE_RESOURCE_REGISTRY
 
 }  // namespace gl
 
@@ -1589,9 +8868,9 @@ proto3d::gl::Shader Compile(GLenum shader_type, const char *source) {
   proto3d::gl::Shader shader;
   shader.Create(shader_type);
   shader.SetSource(source);
-  auto message = shader.Compile();
-  if (message != nullptr) {
-    throw std::runtime_error(std::string(message.get()));
+  auto log = InfoLog::ThreadLocal();
+  if (!shader.Compile(&log)) {
+    throw std::runtime_error(log.data);
   }
   return shader;
 }
@@ -1600,9 +8879,9 @@ proto3d::gl::Shader Compile(GLenum shader_type, GLsizei count, const char **sour
   proto3d::gl::Shader shader;
   shader.Create(shader_type);
   shader.SetSources(count, sources);
-  auto message = shader.Compile();
-  if (message != nullptr) {
-    throw std::runtime_error(std::string(message.get()));
+  auto log = InfoLog::ThreadLocal();
+  if (!shader.Compile(&log)) {
+    throw std::runtime_error(log.data);
   }
   return shader;
 }
@@ -1614,9 +8893,12 @@ template <class... Shaders>
 proto3d::gl::Program Link(Shaders... shaders) {
   proto3d::gl::Program program;
   program.Create();
-  auto message = program.template Link<Shaders...>(shaders...);
-  if (message != nullptr) {
-    throw std::runtime_error(std::string(message.get()));
+  program.AttachShaders(shaders...);
+  auto log    = InfoLog::ThreadLocal();
+  bool linked = program.Link(&log);
+  program.DetachShaders(shaders...);
+  if (!linked) {
+    throw std::runtime_error(log.data);
   }
   return program;
 }
@@ -1629,9 +8911,9 @@ proto3d::gl::Program Link(Shaders... shaders) {
 proto3d::gl::Program Link(proto3d::gl::Shader *shaders, int size) {
   proto3d::gl::Program program;
   program.Create();
-  auto message = program.template Link(shaders, size);
-  if (message != nullptr) {
-    throw std::runtime_error(std::string(message.get()));
+  auto log = InfoLog::ThreadLocal();
+  if (!program.Link(&log, shaders, size)) {
+    throw std::runtime_error(log.data);
   }
   return program;
 }
@@ -1644,11 +8926,14 @@ proto3d::gl::Program Link(proto3d::gl::Shader *shaders, int size) {
 proto3d::gl::Program CompileAndLink(GLenum shader_type, const char *source) {
   proto3d::gl::Program program;
   program.Create();
-  auto shader  = Compile(shader_type, source);
-  auto message = program.Link(shader);
+  auto shader = Compile(shader_type, source);
+  program.AttachShaders(shader);
+  auto log    = InfoLog::ThreadLocal();
+  bool linked = program.Link(&log);
+  program.DetachShaders(shader);
   shader.Delete();
-  if (message != nullptr) {
-    throw std::runtime_error(std::string(message.get()));
+  if (!linked) {
+    throw std::runtime_error(log.data);
   }
   return program;
 }
@@ -0,0 +1,889 @@
+// proto3d_render_server: headless batch rendering.
+//
+// Runs K worker threads, each owning its own surfaceless EGL context, that
+// take render jobs from a shared queue. A job draws an OBJ mesh from a camera
+// into a pooled render target and streams the pixels to a binary PPM file
+// through a ReadbackQueue, so a worker already draws the next job while the
+// GPU copies the previous one. Independent contexts let software rasterizers
+// like Mesa llvmpipe scale with the number of workers.
+//
+// Images larger than --tile-size (4096 by default) in either dimension, up to
+// 65536x65536 for print renders, are split into tiles with cropped projections
+// (see PosterLayout). The tiles are rendered in parallel by all the workers
+// and written into the memory mapped output file.
+//
+// A job is one line of text (paths relative to the server's working
+// directory, fovy in degrees, 45 by default):
+//
+//     scene.obj out.ppm width height eye_x eye_y eye_z target_x target_y target_z [fovy]
+//
+// Jobs come from either
+//
+//   --jobs-dir DIR  files named *.job in DIR, one job per line. A file is
+//                   claimed by renaming it to *.job.running and is renamed to
+//                   *.job.done (or *.job.failed) once its last image is on
+//                   disk. With --once, exits when DIR has no more jobs.
+//   --socket PATH   a UNIX stream socket. Every job line is answered with
+//                   "ok out.ppm" or "error out.ppm: reason" when it finishes.
+//
+// Usage: proto3d_render_server [--workers K] [--tile-size N] [--once]
+//                              (--jobs-dir DIR | --socket PATH)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define PROTO3D_GLCOREARB_IMPLEMENTATION
+#include "proto3d_glcorearb.h"
+#define PROTO3D_IMPLEMENTATION
+#include "proto3d.hpp"
+
+using namespace proto3d;
+using namespace proto3d::gl;
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void OnSignal(int) { g_stop = 1; }
+
+// Jobs {{{
+
+/// Where a job came from, told when the job is finished.
+class JobSource {
+ public:
+  virtual ~JobSource() {}
+
+  /// @param error nullptr if the image was written
+  virtual void Finished(const std::string &output, const char *error) = 0;
+};
+
+class Poster;
+
+struct Job {
+  std::string scene;
+  std::string output;
+  int width;
+  int height;
+  Vec4 eye;
+  Vec4 target;
+  float fovy;
+  std::shared_ptr<JobSource> source;
+  /// Set on the tiles of a job split by JobQueue::Submit(), which is then
+  /// also the `source`.
+  Poster *poster;
+  PosterTile tile;
+
+  Job() : poster(nullptr) {}
+};
+
+static int WritePpmHeader(char *header, size_t size, int width, int height) {
+  return snprintf(header, size, "P6\n%d %d\n255\n", width, height);
+}
+
+/// The output of a job too large for one render target. Its tile jobs write
+/// into the mapped file, and the job is finished when the last of them is
+/// destroyed.
+class Poster : public JobSource {
+ public:
+  PosterLayout layout;
+
+  /// @return nullptr if the output file can't be created, see `error`
+  static std::shared_ptr<Poster> Create(const Job &job, GLsizei tile_size, const char **error) {
+    std::shared_ptr<Poster> poster(new Poster());
+    poster->layout = PosterLayout{job.width, job.height, tile_size};
+    char header[64];
+    poster->header_bytes = WritePpmHeader(header, sizeof(header), job.width, job.height);
+    size_t size          = poster->header_bytes + (size_t)job.width * job.height * 3;
+    if (!poster->file.Create(job.output.c_str(), size)) {
+      *error = strerror(errno);
+      return nullptr;
+    }
+    memcpy(poster->file.data, header, poster->header_bytes);
+    poster->output = job.output;
+    poster->source = job.source;
+    return poster;
+  }
+
+  ~Poster() override {
+    if (source == nullptr) {
+      return;
+    }
+    bool written      = file.Close();
+    const char *error = first_error.load();
+    source->Finished(output, error != nullptr ? error : written ? nullptr : "write failed");
+  }
+
+  void Finished(const std::string &, const char *error) override {
+    const char *none = nullptr;
+    if (error != nullptr) {
+      first_error.compare_exchange_strong(none, error);
+    }
+  }
+
+  /// Copies the bottom-up rows of a tile into the image.
+  void WriteTile(const PosterTile &tile, const uint8_t *pixels, GLsizeiptr row_bytes) {
+    uint8_t *image = file.data + header_bytes;
+    for (GLsizei row = 0; row < tile.height; row++) {
+      const uint8_t *src = pixels + (tile.height - 1 - row) * row_bytes;
+      uint8_t *dst       = image + ((size_t)(tile.y + row) * layout.width + tile.x) * 3;
+      memcpy(dst, src, (size_t)tile.width * 3);
+    }
+  }
+
+ private:
+  Poster() : header_bytes(0), first_error(nullptr) {}
+
+  MappedOutputFile file;
+  int header_bytes;
+  std::string output;
+  std::shared_ptr<JobSource> source;
+  std::atomic<const char *> first_error;
+};
+
+/// @return nullptr on success or the reason `line` is not a job
+static const char *ParseJob(const char *line, Job *job) {
+  char scene[1024], output[1024];
+  float fovy = 45.0f;
+  int n      = sscanf(line,
+                 "%1023s %1023s %d %d %f %f %f %f %f %f %f",
+                 scene,
+                 output,
+                 &job->width,
+                 &job->height,
+                 &job->eye.x,
+                 &job->eye.y,
+                 &job->eye.z,
+                 &job->target.x,
+                 &job->target.y,
+                 &job->target.z,
+                 &fovy);
+  if (n < 10) {
+    return "expected: scene.obj out.ppm width height eye_xyz target_xyz [fovy]";
+  }
+  if (job->width <= 0 || job->height <= 0 || job->width > 65536 || job->height > 65536) {
+    return "invalid output size";
+  }
+  job->scene  = scene;
+  job->output = output;
+  job->fovy   = fovy * 3.14159265f / 180.0f;
+  return nullptr;
+}
+
+/// Jobs shared by the workers. Pop() blocks until a job is available or the
+/// queue is closed and empty.
+class JobQueue {
+ public:
+  explicit JobQueue(GLsizei tile_size) : tile_size(tile_size), closed(false), stopped(false) {}
+
+  /// Queues `job`, or its tiles if it's larger than `tile_size`.
+  void Submit(std::unique_ptr<Job> job) {
+    if (job->width <= tile_size && job->height <= tile_size) {
+      Push(std::move(job));
+      return;
+    }
+    const char *error;
+    std::shared_ptr<Poster> poster = Poster::Create(*job, tile_size, &error);
+    if (poster == nullptr) {
+      job->source->Finished(job->output, error);
+      return;
+    }
+    for (int i = 0; i < poster->layout.TileCount(); i++) {
+      std::unique_ptr<Job> tile(new Job(*job));
+      tile->source = poster;
+      tile->poster = poster.get();
+      tile->tile   = poster->layout.Tile(i);
+      Push(std::move(tile));
+    }
+  }
+
+  void Push(std::unique_ptr<Job> job) {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+    ready.notify_one();
+  }
+
+  std::unique_ptr<Job> Pop(bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (wait && jobs.empty() && !closed) {
+      ready.wait(lock);
+    }
+    if (jobs.empty() || stopped) {
+      return nullptr;
+    }
+    std::unique_ptr<Job> job = std::move(jobs.front());
+    jobs.pop_front();
+    return job;
+  }
+
+  /// Lets the workers return once the queue is empty.
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    ready.notify_all();
+  }
+
+  /// Closes the queue and makes Pop() return nullptr right away: the workers
+  /// finish the job they are rendering and leave the others queued.
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed  = true;
+    stopped = true;
+    ready.notify_all();
+  }
+
+  /// Answers every queued job with `error`.
+  void FailAll(const char *error) {
+    std::deque<std::unique_ptr<Job>> left;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      left.swap(jobs);
+    }
+    for (std::unique_ptr<Job> &job : left) {
+      job->source->Finished(job->output, error);
+    }
+  }
+
+  bool Empty() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return jobs.empty();
+  }
+
+ private:
+  GLsizei tile_size;
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<std::unique_ptr<Job>> jobs;
+  bool closed;
+  bool stopped;
+};
+// }}} END of Jobs
+
+// Job directory {{{
+
+/// A claimed *.job.running file, renamed when the last of its jobs is done,
+/// i.e. when the last Job holding it is destroyed.
+class JobFile : public JobSource {
+ public:
+  explicit JobFile(const std::string &running_path) : path(running_path), failed(false) {}
+
+  ~JobFile() override {
+    std::string base = path.substr(0, path.size() - strlen(".running"));
+    std::string done = base + (failed ? ".failed" : ".done");
+    if (rename(path.c_str(), done.c_str()) != 0) {
+      fprintf(stderr, "rename %s: %s\n", path.c_str(), strerror(errno));
+    }
+  }
+
+  void Finished(const std::string &output, const char *error) override {
+    if (error != nullptr) {
+      fprintf(stderr, "%s: %s: %s\n", path.c_str(), output.c_str(), error);
+      failed = true;
+    }
+  }
+
+  void Fail() { failed = true; }
+
+ private:
+  std::string path;
+  std::atomic<bool> failed;
+};
+
+/// Claims every *.job file of `dir` and queues its jobs.
+/// @return the number of files claimed
+static int ScanJobDirectory(const char *dir, JobQueue *queue) {
+  DIR *d = opendir(dir);
+  if (d == nullptr) {
+    fprintf(stderr, "opendir %s: %s\n", dir, strerror(errno));
+    return 0;
+  }
+  int claimed = 0;
+  while (struct dirent *entry = readdir(d)) {
+    size_t length = strlen(entry->d_name);
+    if (length <= 4 || strcmp(entry->d_name + length - 4, ".job") != 0) {
+      continue;
+    }
+    std::string path    = std::string(dir) + "/" + entry->d_name;
+    std::string running = path + ".running";
+    // rename() is atomic: if several servers share the directory, only one
+    // of them gets the file.
+    if (rename(path.c_str(), running.c_str()) != 0) {
+      continue;
+    }
+    claimed++;
+    std::shared_ptr<JobFile> file = std::make_shared<JobFile>(running);
+    FILE *f                       = fopen(running.c_str(), "r");
+    if (f == nullptr) {
+      file->Fail();
+      continue;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+      if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') {
+        continue;
+      }
+      std::unique_ptr<Job> job(new Job());
+      if (const char *error = ParseJob(line, job.get())) {
+        file->Finished(line, error);
+        continue;
+      }
+      job->source = file;
+      queue->Submit(std::move(job));
+    }
+    fclose(f);
+  }
+  closedir(d);
+  return claimed;
+}
+// }}} END of Job directory
+
+// Job socket {{{
+
+/// A client connection. The socket is closed once the client hung up and
+/// every job it sent is answered.
+class Connection : public JobSource {
+ public:
+  explicit Connection(int fd) : fd(fd) {}
+
+  ~Connection() override { close(fd); }
+
+  void Finished(const std::string &output, const char *error) override {
+    char reply[2048];
+    int length;
+    if (error == nullptr) {
+      length = snprintf(reply, sizeof(reply), "ok %s\n", output.c_str());
+    } else {
+      length = snprintf(reply, sizeof(reply), "error %s: %s\n", output.c_str(), error);
+    }
+    length = std::min(length, (int)sizeof(reply) - 1);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int written = 0; written < length;) {
+      ssize_t n = send(fd, reply + written, length - written, MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      written += (int)n;
+    }
+  }
+
+  /// Makes ReadJobs() return. Replies to the jobs already queued are still
+  /// sent.
+  void StopReading() { shutdown(fd, SHUT_RD); }
+
+  /// Reads job lines until the client shuts down its side of the socket or
+  /// StopReading() is called.
+  static void ReadJobs(std::shared_ptr<Connection> connection, JobQueue *queue) {
+    std::string pending;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(connection->fd, buffer, sizeof(buffer), 0)) > 0) {
+      pending.append(buffer, n);
+      size_t end;
+      while ((end = pending.find('\n')) != std::string::npos) {
+        std::string line = pending.substr(0, end);
+        pending.erase(0, end + 1);
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+          continue;
+        }
+        std::unique_ptr<Job> job(new Job());
+        if (const char *error = ParseJob(line.c_str(), job.get())) {
+          connection->Finished(line, error);
+          continue;
+        }
+        job->source = connection;
+        queue->Submit(std::move(job));
+      }
+    }
+  }
+
+ private:
+  int fd;
+  std::mutex mutex;
+};
+
+static int ListenUnixSocket(const char *path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);  // NOLINT
+  unlink(path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 16) != 0) {
+    fprintf(stderr, "socket %s: %s\n", path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+// }}} END of Job socket
+
+// Scenes {{{
+
+struct Mesh {
+  VAO vao;
+  VBO vbo;
+  GLsizei vertex_count;
+};
+
+/// Loads the triangles of an OBJ file ("v" and "f" lines, polygons are
+/// fanned) as flat shaded position + normal vertices.
+/// @return nullptr on success or the reason the file can't be used
+static const char *LoadObj(const char *path, std::vector<float> *vertices) {
+  FILE *f = fopen(path, "r");
+  if (f == nullptr) {
+    return "can't open the scene";
+  }
+  std::vector<Vec4> positions;
+  char line[4096];
+  const char *error = nullptr;
+  while (error == nullptr && fgets(line, sizeof(line), f) != nullptr) {
+    if (line[0] == 'v' && line[1] == ' ') {
+      Vec4 p;
+      if (sscanf(line + 2, "%f %f %f", &p.x, &p.y, &p.z) != 3) {
+        error = "invalid vertex";
+      }
+      positions.push_back(p);
+    } else if (line[0] == 'f' && line[1] == ' ') {
+      // Indices are 1-based or negative (relative to the last vertex), and
+      // may be followed by /texcoord/normal which are ignored.
+      int face[64], count = 0, value, consumed;
+      for (const char *s = line + 2; count < 64 && sscanf(s, " %d%n", &value, &consumed) == 1;) {
+        s += consumed;
+        s += strcspn(s, " \t\r\n");
+        int index = value < 0 ? (int)positions.size() + value : value - 1;
+        if (index < 0 || index >= (int)positions.size()) {
+          error = "face index out of range";
+          break;
+        }
+        face[count++] = index;
+      }
+      for (int i = 2; error == nullptr && i < count; i++) {
+        const Vec4 &a = positions[face[0]];
+        const Vec4 &b = positions[face[i - 1]];
+        const Vec4 &c = positions[face[i]];
+        Vec4 normal   = (b - a).Cross3(c - a);
+        float length  = sqrtf(normal.Dot(normal));
+        normal        = length > 0 ? normal * (1.0f / length) : Vec4(0, 0, 1, 0);
+        for (const Vec4 *p : {&a, &b, &c}) {
+          vertices->insert(vertices->end(), {p->x, p->y, p->z, normal.x, normal.y, normal.z});
+        }
+      }
+    }
+  }
+  fclose(f);
+  if (error == nullptr && vertices->empty()) {
+    error = "the scene has no triangles";
+  }
+  return error;
+}
+// }}} END of Scenes
+
+// Workers {{{
+
+static EGLDisplay g_display = EGL_NO_DISPLAY;
+
+static const char *kVertexSource =
+    "#version 330\n"
+    "uniform mat4 model_to_clip;\n"
+    "in vec3 position;\n"
+    "in vec3 normal;\n"
+    "out vec3 world_normal;\n"
+    "void main() {\n"
+    "  world_normal = normal;\n"
+    "  gl_Position  = model_to_clip * vec4(position, 1.0);\n"
+    "}\n";
+
+static const char *kFragmentSource =
+    "#version 330\n"
+    "in vec3 world_normal;\n"
+    "out vec4 color;\n"
+    "void main() {\n"
+    "  vec3 light = normalize(vec3(0.4, 0.8, 0.6));\n"
+    "  float lambert = abs(dot(normalize(world_normal), light));\n"
+    "  color = vec4(vec3(0.15 + 0.8 * lambert), 1.0);\n"
+    "}\n";
+
+/// A render thread with its own GL context, render targets and scenes.
+class Worker {
+ public:
+  Worker() : context(EGL_NO_CONTEXT), readback(3) {}
+
+  /// Creates and makes current the worker's context.
+  bool Init(InfoLog *log);
+
+  /// Renders jobs until the queue is closed and empty.
+  void Run(JobQueue *queue);
+
+  void Shutdown();
+
+ private:
+  void Render(std::unique_ptr<Job> job);
+
+  /// @return nullptr if the scene can't be loaded, see `error`
+  const Mesh *GetMesh(const std::string &path, const char **error);
+
+  void DeleteMeshes();
+
+  static void WriteImage(const ReadbackResult &result, void *user);
+
+  /// Scenes kept on the GPU between jobs
+  static const size_t kMaxMeshes = 32;
+
+  EGLContext context;
+  Program program;
+  GLint model_to_clip_location;
+  GLint max_size;
+  RenderTargetPool targets;
+  ReadbackQueue readback;
+  std::map<std::string, Mesh> meshes;
+};
+
+bool Worker::Init(InfoLog *log) {
+  EGLint context_attributes[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                 3,
+                                 EGL_CONTEXT_MINOR_VERSION,
+                                 3,
+                                 EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                 EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                 EGL_NONE};
+  // The current API is per thread
+  eglBindAPI(EGL_OPENGL_API);
+  context = eglCreateContext(g_display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attributes);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(g_display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    snprintf(log->data, log->size, "can't create a GL 3.3 context (EGL error 0x%x)", eglGetError());
+    return false;
+  }
+
+  // GL entry points are the same for every context, load them once.
+  static std::once_flag loaded;
+  static int load_result;
+  std::call_once(loaded, [] { load_result = Proto3dOpenLibGlAndLoadCoreProfile(); });
+  if (load_result != 0) {
+    snprintf(log->data, log->size, "can't load the OpenGL core profile");
+    return false;
+  }
+
+  Shader shaders[2];
+  shaders[0].Create(GL_VERTEX_SHADER);
+  shaders[0].SetSource(kVertexSource);
+  shaders[1].Create(GL_FRAGMENT_SHADER);
+  shaders[1].SetSource(kFragmentSource);
+  bool ok = shaders[0].Compile(log) && shaders[1].Compile(log);
+  if (ok) {
+    program.Create();
+    program.AttachShaders(shaders[0]);
+    program.AttachShaders(shaders[1]);
+    glBindAttribLocation(program.id, 0, "position");
+    glBindAttribLocation(program.id, 1, "normal");
+    ok = program.Link(log);
+    program.DetachShaders(shaders, 2);
+  }
+  shaders[0].Delete();
+  shaders[1].Delete();
+  if (!ok) {
+    return false;
+  }
+  model_to_clip_location = program.UniformLocation("model_to_clip");
+  glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+  readback.Create();
+  glEnable(GL_DEPTH_TEST);
+  return true;
+}
+
+void Worker::Run(JobQueue *queue) {
+  for (;;) {
+    // Don't sit on finished images while waiting for more work
+    std::unique_ptr<Job> job = queue->Pop(false);
+    if (job == nullptr) {
+      readback.Flush();
+      job = queue->Pop(true);
+      if (job == nullptr) {
+        return;
+      }
+    }
+    Render(std::move(job));
+    readback.Poll();
+    targets.EndFrame();
+  }
+}
+
+void Worker::Shutdown() {
+  readback.Flush();
+  readback.Delete();
+  targets.Delete();
+  DeleteMeshes();
+  program.Delete();
+  eglMakeCurrent(g_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(g_display, context);
+}
+
+void Worker::DeleteMeshes() {
+  for (auto &entry : meshes) {
+    entry.second.vbo.Delete();
+    entry.second.vao.Delete();
+  }
+  meshes.clear();
+}
+
+const Mesh *Worker::GetMesh(const std::string &path, const char **error) {
+  auto it = meshes.find(path);
+  if (it != meshes.end()) {
+    return &it->second;
+  }
+  if (meshes.size() >= kMaxMeshes) {
+    DeleteMeshes();
+  }
+  std::vector<float> vertices;
+  if ((*error = LoadObj(path.c_str(), &vertices)) != nullptr) {
+    return nullptr;
+  }
+  Mesh mesh;
+  mesh.vertex_count = (GLsizei)(vertices.size() / 6);
+  mesh.vao.Create();
+  mesh.vao.Bind();
+  mesh.vbo.Create();
+  mesh.vbo.Bind();
+  mesh.vbo.LoadBufferData(vertices.data(), vertices.size() * sizeof(float));
+  VertexPointerFormat format(3);
+  format.stride = 6 * sizeof(float);
+  mesh.vao.AddArray(0, mesh.vbo, format);
+  format.offset = 3 * sizeof(float);
+  mesh.vao.AddArray(1, mesh.vbo, format);
+  mesh.vao.Unbind();
+  mesh.vbo.Unbind();
+  return &(meshes[path] = mesh);
+}
+
+void Worker::Render(std::unique_ptr<Job> job) {
+  PROTO3D_PROFILE_SCOPE("Worker::Render");
+  const char *error = nullptr;
+  const Mesh *mesh  = GetMesh(job->scene, &error);
+  if (mesh == nullptr) {
+    job->source->Finished(job->output, error);
+    return;
+  }
+
+  GLsizei width  = job->poster != nullptr ? job->tile.width : job->width;
+  GLsizei height = job->poster != nullptr ? job->tile.height : job->height;
+  if (width > max_size || height > max_size) {
+    job->source->Finished(job->output, "larger than GL_MAX_TEXTURE_SIZE, lower --tile-size");
+    return;
+  }
+
+  RenderTarget color      = targets.Acquire({width, height, GL_RGBA8, 0});
+  RenderTarget depth      = targets.Acquire({width, height, GL_DEPTH_COMPONENT24, 0});
+  Framebuffer framebuffer = targets.GetFramebuffer(&color, 1, &depth);
+  framebuffer.Bind();
+  glViewport(0, 0, width, height);
+  glClearColor(0.1f, 0.1f, 0.12f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  Vec4 to_target  = job->target - job->eye;
+  float distance  = sqrtf(to_target.Dot(to_target));
+  Mat4 projection = Mat4::Perspective(
+      job->fovy, (float)job->width / job->height, distance * 0.01f, distance * 100.0f);
+  if (job->poster != nullptr) {
+    projection = job->poster->layout.Projection(projection, job->tile);
+  }
+  Mat4 view = Mat4::LookAt(job->eye, job->target, Vec4(0, 1, 0, 0));
+  program.Use();
+  program.SetUniformMat4(model_to_clip_location, projection * view);
+  mesh->vao.Bind();
+  glDrawArrays(GL_TRIANGLES, 0, mesh->vertex_count);
+  mesh->vao.Unbind();
+
+  // The targets can go back to the pool right away: later draws into them
+  // are ordered after this glReadPixels.
+  readback.Read(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, WriteImage, job.release());
+  framebuffer.Unbind();
+  targets.Release(color);
+  targets.Release(depth);
+}
+
+void Worker::WriteImage(const ReadbackResult &result, void *user) {
+  std::unique_ptr<Job> job(static_cast<Job *>(user));
+  if (result.pixels == nullptr) {
+    job->source->Finished(job->output, "readback failed");
+    return;
+  }
+  if (job->poster != nullptr) {
+    job->poster->WriteTile(
+        job->tile, static_cast<const uint8_t *>(result.pixels), result.row_bytes);
+    return;
+  }
+  FILE *f = fopen(job->output.c_str(), "wb");
+  if (f == nullptr) {
+    job->source->Finished(job->output, strerror(errno));
+    return;
+  }
+  // Straight from the mapped buffer, bottom-up rows flipped on the way out
+  char header[64];
+  fwrite(header, 1, WritePpmHeader(header, sizeof(header), result.width, result.height), f);
+  const char *pixels = static_cast<const char *>(result.pixels);
+  for (GLsizei y = result.height - 1; y >= 0; y--) {
+    fwrite(pixels + y * result.row_bytes, 3, result.width, f);
+  }
+  bool ok = !ferror(f);
+  ok      = (fclose(f) == 0) && ok;
+  job->source->Finished(job->output, ok ? nullptr : "write failed");
+}
+// }}} END of Workers
+
+static void PrintUsage() {
+  fprintf(stderr,
+          "Usage: proto3d_render_server [--workers K] [--tile-size N] [--once] "
+          "(--jobs-dir DIR | --socket PATH)\n");
+}
+
+int main(int argc, char **argv) {
+  const char *jobs_dir    = nullptr;
+  const char *socket_path = nullptr;
+  bool once               = false;
+  GLsizei tile_size       = 4096;
+  int worker_count        = (int)std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      worker_count = std::max(1, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+      tile_size = std::max(16, atoi(argv[++i]));
+    } else if (strcmp(argv[i], "--once") == 0) {
+      once = true;
+    } else if (strcmp(argv[i], "--jobs-dir") == 0 && i + 1 < argc) {
+      jobs_dir = argv[++i];
+    } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else {
+      PrintUsage();
+      return 1;
+    }
+  }
+  if ((jobs_dir == nullptr) == (socket_path == nullptr)) {
+    PrintUsage();
+    return 1;
+  }
+
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (get_platform_display != nullptr) {
+    g_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  }
+  if (g_display == EGL_NO_DISPLAY) {
+    g_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+  EGLint major, minor;
+  if (!eglInitialize(g_display, &major, &minor)) {
+    fprintf(stderr, "can't initialize EGL (error 0x%x)\n", eglGetError());
+    return 1;
+  }
+
+  signal(SIGINT, OnSignal);
+  signal(SIGTERM, OnSignal);
+
+  JobQueue queue(tile_size);
+  std::atomic<int> failed_workers(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < worker_count; i++) {
+    threads.emplace_back([&queue, &failed_workers] {
+      Worker worker;
+      InfoLog log = InfoLog::ThreadLocal();
+      if (!worker.Init(&log)) {
+        fprintf(stderr, "worker: %s\n", log.data);
+        failed_workers++;
+        return;
+      }
+      worker.Run(&queue);
+      worker.Shutdown();
+    });
+  }
+
+  if (jobs_dir != nullptr) {
+    while (!g_stop && failed_workers < worker_count) {
+      if (ScanJobDirectory(jobs_dir, &queue) == 0) {
+        if (once && queue.Empty()) {
+          break;
+        }
+        usleep(200 * 1000);
+      }
+    }
+  } else {
+    // Reader threads submit to `queue`, they must all be joined before it
+    // goes away. A connection expires once its reader returned and its jobs
+    // are answered.
+    struct Reader {
+      std::thread thread;
+      std::weak_ptr<Connection> connection;
+    };
+    std::vector<Reader> readers;
+    int listen_fd = ListenUnixSocket(socket_path);
+    if (listen_fd < 0) {
+      g_stop = 1;
+    }
+    while (!g_stop && failed_workers < worker_count) {
+      for (size_t i = 0; i < readers.size();) {
+        if (readers[i].connection.expired()) {
+          readers[i].thread.join();
+          readers[i] = std::move(readers.back());
+          readers.pop_back();
+        } else {
+          i++;
+        }
+      }
+      pollfd listening = {listen_fd, POLLIN, 0};
+      if (poll(&listening, 1, 200) <= 0) {
+        continue;
+      }
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0) {
+        std::shared_ptr<Connection> connection = std::make_shared<Connection>(fd);
+        readers.push_back(
+            Reader{std::thread(Connection::ReadJobs, connection, &queue), connection});
+      }
+    }
+    if (listen_fd >= 0) {
+      close(listen_fd);
+      unlink(socket_path);
+    }
+    for (Reader &reader : readers) {
+      if (std::shared_ptr<Connection> connection = reader.connection.lock()) {
+        connection->StopReading();
+      }
+      reader.thread.join();
+    }
+  }
+
+  // Interrupted: the workers drop the queued jobs after their current one.
+  // Otherwise they drain the queue.
+  if (g_stop) {
+    queue.Stop();
+  } else {
+    queue.Close();
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  // Left if the server was interrupted or every worker failed
+  queue.FailAll("server stopped");
+  eglTerminate(g_display);
+  return failed_workers == worker_count ? 1 : 0;
+}
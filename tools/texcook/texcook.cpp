@@ -0,0 +1,430 @@
+// proto3d_texcook: offline texture cooking.
+//
+// Decodes an image with stb_image, builds its mip chain on the CPU (linear
+// light for sRGB images), optionally block-compresses every level and writes
+// a KTX2 file. At runtime the file is mapped and uploaded with one call per
+// mip level:
+//
+//     CompressedTexture2D texture;
+//     texture.Gen();
+//     texture.Bind();
+//     const char *error = texture.LoadFile("rock.ktx2");
+//
+// Usage: proto3d_texcook [--srgb] [--bc] [--filter box|triangle|kaiser]
+//                        [--no-mips] input.png output.ktx2
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define PROTO3D_GLCOREARB_IMPLEMENTATION
+#include "proto3d_glcorearb.h"
+#define PROTO3D_IMPLEMENTATION
+#include "proto3d.hpp"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+using namespace proto3d;
+
+#ifndef PROTO3D_USE_STB
+#error "proto3d_texcook needs PROTO3D_USE_STB"
+#endif
+
+struct Options {
+  const char *input;
+  const char *output;
+  bool srgb;
+  bool block_compress;
+  bool mips;
+  MipFilter filter;
+};
+
+// Block compression {{{
+
+// Fast bounding box encoders, good enough for color and mask textures. Each
+// takes a 4x4 block of RGBA8 texels.
+
+static uint16_t PackRGB565(const int c[3]) {
+  return (uint16_t)(((c[0] * 31 + 127) / 255) << 11 | ((c[1] * 63 + 127) / 255) << 5 |
+                    ((c[2] * 31 + 127) / 255));
+}
+
+static void UnpackRGB565(uint16_t packed, int c[3]) {
+  int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+  c[0] = (r << 3) | (r >> 2);
+  c[1] = (g << 2) | (g >> 4);
+  c[2] = (b << 3) | (b >> 2);
+}
+
+// BC1 color block, always in 4-color mode so it can be reused by BC3
+static void EncodeBC1(const uint8_t texels[16][4], uint8_t out[8]) {
+  int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+  float mean[3] = {0, 0, 0};
+  for (int i = 0; i < 16; i++) {
+    for (int k = 0; k < 3; k++) {
+      lo[k] = std::min(lo[k], (int)texels[i][k]);
+      hi[k] = std::max(hi[k], (int)texels[i][k]);
+      mean[k] += texels[i][k] / 16.0f;
+    }
+  }
+  // Pick the bounding box diagonal that follows the green covariance
+  float cov_rg = 0, cov_bg = 0;
+  for (int i = 0; i < 16; i++) {
+    cov_rg += (texels[i][0] - mean[0]) * (texels[i][1] - mean[1]);
+    cov_bg += (texels[i][2] - mean[2]) * (texels[i][1] - mean[1]);
+  }
+  if (cov_rg < 0) {
+    std::swap(lo[0], hi[0]);
+  }
+  if (cov_bg < 0) {
+    std::swap(lo[2], hi[2]);
+  }
+  // Inset the endpoints a little, the extremes are rarely the best fit
+  for (int k = 0; k < 3; k++) {
+    int inset = (hi[k] - lo[k]) / 16;
+    hi[k] -= inset;
+    lo[k] += inset;
+  }
+  uint16_t c0 = PackRGB565(hi), c1 = PackRGB565(lo);
+  if (c0 < c1) {
+    std::swap(c0, c1);
+  }
+  int palette[4][3];
+  UnpackRGB565(c0, palette[0]);
+  UnpackRGB565(c1, palette[1]);
+  for (int k = 0; k < 3; k++) {
+    palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+    palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+  }
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    for (int i = 0; i < 16; i++) {
+      int best = 0, best_distance = 1 << 30;
+      for (int p = 0; p < 4; p++) {
+        int distance = 0;
+        for (int k = 0; k < 3; k++) {
+          int d = texels[i][k] - palette[p][k];
+          distance += d * d;
+        }
+        if (distance < best_distance) {
+          best          = p;
+          best_distance = distance;
+        }
+      }
+      indices |= (uint32_t)best << (2 * i);
+    }
+  }
+  out[0] = (uint8_t)c0;
+  out[1] = (uint8_t)(c0 >> 8);
+  out[2] = (uint8_t)c1;
+  out[3] = (uint8_t)(c1 >> 8);
+  memcpy(out + 4, &indices, 4);  // little-endian hosts only
+}
+
+// BC4 block of `channel`, in 8 value mode
+static void EncodeBC4(const uint8_t texels[16][4], int channel, uint8_t out[8]) {
+  int lo = 255, hi = 0;
+  for (int i = 0; i < 16; i++) {
+    lo = std::min(lo, (int)texels[i][channel]);
+    hi = std::max(hi, (int)texels[i][channel]);
+  }
+  int palette[8] = {hi, lo};
+  for (int p = 1; p < 7; p++) {
+    palette[p + 1] = ((7 - p) * hi + p * lo) / 7;
+  }
+  uint64_t indices = 0;
+  if (hi != lo) {
+    for (int i = 0; i < 16; i++) {
+      int best = 0, best_distance = 256;
+      for (int p = 0; p < 8; p++) {
+        int distance = std::abs(texels[i][channel] - palette[p]);
+        if (distance < best_distance) {
+          best          = p;
+          best_distance = distance;
+        }
+      }
+      indices |= (uint64_t)best << (3 * i);
+    }
+  }
+  out[0] = (uint8_t)hi;
+  out[1] = (uint8_t)lo;
+  for (int b = 0; b < 6; b++) {
+    out[2 + b] = (uint8_t)(indices >> (8 * b));
+  }
+}
+
+// Compresses a level with BC4 (1 component), BC5 (2), BC1 (3) or BC3 (4)
+static std::vector<uint8_t> CompressLevel(const MipLevel &level, int components) {
+  int blocks_x = (level.width + 3) / 4, blocks_y = (level.height + 3) / 4;
+  int block_bytes = (components == 1 || components == 3) ? 8 : 16;
+  std::vector<uint8_t> out((size_t)blocks_x * blocks_y * block_bytes);
+  uint8_t *dst = out.data();
+  for (int by = 0; by < blocks_y; by++) {
+    for (int bx = 0; bx < blocks_x; bx++, dst += block_bytes) {
+      // Gather the block as RGBA, replicating the edges of small levels
+      uint8_t texels[16][4];
+      for (int i = 0; i < 16; i++) {
+        int x            = std::min(bx * 4 + i % 4, level.width - 1);
+        int y            = std::min(by * 4 + i / 4, level.height - 1);
+        const uint8_t *p = &level.pixels[((size_t)y * level.width + x) * components];
+        for (int k = 0; k < 4; k++) {
+          texels[i][k] = k < components ? p[k] : (k == 3 ? 255 : 0);
+        }
+      }
+      switch (components) {
+        case 1:
+          EncodeBC4(texels, 0, dst);
+          break;
+        case 2:
+          EncodeBC4(texels, 0, dst);
+          EncodeBC4(texels, 1, dst + 8);
+          break;
+        case 3:
+          EncodeBC1(texels, dst);
+          break;
+        default:
+          EncodeBC4(texels, 3, dst);
+          EncodeBC1(texels, dst + 8);
+          break;
+      }
+    }
+  }
+  return out;
+}
+// }}} END of Block compression
+
+// KTX2 output {{{
+
+static void PutU16(std::vector<uint8_t> *out, uint32_t v) {
+  out->push_back((uint8_t)v);
+  out->push_back((uint8_t)(v >> 8));
+}
+
+static void PutU32(std::vector<uint8_t> *out, uint32_t v) {
+  PutU16(out, v);
+  PutU16(out, v >> 16);
+}
+
+static void PutU64(std::vector<uint8_t> *out, uint64_t v) {
+  PutU32(out, (uint32_t)v);
+  PutU32(out, (uint32_t)(v >> 32));
+}
+
+static void SetU64(std::vector<uint8_t> *out, size_t offset, uint64_t v) {
+  for (int b = 0; b < 8; b++) {
+    (*out)[offset + b] = (uint8_t)(v >> (8 * b));
+  }
+}
+
+// VkFormat and the basic data format descriptor (KTX2 requires one) of the
+// cooked levels
+struct Ktx2Format {
+  uint32_t vk_format;
+  uint32_t block_bytes;
+  std::vector<uint8_t> dfd;
+};
+
+static Ktx2Format DescribeFormat(int components, bool srgb, bool block_compress) {
+  // Color sRGB only applies to RGB(A) images, as in GenerateMipChain()
+  srgb = srgb && components >= 3;
+  struct Sample {
+    uint32_t bit_offset, bit_length, channel;
+  };
+  std::vector<Sample> samples;
+  Ktx2Format format;
+  uint8_t color_model, block_dimension;
+  if (block_compress) {
+    static const uint32_t kVkFormats[4][2] = {{139, 139}, {141, 141}, {131, 132}, {137, 138}};
+    static const uint8_t kColorModels[4]   = {131, 132, 128, 130};  // KHR_DF_MODEL_BCn
+    format.vk_format   = kVkFormats[components - 1][srgb];
+    format.block_bytes = (components == 1 || components == 3) ? 8 : 16;
+    color_model        = kColorModels[components - 1];
+    block_dimension    = 3;  // 4x4 texels
+    if (components == 4) {
+      samples.push_back(Sample{0, 64, 15});
+      samples.push_back(Sample{64, 64, 0});
+    } else {
+      for (uint32_t c = 0; c < format.block_bytes / 8; c++) {
+        samples.push_back(Sample{64 * c, 64, c});
+      }
+    }
+  } else {
+    static const uint32_t kVkFormats[4][2] = {{9, 9}, {16, 16}, {23, 29}, {37, 43}};
+    format.vk_format   = kVkFormats[components - 1][srgb];
+    format.block_bytes = (uint32_t)components;
+    color_model        = 1;  // KHR_DF_MODEL_RGBSDA
+    block_dimension    = 0;
+    for (int c = 0; c < components; c++) {
+      samples.push_back(Sample{8u * c, 8, c == 3 ? 15u : (uint32_t)c});
+    }
+  }
+  std::vector<uint8_t> &dfd = format.dfd;
+  uint32_t block_size       = 24 + 16 * (uint32_t)samples.size();
+  PutU32(&dfd, 4 + block_size);  // dfdTotalSize
+  PutU32(&dfd, 0);               // vendorId = Khronos, descriptorType = basic
+  PutU16(&dfd, 2);               // versionNumber
+  PutU16(&dfd, block_size);
+  dfd.push_back(color_model);
+  dfd.push_back(1);             // colorPrimaries = BT.709
+  dfd.push_back(srgb ? 2 : 1);  // transferFunction = sRGB or linear
+  dfd.push_back(0);             // flags = straight alpha
+  for (int i = 0; i < 4; i++) {
+    dfd.push_back(i < 2 ? block_dimension : 0);
+  }
+  dfd.push_back((uint8_t)format.block_bytes);  // bytesPlane0
+  for (int i = 1; i < 8; i++) {
+    dfd.push_back(0);
+  }
+  for (const Sample &sample : samples) {
+    // Alpha stays linear in sRGB formats
+    uint32_t qualifiers = (srgb && sample.channel == 15) ? 0x10 : 0;
+    PutU16(&dfd, sample.bit_offset);
+    dfd.push_back((uint8_t)(sample.bit_length - 1));
+    dfd.push_back((uint8_t)(sample.channel | qualifiers));
+    PutU32(&dfd, 0);  // samplePosition
+    PutU32(&dfd, 0);  // sampleLower
+    PutU32(&dfd, block_compress ? 0xFFFFFFFFu : 255u);
+  }
+  return format;
+}
+
+static bool WriteKtx2(const char *path,
+                      const Ktx2Format &format,
+                      int width,
+                      int height,
+                      const std::vector<std::vector<uint8_t>> &levels) {
+  static const uint8_t kMagic[12] = {
+      0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n'};
+  std::vector<uint8_t> out(kMagic, kMagic + sizeof(kMagic));
+  uint32_t level_count = (uint32_t)levels.size();
+  PutU32(&out, format.vk_format);
+  PutU32(&out, 1);  // typeSize
+  PutU32(&out, (uint32_t)width);
+  PutU32(&out, (uint32_t)height);
+  PutU32(&out, 0);  // pixelDepth
+  PutU32(&out, 0);  // layerCount
+  PutU32(&out, 1);  // faceCount
+  PutU32(&out, level_count);
+  PutU32(&out, 0);  // supercompressionScheme
+  uint32_t dfd_offset = 80 + 24 * level_count;
+  PutU32(&out, dfd_offset);
+  PutU32(&out, (uint32_t)format.dfd.size());
+  PutU32(&out, 0);  // kvdByteOffset
+  PutU32(&out, 0);  // kvdByteLength
+  PutU64(&out, 0);  // sgdByteOffset
+  PutU64(&out, 0);  // sgdByteLength
+  size_t level_index = out.size();
+  out.resize(out.size() + 24 * level_count, 0);
+  out.insert(out.end(), format.dfd.begin(), format.dfd.end());
+
+  // Levels are stored from the smallest, each aligned to
+  // lcm(texel block size, 4)
+  uint32_t alignment = format.block_bytes;
+  while (alignment % 4 != 0) {
+    alignment += format.block_bytes;
+  }
+  for (uint32_t level = level_count; level-- > 0;) {
+    while (out.size() % alignment != 0) {
+      out.push_back(0);
+    }
+    size_t entry = level_index + 24 * level;
+    SetU64(&out, entry, out.size());
+    SetU64(&out, entry + 8, levels[level].size());
+    SetU64(&out, entry + 16, levels[level].size());
+    out.insert(out.end(), levels[level].begin(), levels[level].end());
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+  return fclose(file) == 0 && ok;
+}
+// }}} END of KTX2 output
+
+static bool ParseArgs(int argc, char **argv, Options *options) {
+  options->input          = nullptr;
+  options->output         = nullptr;
+  options->srgb           = false;
+  options->block_compress = false;
+  options->mips           = true;
+  options->filter         = kMipFilterKaiser;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--srgb") == 0) {
+      options->srgb = true;
+    } else if (strcmp(argv[i], "--bc") == 0) {
+      options->block_compress = true;
+    } else if (strcmp(argv[i], "--no-mips") == 0) {
+      options->mips = false;
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "box") == 0) {
+        options->filter = kMipFilterBox;
+      } else if (strcmp(argv[i], "kaiser") == 0) {
+        options->filter = kMipFilterKaiser;
+      } else if (strcmp(argv[i], "triangle") == 0) {
+        options->filter = kMipFilterTriangle;
+      } else {
+        return false;
+      }
+    } else if (options->input == nullptr) {
+      options->input = argv[i];
+    } else if (options->output == nullptr) {
+      options->output = argv[i];
+    } else {
+      return false;
+    }
+  }
+  return options->output != nullptr;
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  if (!ParseArgs(argc, argv, &options)) {
+    fprintf(stderr,
+            "usage: %s [--srgb] [--bc] [--filter box|triangle|kaiser] [--no-mips] input output\n"
+            "  --srgb     color channels are sRGB, filter them in linear light\n"
+            "  --bc       compress to BC4 (grey), BC5 (grey-alpha), BC1 (RGB) or BC3 (RGBA)\n"
+            "  --filter   mip filter, kaiser by default\n"
+            "  --no-mips  only write the base level\n",
+            argv[0]);
+    return 1;
+  }
+
+  auto image = stb::Image::CreateFromFile(options.input, STBI_default);
+  if (image == nullptr) {
+    fprintf(stderr, "Can't load %s: %s\n", options.input, stbi_failure_reason());
+    return 1;
+  }
+  int components = image->pixel_format;
+
+  std::vector<MipLevel> mips;
+  if (options.mips) {
+    ThreadPool pool;
+    pool.Create();
+    GenerateMipChain(image->raw(),
+                     image->width,
+                     image->height,
+                     components,
+                     options.srgb,
+                     options.filter,
+                     &mips,
+                     &pool);
+  } else {
+    mips.push_back(MipLevel{image->width, image->height, std::vector<uint8_t>()});
+    mips[0].pixels.assign(image->raw(),
+                          image->raw() + (size_t)image->width * image->height * components);
+  }
+
+  std::vector<std::vector<uint8_t>> levels;
+  for (const MipLevel &mip : mips) {
+    levels.push_back(options.block_compress ? CompressLevel(mip, components) : mip.pixels);
+  }
+  Ktx2Format format = DescribeFormat(components, options.srgb, options.block_compress);
+  if (!WriteKtx2(options.output, format, image->width, image->height, levels)) {
+    fprintf(stderr, "Can't write %s\n", options.output);
+    return 1;
+  }
+  return 0;
+}